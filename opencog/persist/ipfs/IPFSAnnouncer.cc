@@ -0,0 +1,278 @@
+/*
+ * IPFSAnnouncer.cc
+ * Announcement of new AtomSpace roots to other storage instances.
+ *
+ * The ipfs-http-client has no calls for pubsub, so curl is used
+ * directly, as for `dag/export`.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <stdio.h>
+
+#include <chrono>
+#include <map>
+#include <set>
+
+#include <curl/curl.h>
+#include <ipfs/client.h>
+
+#include <opencog/util/exceptions.h>
+
+#include "IPFSAnnouncer.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+
+/// Pubsub messages arrive with base64-encoded data.
+static std::string base64_decode(const std::string& in)
+{
+	static const std::string alpha =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	unsigned int acc = 0;
+	int nbits = 0;
+	for (char c: in)
+	{
+		size_t v = alpha.find(c);
+		if (std::string::npos == v) break;
+		acc = (acc << 6) | v;
+		nbits += 6;
+		if (8 <= nbits)
+		{
+			nbits -= 8;
+			out.push_back((char) ((acc >> nbits) & 0xff));
+		}
+	}
+	return out;
+}
+
+static size_t ignore_write(char*, size_t size, size_t nmemb, void*)
+{
+	return size * nmemb;
+}
+
+/* ================================================================ */
+
+IPFSPubsubAnnouncer::IPFSPubsubAnnouncer(const std::string& host, int port) :
+	_keep_going(false)
+{
+	_url = "http://" + host + ":" + std::to_string(port) + "/api/v0/pubsub/";
+}
+
+IPFSPubsubAnnouncer::~IPFSPubsubAnnouncer()
+{
+	unsubscribe();
+}
+
+void IPFSPubsubAnnouncer::announce(const std::string& topic,
+                                   const std::string& msg)
+{
+	CURL* curl = curl_easy_init();
+	if (nullptr == curl)
+		throw IOException(TRACE_INFO, "Unable to create curl handle\n");
+
+	char* etopic = curl_easy_escape(curl, topic.c_str(), topic.size());
+	char* emsg = curl_easy_escape(curl, msg.c_str(), msg.size());
+	std::string url = _url + "pub?arg=" + etopic + "&arg=" + emsg;
+	curl_free(etopic);
+	curl_free(emsg);
+
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, ignore_write);
+	CURLcode rc = curl_easy_perform(curl);
+	long status = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+	curl_easy_cleanup(curl);
+
+	if (CURLE_OK != rc)
+		throw IOException(TRACE_INFO, "pubsub/pub on %s failed: %s\n",
+		                  topic.c_str(), curl_easy_strerror(rc));
+	if (200 != status)
+		throw IOException(TRACE_INFO, "pubsub/pub on %s failed: HTTP %ld\n",
+		                  topic.c_str(), status);
+}
+
+void IPFSPubsubAnnouncer::subscribe(const std::string& topic,
+                                    const Callback& cb)
+{
+	unsubscribe();
+	_topic = topic;
+	_callback = cb;
+	_keep_going = true;
+	_thread = std::thread(sub_thread, this);
+}
+
+/// Stop listening. Curl checks for this about once a second, even
+/// when nothing is arriving.
+void IPFSPubsubAnnouncer::unsubscribe(void)
+{
+	_keep_going = false;
+	if (_thread.joinable()) _thread.join();
+}
+
+/// Each message is one line of json, with the data in base64.
+void IPFSPubsubAnnouncer::deliver(const std::string& line)
+{
+	try
+	{
+		ipfs::Json msg = ipfs::Json::parse(line);
+		auto data = msg.find("data");
+		if (msg.end() == data) return;
+		_callback(base64_decode(data->get<std::string>()));
+	}
+	catch (const std::exception& ex)
+	{
+		fprintf(stderr, "Bad announcement on %s: %s\n",
+		        _topic.c_str(), ex.what());
+	}
+}
+
+size_t IPFSPubsubAnnouncer::sub_write(char* ptr, size_t size,
+                                      size_t nmemb, void* userdata)
+{
+	IPFSPubsubAnnouncer* self = (IPFSPubsubAnnouncer*) userdata;
+	self->_partial.append(ptr, size * nmemb);
+
+	size_t nl;
+	while (std::string::npos != (nl = self->_partial.find('\n')))
+	{
+		std::string line = self->_partial.substr(0, nl);
+		self->_partial.erase(0, nl + 1);
+		if (0 < line.size()) self->deliver(line);
+	}
+	return size * nmemb;
+}
+
+int IPFSPubsubAnnouncer::sub_progress(void* userdata, long, long, long, long)
+{
+	IPFSPubsubAnnouncer* self = (IPFSPubsubAnnouncer*) userdata;
+	return self->_keep_going ? 0 : 1;
+}
+
+/// Listen to the topic, for as long as we are subscribed. If the
+/// daemon goes away, keep trying, once a second.
+void IPFSPubsubAnnouncer::sub_thread(IPFSPubsubAnnouncer* self)
+{
+	while (self->_keep_going)
+	{
+		CURL* curl = curl_easy_init();
+		if (nullptr == curl) break;
+
+		char* etopic = curl_easy_escape(curl, self->_topic.c_str(),
+		                                self->_topic.size());
+		std::string url = self->_url + "sub?arg=" + etopic;
+		curl_free(etopic);
+
+		self->_partial.clear();
+		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+		curl_easy_setopt(curl, CURLOPT_POST, 1L);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sub_write);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, self);
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+		curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, sub_progress);
+		curl_easy_setopt(curl, CURLOPT_XFERINFODATA, self);
+		CURLcode rc = curl_easy_perform(curl);
+		curl_easy_cleanup(curl);
+
+		if (not self->_keep_going) break;
+		fprintf(stderr, "Lost pubsub subscription to %s: %s\n",
+		        self->_topic.c_str(), curl_easy_strerror(rc));
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+	}
+}
+
+/* ================================================================ */
+// All of the local announcers that are subscribed, by topic.
+
+static std::mutex _local_mutex;
+static std::map<std::string, std::set<IPFSLocalAnnouncer*>> _local_topics;
+
+IPFSLocalAnnouncer::IPFSLocalAnnouncer(void) :
+	_keep_going(false)
+{
+}
+
+IPFSLocalAnnouncer::~IPFSLocalAnnouncer()
+{
+	unsubscribe();
+}
+
+void IPFSLocalAnnouncer::announce(const std::string& topic,
+                                  const std::string& msg)
+{
+	std::lock_guard<std::mutex> lck(_local_mutex);
+	auto it = _local_topics.find(topic);
+	if (_local_topics.end() == it) return;
+	for (IPFSLocalAnnouncer* ann: it->second)
+		if (this != ann) ann->post(msg);
+}
+
+void IPFSLocalAnnouncer::post(const std::string& msg)
+{
+	std::lock_guard<std::mutex> lck(_mtx);
+	_queue.push_back(msg);
+	_cv.notify_one();
+}
+
+void IPFSLocalAnnouncer::subscribe(const std::string& topic,
+                                   const Callback& cb)
+{
+	unsubscribe();
+	_topic = topic;
+	_callback = cb;
+	_keep_going = true;
+	_thread = std::thread(deliver_thread, this);
+
+	std::lock_guard<std::mutex> lck(_local_mutex);
+	_local_topics[topic].insert(this);
+}
+
+void IPFSLocalAnnouncer::unsubscribe(void)
+{
+	{
+		std::lock_guard<std::mutex> lck(_local_mutex);
+		auto it = _local_topics.find(_topic);
+		if (_local_topics.end() != it)
+		{
+			it->second.erase(this);
+			if (0 == it->second.size()) _local_topics.erase(it);
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lck(_mtx);
+		_keep_going = false;
+		_queue.clear();
+	}
+	_cv.notify_one();
+	if (_thread.joinable()) _thread.join();
+}
+
+void IPFSLocalAnnouncer::deliver_thread(IPFSLocalAnnouncer* self)
+{
+	std::unique_lock<std::mutex> lck(self->_mtx);
+	while (true)
+	{
+		self->_cv.wait(lck, [self]
+			{ return not self->_keep_going or 0 < self->_queue.size(); });
+		if (not self->_keep_going) break;
+
+		std::string msg = self->_queue.front();
+		self->_queue.pop_front();
+		lck.unlock();
+		try { self->_callback(msg); }
+		catch (const std::exception& ex)
+		{
+			fprintf(stderr, "Failed to handle announcement on %s: %s\n",
+			        self->_topic.c_str(), ex.what());
+		}
+		lck.lock();
+	}
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,111 @@
+/*
+ * FILE:
+ * opencog/persist/ipfs/IPFSAnnouncer.h
+
+ * FUNCTION:
+ * Announcement of new AtomSpace roots to other storage instances.
+ *
+ * HISTORY:
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_IPFS_ANNOUNCER_H
+#define _OPENCOG_IPFS_ANNOUNCER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// A channel on which new AtomSpace roots are announced, as soon as
+/// they are made, to everyone who is subscribed to the topic. This is
+/// how the other users of an AtomSpace find out about new roots, as
+/// IPNS is much too slow for that. The messages are opaque strings.
+///
+/// Messages are delivered in a thread belonging to the announcer;
+/// `unsubscribe()` waits for a delivery that is under way.
+class IPFSAnnouncer
+{
+	public:
+		typedef std::function<void(const std::string&)> Callback;
+
+		virtual ~IPFSAnnouncer() {}
+		virtual void announce(const std::string& topic,
+		                      const std::string& msg) = 0;
+		virtual void subscribe(const std::string& topic,
+		                       const Callback&) = 0;
+		virtual void unsubscribe(void) = 0;
+};
+
+/// Announcements over IPFS pubsub. The daemon must be run with
+/// `--enable-pubsub-experiment`. Announcements reach everyone else
+/// on the same topic, on any node, including other processes using
+/// the same daemon, and also the sender itself.
+class IPFSPubsubAnnouncer : public IPFSAnnouncer
+{
+	private:
+		std::string _url;
+		std::string _topic;
+		Callback _callback;
+		std::atomic<bool> _keep_going;
+		std::thread _thread;
+		std::string _partial;
+
+		static void sub_thread(IPFSPubsubAnnouncer*);
+		static size_t sub_write(char*, size_t, size_t, void*);
+		static int sub_progress(void*, long, long, long, long);
+		void deliver(const std::string&);
+
+	public:
+		IPFSPubsubAnnouncer(const std::string& host, int port);
+		~IPFSPubsubAnnouncer();
+
+		void announce(const std::string&, const std::string&);
+		void subscribe(const std::string&, const Callback&);
+		void unsubscribe(void);
+};
+
+/// Announcements within this process only. Every announcer on the
+/// same topic, except for the sender, hears the message. This stands
+/// in for pubsub in the unit tests, and can be used to share one
+/// AtomSpace between several storage instances in one process.
+class IPFSLocalAnnouncer : public IPFSAnnouncer
+{
+	private:
+		std::string _topic;
+		Callback _callback;
+
+		std::mutex _mtx;
+		std::condition_variable _cv;
+		std::deque<std::string> _queue;
+		bool _keep_going;
+		std::thread _thread;
+
+		static void deliver_thread(IPFSLocalAnnouncer*);
+		void post(const std::string&);
+
+	public:
+		IPFSLocalAnnouncer(void);
+		~IPFSLocalAnnouncer();
+
+		void announce(const std::string&, const std::string&);
+		void subscribe(const std::string&, const Callback&);
+		void unsubscribe(void);
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_IPFS_ANNOUNCER_H
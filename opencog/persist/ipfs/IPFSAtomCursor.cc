@@ -0,0 +1,151 @@
+/*
+ * IPFSAtomCursor.cc
+ * Batched, resumable scan over the atoms of a stored AtomSpace.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "IPFSAtomCursor.h"
+#include "IPFSAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+
+/// The token is "root@offset", or just "root" for the start of that
+/// root, or empty for the start of the current root.
+IPFSAtomCursor::IPFSAtomCursor(IPFSAtomStorage* store,
+                               const std::string& token,
+                               size_t batch, bool values) :
+	_store(store), _pos(0), _batch(batch), _values(values)
+{
+	if (0 == _batch) _batch = 1;
+
+	_root = token;
+	size_t at = _root.find('@');
+	if (std::string::npos != at)
+	{
+		_pos = strtoul(&_root[at+1], nullptr, 10);
+		_root.resize(at);
+	}
+	if (0 == _root.compare(0, 6, "/ipfs/")) _root = _root.substr(6);
+	if (0 == _root.size()) _root = *_store->pin_root();
+
+	_cids = _store->root_atom_cids(_root);
+	prefetch(_pos);
+}
+
+IPFSAtomCursor::~IPFSAtomCursor()
+{
+	// The prefetch refers to this cursor; let it finish.
+	if (_next.valid()) _next.wait();
+}
+
+std::string IPFSAtomCursor::position(void) const
+{
+	return _root + "@" + std::to_string(_pos);
+}
+
+/* ================================================================ */
+
+/// Fetch the batch that starts at `pos`.
+HandleSeq IPFSAtomCursor::fetch(size_t pos)
+{
+	size_t end = std::min(pos + _batch, _cids.size());
+	std::vector<std::string> cids(_cids.begin() + pos, _cids.begin() + end);
+	return _store->fetch_atoms(cids, _values);
+}
+
+/// Start fetching the batch at `pos`, in the background.
+void IPFSAtomCursor::prefetch(size_t pos)
+{
+	if (_cids.size() <= pos) return;
+
+	auto prom = std::make_shared<std::promise<HandleSeq>>();
+	_next = prom->get_future();
+	_store->_io_pool.submit([this, prom, pos](void)
+	{
+		try { prom->set_value(fetch(pos)); }
+		catch (...) { prom->set_exception(std::current_exception()); }
+	}, IPFSIOPool::NORMAL);
+}
+
+/// Return the next batch of atoms, or an empty list, at the end. If
+/// the fetch fails, the exception is thrown here, and the position
+/// is not changed; calling again retries the same batch.
+HandleSeq IPFSAtomCursor::next(void)
+{
+	if (done()) return HandleSeq();
+
+	HandleSeq atoms;
+	if (_next.valid())
+	{
+		try { atoms = _next.get(); }
+		catch (...)
+		{
+			prefetch(_pos);
+			throw;
+		}
+	}
+	else
+		atoms = fetch(_pos);
+
+	_pos = std::min(_pos + _batch, _cids.size());
+	prefetch(_pos);
+	return atoms;
+}
+
+/* ================================================================ */
+
+/// The CIDs of the atoms listed in the given root, in directory
+/// order; that order is fixed, for any given root.
+std::vector<std::string> IPFSAtomStorage::root_atom_cids(const std::string& root)
+{
+	rethrow();
+
+	ipfs::Json dag;
+	{
+		IPFSConnPool::ConnGuard conn(conn_pool);
+		_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+			[&]{ conn->DagGet(root, &dag); });
+	}
+
+	std::vector<std::string> cids;
+	for (const auto& acid: dag["links"])
+		cids.push_back(acid["Cid"]["/"].get<std::string>());
+	return cids;
+}
+
+/// Fetch the atoms with the given CIDs, all at once, in the
+/// background class. The atoms are not placed in any AtomTable,
+/// nor recorded in the _guid_inv_map; the memory used by a scan
+/// does not grow with the number of atoms scanned.
+HandleSeq IPFSAtomStorage::fetch_atoms(const std::vector<std::string>& cids,
+                                       bool values)
+{
+	HandleSeq atoms(cids.size());
+	std::vector<IPFSIOPool::Task> fetches;
+	for (size_t i = 0; i < cids.size(); i++)
+	{
+		fetches.push_back([&, i](void)
+		{
+			IPFSConnPool::ClassGuard bg(IPFSConnPool::BACKGROUND);
+			ipfs::Json dag(fetch_atom_dag(cids[i]));
+			GuidMap scratch;
+			Handle h(decodeJSONAtom(dag, &scratch));
+			if (values) get_atom_values(h, dag);
+			atoms[i] = h;
+		});
+	}
+	_io_pool.run_all(fetches);
+	_load_count += cids.size();
+	return atoms;
+}
+
+/* ============================= END OF FILE ================= */
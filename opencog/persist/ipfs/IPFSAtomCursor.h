@@ -0,0 +1,75 @@
+/*
+ * FILE:
+ * opencog/persist/ipfs/IPFSAtomCursor.h
+
+ * FUNCTION:
+ * Batched, resumable scan over the atoms of a stored AtomSpace.
+ *
+ * HISTORY:
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_IPFS_ATOM_CURSOR_H
+#define _OPENCOG_IPFS_ATOM_CURSOR_H
+
+#include <future>
+#include <string>
+#include <vector>
+
+#include <opencog/atoms/base/Handle.h>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+class IPFSAtomStorage;
+
+/// A scan over the atoms in one version (root CID) of a stored
+/// AtomSpace, without loading all of them. Each call to `next()`
+/// returns the next batch of atoms; these are not placed in any
+/// AtomSpace or AtomTable. While the caller works on one batch, the
+/// next one is fetched in the background; thus at most two batches
+/// are held in RAM at any time.
+///
+/// The position of the cursor is a token of the form "root@offset".
+/// A cursor created from such a token resumes the scan from there,
+/// even in another process, as the root never changes. An empty
+/// token starts at the beginning of the current root.
+class IPFSAtomCursor
+{
+	private:
+		IPFSAtomStorage* _store;
+		std::string _root;
+		std::vector<std::string> _cids;
+		size_t _pos;
+		size_t _batch;
+		bool _values;
+
+		// The prefetched batch, starting at _pos.
+		std::future<HandleSeq> _next;
+
+		HandleSeq fetch(size_t);
+		void prefetch(size_t);
+
+	public:
+		IPFSAtomCursor(IPFSAtomStorage*, const std::string& token,
+		               size_t batch, bool values);
+		IPFSAtomCursor(const IPFSAtomCursor&) = delete;
+		IPFSAtomCursor& operator=(const IPFSAtomCursor&) = delete;
+		~IPFSAtomCursor();
+
+		HandleSeq next(void);
+		bool done(void) const { return _cids.size() <= _pos; }
+		std::string position(void) const;
+		size_t size(void) const { return _cids.size(); }
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_IPFS_ATOM_CURSOR_H
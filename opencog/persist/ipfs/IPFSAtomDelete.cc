@@ -97,31 +97,34 @@ std::cout << "Quasi-error: expected to find atom but did not!" << std::endl;
 
 	// Now actually remove.
 	std::string new_as_id;
-	ipfs::Client* conn = conn_pool.pop();
 	{
 		std::string name = h->to_short_string();
+		ipfs::Client* conn = nullptr;
 		try
 		{
 			// Update the cid under a lock, as atomspace modifications
 			// can occur from multiple threads.  It's not actually the
-			// cid that matters, its the patch itself.
+			// cid that matters, its the patch itself. The connection
+			// is taken with the lock held; see update_atom_in_atomspace().
 			std::lock_guard<std::mutex> lck(_atomspace_cid_mutex);
-			conn->ObjectPatchRmLink(_atomspace_cid, name, &new_as_id);
-			_atomspace_cid = new_as_id;
+			conn = conn_pool.pop();
+			_rpc_stats.timed(IPFSRpcStats::OBJECT_PATCH,
+				[&]{ conn->ObjectPatchRmLink(*pin_root(), name, &new_as_id); });
+			set_root(new_as_id);
 		}
 		catch (const std::exception& ex)
 		{
-			std::cout << "Error: Atomspace " << _atomspace_cid
+			std::cout << "Error: Atomspace " << *pin_root()
 			          << " does not contain " << name << std::endl;
 
-			conn_pool.push(conn);
+			if (conn) conn_pool.push(conn);
 			throw RuntimeException(TRACE_INFO,
 				"Error: Atomspace did not contain atom; how did that happen?\n");
 		}
+		conn_pool.push(conn);
 		std::cout << "Atomspace after removal of " << name
-		          << " is " << _atomspace_cid << std::endl;
+		          << " is " << new_as_id << std::endl;
 	}
-	conn_pool.push(conn);
 
 	// Bug with stats: should not increment on recursion.
 	_num_atom_deletes++;
@@ -6,13 +6,17 @@
  * SPDX-License-Identifier: AGPL-3.0-or-later
  */
 
+#include <locale.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <unordered_set>
+
 #include <opencog/atoms/base/Atom.h>
 #include <opencog/atoms/atom_types/NameServer.h>
 #include <opencog/atoms/base/Link.h>
 #include <opencog/atoms/base/Node.h>
+#include <opencog/atoms/truthvalue/TruthValue.h>
 #include <opencog/atomspace/AtomSpace.h>
 
 #include "IPFSAtomStorage.h"
@@ -22,17 +26,33 @@ using namespace opencog;
 /* ================================================================ */
 
 /// Fetch the indicated atom from the IPFS CID.
-/// This will return the raw JSON representation.
-ipfs::Json IPFSAtomStorage::fetch_atom_dag(const std::string& cid)
+/// This will return the raw JSON representation. A caller that
+/// already holds a connection from the pool passes it in; otherwise
+/// one is taken from the pool, if the block is not in the cache.
+ipfs::Json IPFSAtomStorage::fetch_atom_dag(const std::string& cid,
+                                           ipfs::Client* held)
 {
 	rethrow();
 
 	ipfs::Json dag;
-	ipfs::Client* conn = conn_pool.pop();
-	conn->DagGet(cid, &dag);
-	conn_pool.push(conn);
+	if (_block_cache.get(cid, dag))
+	{
+		_num_get_atom_hits++;
+		return dag;
+	}
 	_num_get_atoms++;
 
+	if (held)
+		_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+			[&]{ held->DagGet(cid, &dag); });
+	else
+	{
+		IPFSConnPool::ConnGuard conn(conn_pool);
+		_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+			[&]{ conn->DagGet(cid, &dag); });
+	}
+	_block_cache.put(cid, dag, false);
+
 	// std::cout << "Fetched the DAG:" << dag.dump(2) << std::endl;
 	return dag;
 }
@@ -55,6 +75,87 @@ Handle IPFSAtomStorage::fetch_atom(const std::string& cid)
 	return h;
 }
 
+/// Return the atom for the guid, if it is known, else the null handle.
+Handle IPFSAtomStorage::lookup_guid(const std::string& guid)
+{
+	// This is multi-threaded; access under a lock
+	std::lock_guard<std::mutex> lck(_inv_mutex);
+	auto hiter = _guid_inv_map.find(guid);
+	if (_guid_inv_map.end() == hiter) return Handle();
+	return hiter->second;
+}
+
+/// Return the guid in an outgoing set. This is an IPLD link, or, in
+/// AtomSpaces stored by older versions, a plain string.
+std::string IPFSAtomStorage::json_guid(const ipfs::Json& jguid)
+{
+	if (jguid.is_string()) return jguid.get<std::string>();
+	return jguid["/"].get<std::string>();
+}
+
+/// Fetch the json for each of the guids, all at once, and put it
+/// into `dags`. If some other thread is already fetching one of
+/// the guids, then wait for that, instead of fetching it again.
+/// Guids that become known in the meantime are skipped.
+void IPFSAtomStorage::fetch_guid_dags(const std::vector<std::string>& guids,
+                         std::unordered_map<std::string, ipfs::Json>& dags)
+{
+	typedef std::shared_ptr<std::promise<ipfs::Json>> Promise;
+	typedef std::shared_future<ipfs::Json> Future;
+	std::vector<std::pair<std::string, Promise>> ours;
+	std::vector<std::pair<std::string, Future>> waits;
+	{
+		std::lock_guard<std::mutex> lck(_inv_mutex);
+		for (const std::string& guid: guids)
+		{
+			if (_guid_inv_map.end() != _guid_inv_map.find(guid)) continue;
+
+			auto pif = _guid_inflight.find(guid);
+			if (_guid_inflight.end() != pif)
+			{
+				waits.push_back({guid, pif->second});
+				_num_shared_fetches++;
+				continue;
+			}
+
+			Promise prom(std::make_shared<std::promise<ipfs::Json>>());
+			Future fut(prom->get_future().share());
+			_guid_inflight.insert({guid, fut});
+			ours.push_back({guid, prom});
+			waits.push_back({guid, fut});
+		}
+	}
+
+	// Fetch in the same connection class as the caller.
+	IPFSConnPool::Class cls = IPFSConnPool::get_class();
+	IPFSIOPool::Lane lane = (IPFSConnPool::FOREGROUND == cls) ?
+		IPFSIOPool::PRIORITY : IPFSIOPool::NORMAL;
+
+	std::vector<IPFSIOPool::Task> fetches;
+	for (const auto& gp: ours)
+	{
+		fetches.push_back([this, cls, gp](void)
+		{
+			IPFSConnPool::ClassGuard guard(cls);
+			try { gp.second->set_value(fetch_atom_dag(gp.first)); }
+			catch (...) { gp.second->set_exception(std::current_exception()); }
+		});
+	}
+	_io_pool.run_all(fetches, lane);
+
+	// Anyone waiting on these still holds the futures. Until the
+	// caller builds the atoms, a new fetch of one of these guids goes
+	// to the daemon again; that's harmless, just a bit wasteful.
+	{
+		std::lock_guard<std::mutex> lck(_inv_mutex);
+		for (const auto& gp: ours)
+			_guid_inflight.erase(gp.first);
+	}
+
+	for (const auto& gf: waits)
+		dags[gf.first] = gf.second.get();
+}
+
 /// Convert a JSON message into a C++ Atom
 /// For example:
 ///   {
@@ -62,8 +163,18 @@ Handle IPFSAtomStorage::fetch_atom(const std::string& cid)
 ///      "type": "ConceptNode"
 ///   }
 /// is obviously a ConceptNode
-
-Handle IPFSAtomStorage::decodeJSONAtom(const ipfs::Json& atom)
+///
+/// The outgoing set of a link holds guids; those not yet known are
+/// fetched level by level. All of the unknown atoms in one level are
+/// fetched at once, and so the number of round trips is the depth of
+/// the link, and not the number of atoms in it. If a level has more
+/// than _closure_threshold unknown atoms, then everything under them
+/// is fetched with a single request instead. The atoms are then
+/// built bottom-up, and recorded in the _guid_inv_map; or, if
+/// `scratch` is given, there instead. Scans over whole AtomSpaces
+/// use a scratch map, so that they don't grow the _guid_inv_map.
+Handle IPFSAtomStorage::decodeJSONAtom(const ipfs::Json& atom,
+                                       GuidMap* scratch)
 {
 	Type t = nameserver().getType(atom["type"]);
 	if (nameserver().isNode(t))
@@ -78,24 +189,123 @@ Handle IPFSAtomStorage::decodeJSONAtom(const ipfs::Json& atom)
 	// The json representation for outgoing always holds guid
 	// for the atom (i.e. the atom without values on it) and
 	// never the CID (the atom with values on it).
-	HandleSeq oset;
-	for (const std::string& guid: atom["outgoing"])
+	std::unordered_map<std::string, ipfs::Json> dags;
+	std::unordered_set<std::string> seen;
+	std::vector<std::vector<std::string>> levels;
+
+	auto known = [&](const std::string& guid) -> Handle
+	{
+		if (scratch)
+		{
+			auto it = scratch->find(guid);
+			if (scratch->end() != it) return it->second;
+		}
+		return lookup_guid(guid);
+	};
+
+	auto unknown = [&](const ipfs::Json& jatom,
+	                   std::vector<std::string>& next)
 	{
-		// This is multi-threaded; access under a lock
-		std::unique_lock<std::mutex> lck(_inv_mutex);
-		auto hiter = _guid_inv_map.find(guid);
-		lck.unlock();
-		if (_guid_inv_map.end() == hiter)
+		auto pout = jatom.find("outgoing");
+		if (jatom.end() == pout) return;
+		for (const auto& jguid: *pout)
 		{
-			Handle hout(fetch_atom(guid));
-			oset.push_back(hout);
-			std::lock_guard<std::mutex> lck(_inv_mutex);
-			_guid_inv_map.insert({guid, hout});
+			std::string guid = json_guid(jguid);
+			if (seen.end() != seen.find(guid)) continue;
+			if (known(guid)) continue;
+			seen.insert(guid);
+			next.push_back(guid);
+		}
+	};
+
+	auto missing = [&](const std::vector<std::string>& guids)
+	{
+		std::vector<std::string> miss;
+		for (const std::string& guid: guids)
+			if (dags.end() == dags.find(guid)) miss.push_back(guid);
+		return miss;
+	};
+
+	// Top-down: fetch each level. After a closure fetch, the levels
+	// below it are already here.
+	std::vector<std::string> frontier;
+	unknown(atom, frontier);
+	while (0 < frontier.size())
+	{
+		std::vector<std::string> miss(missing(frontier));
+		if (0 < _closure_threshold and _closure_threshold < miss.size())
+		{
+			fetch_closure(miss, dags);
+			miss = missing(miss);
+		}
+		fetch_guid_dags(miss, dags);
+
+		std::vector<std::string> next;
+		for (const std::string& guid: frontier)
+			unknown(dags[guid], next);
+		levels.push_back(frontier);
+		frontier.swap(next);
+	}
+
+	// Bottom-up: build the atoms. An atom that is shared by several
+	// links sits in the level where it was first seen, which might
+	// be above some of the links that hold it. Such atoms are built
+	// on a later pass, once everything below them is built.
+	auto build = [&](const std::string& guid) -> bool
+	{
+		const ipfs::Json& jatom = dags[guid];
+		Type gt = nameserver().getType(jatom["type"]);
+		Handle h;
+		if (nameserver().isLink(gt))
+		{
+			HandleSeq oset;
+			for (const auto& jguid: jatom["outgoing"])
+			{
+				Handle hout(known(json_guid(jguid)));
+				if (nullptr == hout) return false;
+				oset.push_back(hout);
+			}
+			h = createLink(oset, gt);
+			_num_got_links ++;
 		}
 		else
-			oset.push_back(hiter->second);
+			h = decodeJSONAtom(jatom);
+
+		if (scratch)
+		{
+			scratch->insert({guid, h});
+			return true;
+		}
+
+		// Some other thread may have inserted it in the meanwhile;
+		// that's harmless, the two are the same atom.
+		std::lock_guard<std::mutex> lck(_inv_mutex);
+		_guid_inv_map.insert({guid, h});
+		return true;
+	};
+
+	std::vector<std::string> deferred;
+	for (auto lvl = levels.rbegin(); lvl != levels.rend(); lvl++)
+		for (const std::string& guid: *lvl)
+			if (not known(guid) and not build(guid))
+				deferred.push_back(guid);
+
+	while (0 < deferred.size())
+	{
+		std::vector<std::string> again;
+		for (const std::string& guid: deferred)
+			if (not known(guid) and not build(guid))
+				again.push_back(guid);
+		if (again.size() == deferred.size())
+			throw RuntimeException(TRACE_INFO,
+				"Unable to resolve outgoing set! %s\n", atom.dump(2).c_str());
+		deferred.swap(again);
 	}
 
+	HandleSeq oset;
+	for (const auto& jguid: atom["outgoing"])
+		oset.push_back(known(json_guid(jguid)));
+
 	_num_got_links ++;
 	return createLink(oset, t);
 }
@@ -157,16 +367,64 @@ Handle IPFSAtomStorage::decodeStrAtom(const std::string& satom)
 	return createLink(oset, t);
 }
 
+/// The "C" locale, for printing and parsing doubles. The locale of
+/// the process might use a decimal comma, or group the digits.
+static locale_t c_locale(void)
+{
+	static locale_t loc = newlocale(LC_ALL_MASK, "C", (locale_t) 0);
+	return loc;
+}
+
+/// Convert a double into a string. The printed form must be exactly
+/// the same every time, in every process, for the same double, as
+/// otherwise the same Values would get different CIDs. It must also
+/// have enough digits to round-trip exactly. So it is printed in the
+/// "C" locale, whatever the locale of the process.
+std::string IPFSAtomStorage::encodeFloatToStr(double d)
+{
+	char buf[40];
+	locale_t old = uselocale(c_locale());
+	snprintf(buf, sizeof(buf), "%.17g", d);
+	uselocale(old);
+	return buf;
+}
+
+/// Parse a double printed by `encodeFloatToStr()`, starting at `pos`,
+/// and move `pos` to just past it.
+double IPFSAtomStorage::decodeStrToFloat(const std::string& str,
+                                         size_t& pos)
+{
+	const char* start = str.c_str() + pos;
+	char* end;
+	locale_t old = uselocale(c_locale());
+	double d = strtod(start, &end);
+	uselocale(old);
+	if (end == start)
+		throw SyntaxException(TRACE_INFO, "Bad number in %s", str.c_str());
+	pos += end - start;
+	return d;
+}
+
 /// Convert value (or Atom) into a string.
 std::string IPFSAtomStorage::encodeValueToStr(const ValuePtr& v)
 {
-	if (nameserver().isA(v->get_type(), FLOAT_VALUE))
+	// The default printers for FloatValues and TruthValues vary in
+	// precision (SimpleTruthValue only prints 6 digits, and breaks
+	// the unit tests), so print these here, in a canonical form.
+	Type t = v->get_type();
+	if (SIMPLE_TRUTH_VALUE == t)
+	{
+		TruthValuePtr tv(TruthValueCast(v));
+		return "(SimpleTruthValue " + encodeFloatToStr(tv->get_mean())
+			+ " " + encodeFloatToStr(tv->get_confidence()) + ")";
+	}
+	if (nameserver().isA(t, FLOAT_VALUE))
 	{
-		// The FloatValue to_string() print prints out a high-precision
-		// form of the value, as compared to SimpleTruthValue, which
-		// only prints 6 digits and breaks the unit tests.
 		FloatValuePtr fv(FloatValueCast(v));
-		return fv->FloatValue::to_string();
+		std::string str = "(" + nameserver().getTypeName(t);
+		for (double d: fv->value())
+			str += " " + encodeFloatToStr(d);
+		return str + ")";
 	}
 	return v->to_short_string();
 }
@@ -175,7 +433,40 @@ std::string IPFSAtomStorage::encodeValueToStr(const ValuePtr& v)
 
 Handle IPFSAtomStorage::do_fetch_atom(Handle &h)
 {
-	ipfs::Json dag = get_atom_json(h);
+	return do_fetch_atom(h, *pin_root());
+}
+
+/// Fetch the values on the atom, as they are in the given root.
+///
+/// If the atom is still queued for storing, then the values that are
+/// queued are returned; these are newer than any in IPFS. Likewise,
+/// if this process owns the AtomSpace, and has stored the atom, then
+/// the locally cached json for the atom is newer than, or the same
+/// as, the one in IPFS. Either way, the daemon is not asked, and the
+/// process always sees its own writes, without a barrier.
+Handle IPFSAtomStorage::do_fetch_atom(Handle &h, const std::string& root)
+{
+	Handle hp(get_pending_write(h));
+	if (hp)
+	{
+		_num_pending_reads++;
+		if (hp != h)
+		{
+			for (const Handle& key: hp->getKeys())
+				h->setValue(key, hp->getValue(key));
+		}
+		return h;
+	}
+
+	ipfs::Json dag;
+	if (0 < _keyname.size())
+	{
+		std::lock_guard<std::mutex> lck(_json_mutex);
+		auto pj = _json_map.find(h);
+		if (_json_map.end() != pj) dag = pj->second;
+	}
+	if (0 == dag.size())
+		dag = get_atom_json(h, root);
 
 	if (0 == dag.size())
 	{
@@ -190,18 +481,32 @@ Handle IPFSAtomStorage::do_fetch_atom(Handle &h)
 	return h;
 }
 
+/// Interactive fetches go in the priority lane of the I/O pool, so
+/// that they are not stuck behind bulk loads and stores.
 Handle IPFSAtomStorage::getNode(Type t, const char * str)
 {
 	rethrow();
 	Handle h(createNode(t, str));
-	return do_fetch_atom(h);
+	Handle hf;
+	_io_pool.run([&](void)
+	{
+		IPFSConnPool::ClassGuard fg(IPFSConnPool::FOREGROUND);
+		hf = do_fetch_atom(h);
+	}, IPFSIOPool::PRIORITY);
+	return hf;
 }
 
 Handle IPFSAtomStorage::getLink(Type t, const HandleSeq& hs)
 {
 	rethrow();
 	Handle h(createLink(hs, t));
-	return do_fetch_atom(h);
+	Handle hf;
+	_io_pool.run([&](void)
+	{
+		IPFSConnPool::ClassGuard fg(IPFSConnPool::FOREGROUND);
+		hf = do_fetch_atom(h);
+	}, IPFSIOPool::PRIORITY);
+	return hf;
 }
 
 /* ============================= END OF FILE ================= */
@@ -13,10 +13,13 @@
  * Copyright (c) 2008,2009,2013,2015,2017 Linas Vepstas <linas@linas.org>
  * SPDX-License-Identifier: AGPL-3.0-or-later
  */
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
+#include <random>
 #include <thread>
 
 #include <opencog/atomspace/AtomSpace.h>
@@ -28,14 +31,55 @@ using namespace opencog;
 // Number of write-back queues
 #define NUM_WB_QUEUES 6
 
+// The empty unixfs directory. Every IPFS repo has it from the start,
+// and so an empty AtomSpace can use it as its root, without writing
+// anything.
+#define EMPTY_ROOT_CID "QmUNLLsPACCz1vLxQVkXqqLX5R1X345qqfHbsf67hvA3Nn"
+
 /* ================================================================ */
 // Constructors
 
-void IPFSAtomStorage::init(const char * uri)
+/// Return the value of the named option in the URI, or the default,
+/// if there is no such option. Options follow a question mark, and are
+/// separated by ampersands, as in
+///    ipfs:///atomspace-key?io-threads=8&wb-queues=4
+size_t IPFSAtomStorage::get_uri_option(const std::string& uri,
+                                       const char* name, size_t dflt)
+{
+	size_t pos = uri.find('?');
+	if (std::string::npos == pos) return dflt;
+
+	std::string opt = std::string(name) + "=";
+	while (std::string::npos != pos)
+	{
+		pos++;
+		if (0 == uri.compare(pos, opt.size(), opt))
+			return atol(uri.c_str() + pos + opt.size());
+		pos = uri.find('&', pos);
+	}
+	return dflt;
+}
+
+void IPFSAtomStorage::init(const char * curi)
 {
+	// The closure fetches and the pubsub announcer use curl directly.
+	curl_init();
+
 	tvpred = createNode(PREDICATE_NODE, "*-TruthValueKey-*");
+	_tvpred_str = encodeAtomToStr(tvpred);
+
+	_uri = curi;
 
-	_uri = uri;
+	// The options were already used to size the I/O threads; strip
+	// them off, before looking for the hostname and key.
+	std::string suri(curi);
+	size_t qpos = suri.find('?');
+	if (std::string::npos != qpos) suri.resize(qpos);
+	const char* uri = suri.c_str();
+
+	_io_threads = _io_pool.size();
+	_wb_queues = get_uri_option(_uri, "wb-queues", NUM_WB_QUEUES);
+	if (0 == _wb_queues) _wb_queues = 1;
 
 #define URIX_LEN (sizeof("ipfs://") - 1)  // Should be 7
 	if (strncmp(uri, "ipfs://", URIX_LEN))
@@ -82,96 +126,279 @@ void IPFSAtomStorage::init(const char * uri)
 		}
 	}
 
+	_value_block_size = 0;
+
 	// If the "key" is actually an IPFS or IPNS CID...
+	_read_only = false;
+	std::string atomspace_cid;
 	if (std::string::npos != _keyname.find("ipfs/"))
 	{
-		_atomspace_cid = &_keyname[sizeof("ipfs/")-1];
+		atomspace_cid = &_keyname[sizeof("ipfs/")-1];
 		_keyname.clear();
+		_read_only = true;
 	}
 	else
 	if (std::string::npos != _keyname.find("ipns/"))
 	{
-		_key_cid = &_keyname[sizeof("ipns/")];
+		_key_cid = &_keyname[sizeof("ipns/")-1];
 		_keyname.clear();
-		// XXX TODO Maybe we should IPNS resolve the atomspace now!?
-		// Well, we can't, or don't want to, because IPNS is too
-		// slow. Let the user decide when to resolve.
+		// IPNS is too slow to resolve now; it is resolved in the
+		// background, below, and the last resolution is used, if
+		// there is one.
 	}
 
 	// Trim trailing whitespace.  This can happen if we get the
 	// key from SchemeEval::eval() which has a bad habit of
 	// appending newline chars.
 	const std::string WHITESPACE = " \n\r\t\f\v";
-	size_t end = _atomspace_cid.find_last_not_of(WHITESPACE);
+	size_t end = atomspace_cid.find_last_not_of(WHITESPACE);
 	if (std::string::npos != end)
-		_atomspace_cid.resize(end+1);
+		atomspace_cid.resize(end+1);
+	set_root(atomspace_cid);
 
 	end = _key_cid.find_last_not_of(WHITESPACE);
 	if (std::string::npos != end)
 		_key_cid.resize(end+1);
 
 	// Create pool of IPFS server connections.
-	_initial_conn_pool_size = NUM_OMP_THREADS + NUM_WB_QUEUES;
+	// One connection per thread that might talk to IPFS at the same
+	// time: the I/O threads, the write-back queues, and the user.
+	// On top of that, some are kept for foreground reads only, so
+	// that these do not wait behind bulk stores.
+	size_t read_conns = get_uri_option(_uri, "read-conns", NUM_READ_CONNS);
+	_closure_threshold = get_uri_option(_uri, "closure-threshold",
+	                                    CLOSURE_THRESHOLD);
+	conn_pool.set_reserved(read_conns);
+	_initial_conn_pool_size = _io_threads + _wb_queues + 1 + read_conns;
 	for (int i=0; i<_initial_conn_pool_size; i++)
 	{
 		ipfs::Client* conn = new ipfs::Client(_hostname, _port);
 		conn_pool.push(conn);
 	}
 
+	_resolver = new IPFSResolver(_hostname, _port, cache_dir("ipns"));
+	_ipns_refresh = false;
+	_refresh_as = nullptr;
+
 	bulk_load = false;
 	bulk_store = false;
+	_fresh_root = false;
+	_json_gen = 0;
+	_link_format = 0;
+	_stats_time = 0;  // Nothing counted yet, so nothing to carry over.
 	clear_stats();
 
-	// Create the IPNS key under which we will publish,
-	// if it does not yet exist.
-	_publish_keep_going = false;
+	_pending_gen = 0;
+
+	// Prefetching is off, until a cache size is set.
+	_prefetch_depth = 0;
+
+	// Write combining is off, until a window is set.
+	_combine_msec = 0;
+	_combine_busy = 0;
+	_combine_keep_going = true;
+
+	// Metrics are not written to a file, until a file is set.
+	_metrics_secs = 0;
+	_metrics_keep_going = true;
+
+	// Adaptive flow control is off, until turned on. The writers are
+	// let through the gate without waiting, unless they are capped
+	// with the max-writers option.
+	_flow_adaptive = false;
+	_flow_keep_going = true;
+	_flow_max_writers = get_uri_option(_uri, "max-writers", _wb_queues);
+	if (0 == _flow_max_writers or (int) _wb_queues < _flow_max_writers)
+		_flow_max_writers = _wb_queues;
+	_flow_writers = _flow_max_writers;
+	_flow_gated = (_flow_max_writers < (int) _wb_queues);
+	_flow_active = 0;
+	_flow_peak = 0;
+	_flow_rate = 0.0;
+	_flow_latency = 0.0;
+	_flow_min_latency = 0.0;
+	_flow_last_depth = 0;
+	_flow_decision = "off";
+
+	// The announcer is needed only if there is a key; but the key
+	// might not be known yet, so the nonce and topic wait for that.
+	_announcer = nullptr;
+	size_t announce = get_uri_option(_uri, "announce", 0);
+	if (has_key() and 0 < announce)
+	{
+		if (1 == announce)
+			_announcer = new IPFSPubsubAnnouncer(_hostname, _port);
+		else
+			_announcer = new IPFSLocalAnnouncer();
+	}
+
+	// Roots are committed with a compare and swap, if asked for:
+	// commit=1 for a registry that is shared by all of the processes
+	// using the same cache directory. Start from the committed root.
+	_registry = nullptr;
+	if (0 < _keyname.size() and 0 < get_uri_option(_uri, "commit", 0))
+	{
+		_registry = new IPFSFileRegistry(cache_dir("roots/" + _hostname +
+		                                 ":" + std::to_string(_port)));
+		_commit_seen = _registry->get(_keyname);
+		if (0 < _commit_seen.size()) set_root(_commit_seen);
+	}
+
+	// Find the IPNS key under which we will publish, or create it,
+	// if it does not yet exist. Unless its ID was cached, this is
+	// done in the background, so that opening is not held up.
 	if (0 < _keyname.size())
 	{
-		// Brute force search for keys.
-		ipfs::Json key_list;
-		ipfs::Client clnt(_hostname, _port);
-		clnt.KeyList(&key_list);
-		for (const auto& item : key_list)
+		FILE* fh = fopen(key_cache_path().c_str(), "r");
+		if (fh)
 		{
-			std::string kame = item["Name"];
-			if (0 == kame.compare(_keyname))
-			{
-				_key_cid = item["Id"];
-				break;
-			}
+			char id[256];
+			if (1 == fscanf(fh, "%255s", id)) _key_cid = id;
+			fclose(fh);
 		}
-		if (0 < _key_cid.size())
+	}
+
+	if (0 < _keyname.size() and 0 == _key_cid.size())
+	{
+		auto found = std::make_shared<std::promise<void>>();
+		_key_ready = found->get_future().share();
+		_key_thread = std::thread([this, found](void)
 		{
-			std::cout << "Found existing AtomSpace key: /ipns/"
-			          << _key_cid << std::endl;
-		}
-		else
+			try
+			{
+				find_key();
+				key_found();
+				found->set_value();
+			}
+			catch (...)
+			{
+				found->set_exception(std::current_exception());
+			}
+		});
+	}
+	else if (has_key())
+		key_found();
+
+	// We run IPNS publication in it's own thread, because it's so
+	// horridly slow.  As of this writing, either 60 sec or 90 sec.
+	// This is a well-known problem, see
+	// https://github.com/ipfs/go-ipfs/issues/3860
+	_publish_keep_going = false;
+	_publish_pending = false;
+	if (0 < _keyname.size())
+	{
+		_publish_keep_going = true;
+		_publish_thread = std::thread(publish_thread, this);
+	}
+
+	// Start out with an empty AtomSpace, but only if we're not
+	// already working with one.
+	if (0 == pin_root()->size()) kill_data();
+	{
+		std::lock_guard<std::mutex> lck(_atomspace_cid_mutex);
+		_commit_base = *pin_root();
+	}
+
+	std::lock_guard<std::mutex> lck(_refresh_mutex);
+	_loaded_root = *pin_root();
+}
+
+/// The file holding the ID of the key. Keys belong to the daemon, and
+/// so the daemon is a part of the path.
+std::string IPFSAtomStorage::key_cache_path(void)
+{
+	std::string dir = cache_dir("keys/" + _hostname + ":" +
+	                            std::to_string(_port));
+	if (0 == dir.size()) return "";
+	return dir + "/" + _keyname;
+}
+
+/// Look for the key in the daemon, and make it, if it's not there.
+/// New keys are ed25519 keys, which take no time at all to make,
+/// and are small enough that the key ID is the public key itself.
+void IPFSAtomStorage::find_key(void)
+{
+	// Brute force search for keys.
+	std::string id;
+	ipfs::Json key_list;
+	ipfs::Client clnt(_hostname, _port);
+	_rpc_stats.timed(IPFSRpcStats::KEY, [&]{ clnt.KeyList(&key_list); });
+	for (const auto& item : key_list)
+	{
+		std::string kame = item["Name"];
+		if (0 == kame.compare(_keyname))
 		{
-			// Not found; make a new one, by default.
-			clnt.KeyGen(_keyname, "rsa", 2048, &_key_cid);
-			std::cout << "Generated AtomSpace key: /ipns/"
-			          << _key_cid << std::endl;
+			id = item["Id"];
+			break;
 		}
+	}
+	if (0 < id.size())
+	{
+		std::cout << "Found existing AtomSpace key: /ipns/"
+		          << id << std::endl;
+	}
+	else
+	{
+		// Not found; make a new one, by default.
+		_rpc_stats.timed(IPFSRpcStats::KEY,
+			[&]{ clnt.KeyGen(_keyname, "ed25519", 256, &id); });
+		std::cout << "Generated AtomSpace key: /ipns/"
+		          << id << std::endl;
+	}
+	_key_cid = id;
+
+	// Write the file to a temp file, and rename it into place, so
+	// that other processes never see a half-written file.
+	std::string path = key_cache_path();
+	if (0 == path.size()) return;
+	std::string tmp = path + ".tmp";
+	FILE* fh = fopen(tmp.c_str(), "w");
+	if (nullptr == fh) return;
+	fprintf(fh, "%s\n", id.c_str());
+	bool ok = (0 == fclose(fh));
+	if (not ok or rename(tmp.c_str(), path.c_str())) remove(tmp.c_str());
+}
 
-		// We run IPNS publication in it's own thread, because it's so
-		// horridly slow.  As of this writing, either 60 sec or 90 sec.
-		// This is a well-known problem, see
-		// https://github.com/ipfs/go-ipfs/issues/3860
-		_publish_keep_going = true;
-		std::thread publisher(publish_thread, this);
-		publisher.detach();
-		// std::this_thread::yield();
-		// std::this_thread::sleep_for(50ms);
-		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+/// Start everything that needs the key ID. AtomSpaces opened by IPNS
+/// name start out at the last root that the name was seen to resolve
+/// to; the name is resolved again, in the background, right away, so
+/// that the latest root is known by the time that it is wanted.
+void IPFSAtomStorage::key_found(void)
+{
+	_resolver->on_resolve(
+		[this](const std::string& name, const std::string& cid)
+		{ ipns_updated(name, cid); });
+	std::string cid = _resolver->lookup(_key_cid, false);
+	if (0 == _keyname.size() and 0 < cid.size()) set_root(cid);
+
+	// Listen for the new roots that other users of the AtomSpace
+	// announce: announce=1 for IPFS pubsub, announce=2 for other
+	// storage instances in this process only.
+	if (_announcer)
+	{
+		std::random_device rd;
+		char nonce[20];
+		snprintf(nonce, sizeof(nonce), "%08x%08x", rd(), rd());
+		_announce_nonce = nonce;
+		_announce_topic = "atomspace/" + _key_cid;
+		_announcer->subscribe(_announce_topic,
+			[this](const std::string& msg) { root_announced(msg); });
 	}
+}
 
-	// Initialize a new AtomSpace, but only if
-	// we're not already working with one.
-	if (0 == _atomspace_cid.size()) kill_data();
+/// Return the ID of the IPNS key, waiting for it to be found or made,
+/// if need be. Throws, if it could be neither found nor made.
+const std::string& IPFSAtomStorage::key_cid(void)
+{
+	if (_key_ready.valid()) _key_ready.get();
+	return _key_cid;
 }
 
 IPFSAtomStorage::IPFSAtomStorage(std::string uri) :
-	_write_queue(this, &IPFSAtomStorage::vdo_store_atom, NUM_WB_QUEUES),
+	_io_pool(get_uri_option(uri, "io-threads", NUM_IO_THREADS)),
+	_write_queue(this, &IPFSAtomStorage::vdo_store_atom,
+	             std::max((size_t) 1,
+	                 get_uri_option(uri, "wb-queues", NUM_WB_QUEUES))),
 	_async_write_queue_exception(nullptr)
 {
 	init(uri.c_str());
@@ -179,11 +406,64 @@ IPFSAtomStorage::IPFSAtomStorage(std::string uri) :
 
 IPFSAtomStorage::~IPFSAtomStorage()
 {
+	// The metrics writer looks at everything; stop it first.
+	{
+		std::lock_guard<std::mutex> lck(_metrics_file_mutex);
+		_metrics_keep_going = false;
+	}
+	_metrics_file_cv.notify_one();
+	if (_metrics_thread.joinable()) _metrics_thread.join();
+
+	if (_key_thread.joinable()) _key_thread.join();
 	flushStoreQueue();
 
-	_publish_keep_going = false;
+	// Nobody else will commit these changes, so failing to do so
+	// is reported, but does not stop the close.
+	try
+	{
+		commit_root();
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "Failed to commit AtomSpace CID: "
+		          << ex.what() << std::endl;
+	}
+
+	{
+		std::lock_guard<std::mutex> lck(_publish_mutex);
+		_publish_keep_going = false;
+	}
 	_publish_cv.notify_one();
 
+	// A publish that is under way uses the resolver and the stats;
+	// wait for it to finish before freeing them.
+	if (_publish_thread.joinable()) _publish_thread.join();
+
+	if (_announcer)
+	{
+		announce_root();
+		_announcer->unsubscribe();
+		delete _announcer;
+	}
+
+	_resolver->on_resolve(nullptr);
+	delete _resolver;
+	delete _registry;
+
+	{
+		std::lock_guard<std::mutex> lck(_combine_mutex);
+		_combine_keep_going = false;
+	}
+	_combine_cv.notify_one();
+	if (_combine_thread.joinable()) _combine_thread.join();
+
+	{
+		std::lock_guard<std::mutex> lck(_flow_mutex);
+		_flow_keep_going = false;
+	}
+	_flow_tick_cv.notify_one();
+	if (_flow_thread.joinable()) _flow_thread.join();
+
 	while (not conn_pool.is_empty())
 	{
 		ipfs::Client* conn = conn_pool.pop();
@@ -205,7 +485,7 @@ bool IPFSAtomStorage::connected(void)
  */
 std::string IPFSAtomStorage::get_ipfs_cid(void)
 {
-	return "/ipfs/" + _atomspace_cid;
+	return "/ipfs/" + *pin_root();
 }
 
 /**
@@ -213,25 +493,151 @@ std::string IPFSAtomStorage::get_ipfs_cid(void)
  */
 std::string IPFSAtomStorage::get_ipns_key(void)
 {
-	return "/ipns/" + _key_cid;
+	return "/ipns/" + key_cid();
 }
 
 /**
  * Use IPNS to find the latest IPFS cid for this AtomSpace.
+ * This is the last resolution, if there is one; otherwise, this
+ * waits for the resolution, which can take a minute.
  */
 void IPFSAtomStorage::resolve_atomspace(void)
 {
-	if (0 == _key_cid.size()) return;
+	if (not has_key()) return;
 
-	// Caution: as of this writing, name resolution takes
-	// exactly 60 seconds. This is a bug; see
-	// https://github.com/ipfs/go-ipfs/issues/3860
-	// for details.
-	std::string ipfs_path;
-	ipfs::Client* conn = conn_pool.pop();
-	conn->NameResolve(_key_cid, &ipfs_path);
-	conn_pool.push(conn);
-	_atomspace_cid = ipfs_path;
+	// The registry is always up to date; IPNS lags behind it. Move
+	// to the committed root, unless there are local changes; these
+	// are rebased onto it at the next commit.
+	if (_registry)
+	{
+		std::string committed = _registry->get(_keyname);
+		std::lock_guard<std::mutex> lck(_atomspace_cid_mutex);
+		if (0 == committed.size() or *pin_root() != _commit_base) return;
+		set_root(committed);
+		_commit_base = committed;
+		_commit_seen = committed;
+		return;
+	}
+
+	std::string cid = _resolver->lookup(key_cid(), true);
+
+	std::lock_guard<std::mutex> lck(_atomspace_cid_mutex);
+	set_root(cid);
+}
+
+/// Turn on or off the updating of the loaded AtomSpace, when the
+/// IPNS key resolves to a new root.
+void IPFSAtomStorage::set_ipns_refresh(bool on)
+{
+	_ipns_refresh = on;
+}
+
+/// Called from the resolver thread, when the IPNS key resolves to a
+/// new root. The root is followed if refreshing is on, or if it is
+/// the one that was last announced.
+void IPFSAtomStorage::ipns_updated(const std::string& name,
+                                   const std::string& cid)
+{
+	if (name != _key_cid) return;
+
+	bool announced;
+	{
+		std::lock_guard<std::mutex> lck(_announce_mutex);
+		announced = (cid == _announced_root);
+	}
+	if (_ipns_refresh or announced) follow_root(cid);
+}
+
+/// Move to a newer root, unless there were local changes since the
+/// current one was opened or loaded. If an AtomSpace was loaded, it
+/// is synced to the new root. Local changes are never clobbered: if
+/// there are any, the new root is left for the user to merge. Stores
+/// that are still queued are local changes too; the root does not
+/// show them yet.
+void IPFSAtomStorage::follow_root(const std::string& cid)
+{
+	std::lock_guard<std::mutex> lck(_refresh_mutex);
+	if (cid == _loaded_root or *pin_root() != _loaded_root) return;
+	if (have_pending_writes()) return;
+
+	if (_refresh_as)
+	{
+		IPFSConnPool::ClassGuard bg(IPFSConnPool::BACKGROUND);
+		sync_atomspace(_refresh_as, _loaded_root, cid);
+	}
+	{
+		std::lock_guard<std::mutex> lck(_atomspace_cid_mutex);
+		if (*pin_root() != _loaded_root or have_pending_writes()) return;
+		if (*pin_root() == _commit_base) _commit_base = cid;
+		set_root(cid);
+	}
+	_loaded_root = cid;
+	_num_root_updates++;
+}
+
+/// Tell the other users of the AtomSpace about the current root,
+/// unless they were already told, or it is not ours, but one that
+/// we opened, loaded or followed.
+void IPFSAtomStorage::announce_root(void)
+{
+	if (nullptr == _announcer) return;
+	key_cid();
+
+	std::string loaded;
+	{
+		std::lock_guard<std::mutex> lck(_refresh_mutex);
+		loaded = _loaded_root;
+	}
+
+	std::lock_guard<std::mutex> lck(_announce_mutex);
+	RootPin root = pin_root();
+	if (*root == _last_announced or *root == loaded) return;
+
+	// Announcements are a courtesy; failing to make one is not
+	// a reason to fail the store.
+	try
+	{
+		_announcer->announce(_announce_topic, *root + " " + _announce_nonce);
+		_last_announced = *root;
+		_num_announces++;
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "Failed to announce AtomSpace CID: "
+		          << ex.what() << std::endl;
+	}
+}
+
+/// Called from the announcer thread, with a root announced by some
+/// other user of the AtomSpace. The message is the CID and the nonce
+/// of the sender.
+///
+/// Announcements are not signed, and anyone can send them, so they
+/// are only ever a hint: the key is resolved again, right away, and
+/// the root is followed once the key resolves to it; see
+/// `ipns_updated()`. The announced CID is never recorded as the
+/// resolution of the key. The owner of the key never follows
+/// anyone; the roots that it publishes are its own.
+void IPFSAtomStorage::root_announced(const std::string& msg)
+{
+	size_t sp = msg.find(' ');
+	if (std::string::npos == sp) return;
+	if (0 == msg.compare(sp + 1, std::string::npos, _announce_nonce)) return;
+
+	std::string cid = msg.substr(0, sp);
+	_num_announces_heard++;
+	if (0 < _keyname.size()) return;
+
+	{
+		std::lock_guard<std::mutex> lck(_announce_mutex);
+		_announced_root = cid;
+	}
+
+	// The key might already be known to resolve to it.
+	if (cid == _resolver->lookup(_key_cid, false))
+		follow_root(cid);
+	else
+		_resolver->refresh(_key_cid);
 }
 
 /**
@@ -252,16 +658,29 @@ std::string IPFSAtomStorage::get_atom_guid(const Handle& h)
  * for Values and for the incoming set.
  */
 ipfs::Json IPFSAtomStorage::get_atom_json(const Handle& atom)
+{
+	return get_atom_json(atom, *pin_root());
+}
+
+/**
+ * Return the IPFS json of this Atom, as it is in the given
+ * AtomSpace root.
+ */
+ipfs::Json IPFSAtomStorage::get_atom_json(const Handle& atom,
+                                          const std::string& root)
 {
 	// Build the name
-	std::string path = _atomspace_cid + "/" + atom->to_short_string();
+	std::string path = root + "/" + atom->to_short_string();
 
 	// std::cout << "Query path = " << path << std::endl;
 	ipfs::Json dag;
-	ipfs::Client* conn = conn_pool.pop();
+	if (_block_cache.get(path, dag)) return dag;
+
+	IPFSConnPool::ConnGuard conn(conn_pool);
 	try
 	{
-		conn->DagGet(path, &dag);
+		_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+			[&]{ conn->DagGet(path, &dag); });
 	}
 	catch (const std::exception& ex)
 	{
@@ -269,7 +688,7 @@ ipfs::Json IPFSAtomStorage::get_atom_json(const Handle& atom)
 		// recorded in IPFS. That's a normal situation, just
 		// ignore the error.
 	}
-	conn_pool.push(conn);
+	if (0 < dag.size()) _block_cache.put(path, dag, false);
 	return dag;
 }
 
@@ -283,35 +702,48 @@ ipfs::Json IPFSAtomStorage::get_atom_json(const Handle& atom)
  */
 void IPFSAtomStorage::publish_atomspace(void)
 {
-	if (0 == _key_cid.size()) return;
+	if (not has_key()) return;
+	announce_root();
+	{
+		std::lock_guard<std::mutex> lck(_publish_mutex);
+		_publish_pending = true;
+	}
 	_publish_cv.notify_one();
 }
 
 void IPFSAtomStorage::publish_thread(IPFSAtomStorage* self)
 {
 	ipfs::Client clnt(self->_hostname, self->_port);
-	std::mutex mtx;
-	while (self->_publish_keep_going)
+	while (true)
 	{
-		std::unique_lock<std::mutex> lock(mtx);
-		self->_publish_cv.wait(lock);
-
-		// Last time out, just quit.
-		if (not self->_publish_keep_going) break;
+		{
+			std::unique_lock<std::mutex> lock(self->_publish_mutex);
+			self->_publish_cv.wait(lock, [self]
+				{ return self->_publish_pending or
+				         not self->_publish_keep_going; });
+
+			// Last time out, just quit.
+			if (not self->_publish_keep_going) break;
+			self->_publish_pending = false;
+		}
 
+		RootPin root = self->pin_root();
 		std::cout << "Publishing AtomSpace CID: "
-		          << self->_atomspace_cid << std::endl;
+		          << *root << std::endl;
 
 		// XXX hack alert -- lifetime set to 4 hours, it should be
 		// infinity or something.... the TTL is 30 seconds, but should
 		// be shorter or user-configurable .. set both with scheme bindings.
 		try
 		{
+			const std::string& key = self->key_cid();
 			std::string name;
 			ipfs::Json options = {{"lifetime", "4h"}, {"ttl", "4h"}};
-			clnt.NamePublish(self->_atomspace_cid,
-			                 self->_keyname, options, &name);
+			self->_rpc_stats.timed(IPFSRpcStats::NAME_PUBLISH, [&]{
+				clnt.NamePublish(*root,
+				                 self->_keyname, options, &name); });
 			std::cout << "Published AtomSpace: " << name << std::endl;
+			self->_resolver->update(key, *root);
 		}
 		catch (const std::exception& ex)
 		{
@@ -325,24 +757,33 @@ void IPFSAtomStorage::publish_thread(IPFSAtomStorage* self)
 	}
 }
 
-void IPFSAtomStorage::update_atom_in_atomspace(const Handle& h,
-                                               const std::string& cid)
+/// Patch the atom, stored as `cid`, into the root. The json that was
+/// stored must have been taken from the cache at json generation
+/// `gen`; if a rebase replaced the cached json since, nothing is done,
+/// and false is returned: the store must be built again, from the new
+/// json, or else it would undo the changes that the rebase brought in.
+bool IPFSAtomStorage::update_atom_in_atomspace(const Handle& h,
+                                               const std::string& cid,
+                                               size_t gen)
 {
+	ensure_root();
 	std::string label(encodeAtomToStr(h));
 
-	// XXX FIXME ... this leaks pool entries, if ipfs ever throws.
-	// We can't just catch, we need to rethrow, too.
 	std::string new_as_id;
-	ipfs::Client* conn = conn_pool.pop();
 	{
 		// Update the cid under a lock, as this method can
 		// be called from multiple threads.  It's not actually
-		// the cid that matters, its the patch itself.
+		// the cid that matters, its the patch itself. The
+		// connection is taken only once the lock is held, so
+		// that threads waiting on the lock do not use up the pool.
 		std::lock_guard<std::mutex> lck(_atomspace_cid_mutex);
-		conn->ObjectPatchAddLink(_atomspace_cid, label, cid, &new_as_id);
-		_atomspace_cid = new_as_id;
+		if (gen != _json_gen) return false;
+
+		IPFSConnPool::ConnGuard conn(conn_pool);
+		_rpc_stats.timed(IPFSRpcStats::OBJECT_PATCH,
+			[&]{ conn->ObjectPatchAddLink(*pin_root(), label, cid, &new_as_id); });
+		set_root(new_as_id);
 	}
-	conn_pool.push(conn);
 
 	{
 		// Store the current cid for this atom; this is the cid
@@ -350,6 +791,7 @@ void IPFSAtomStorage::update_atom_in_atomspace(const Handle& h,
 		std::lock_guard<std::mutex> lck(_atom_cid_mutex);
 		_atom_cid_map[h] = cid;
 	}
+	return true;
 }
 
 /// Rethrow asynchronous exceptions caught during atom storage.
@@ -391,12 +833,16 @@ void IPFSAtomStorage::flushStoreQueue()
 {
 	rethrow();
 	_write_queue.barrier();
+	flush_combined();
+	_io_pool.barrier();
 	rethrow();
 }
 
 void IPFSAtomStorage::barrier()
 {
 	flushStoreQueue();
+	commit_root();
+	announce_root();
 	// publish();
 }
 
@@ -412,6 +858,9 @@ void IPFSAtomStorage::unregisterWith(AtomSpace* as)
 	BackingStore::unregisterWith(as);
 
 	flushStoreQueue();
+
+	std::lock_guard<std::mutex> lck(_refresh_mutex);
+	if (as == _refresh_as) _refresh_as = nullptr;
 }
 
 /* ================================================================ */
@@ -434,19 +883,64 @@ void IPFSAtomStorage::kill_data(void)
 	_guid_inv_map.clear();
 	_json_map.clear();
 
-	std::string text = "AtomSpace " + _uri;
-	ipfs::Json result;
-
-	ipfs::Client* conn = conn_pool.pop();
-	conn->FilesAdd({{"AtomSpace",
-		ipfs::http::FileUpload::Type::kFileContents,
-		text}}, &result);
-	conn_pool.push(conn);
+	// Nothing is written yet; see ensure_root().
+	{
+		std::lock_guard<std::mutex> lck(_atomspace_cid_mutex);
+		set_root(EMPTY_ROOT_CID);
+	}
+	_link_format = 0;
+	_fresh_root = true;
+}
 
-	_atomspace_cid = result[0]["hash"];
+/// Store the atoms that every AtomSpace must have, if this is the
+/// first write to a new one. Called before every write to the root.
+/// If the root is still empty, the entry of the TruthValue key also
+/// records the link format; see link_format().
+void IPFSAtomStorage::ensure_root(void)
+{
+	if (not _fresh_root.exchange(false)) return;
+	bool empty = (EMPTY_ROOT_CID == *pin_root());
+	if (empty) _link_format = LINK_FORMAT_IPLD;
 
 	// Special case for TruthValues - must always have this atom.
 	do_store_single_atom(tvpred);
+	if (not empty) return;
+
+	ipfs::Json jatom = encodeAtomToJSON(tvpred);
+	jatom["format"] = (int) LINK_FORMAT_IPLD;
+
+	ipfs::Json result;
+	{
+		IPFSConnPool::ConnGuard conn(conn_pool);
+		_rpc_stats.timed(IPFSRpcStats::DAG_PUT,
+			[&]{ conn->DagPut(jatom, &result); });
+	}
+	{
+		std::lock_guard<std::mutex> lck(_json_mutex);
+		_json_map[tvpred] = jatom;
+	}
+	std::string cid = result["Cid"]["/"];
+	while (not update_atom_in_atomspace(tvpred, cid, _json_gen)) {}
+}
+
+/// The link format of the AtomSpace: the one recorded in the root,
+/// or version 1, if the root has none. Empty roots get the current
+/// version; it is recorded with the first write.
+int IPFSAtomStorage::link_format(void)
+{
+	int fmt = _link_format;
+	if (0 < fmt) return fmt;
+
+	RootPin root = pin_root();
+	if (0 == root->size() or EMPTY_ROOT_CID == *root)
+		return LINK_FORMAT_IPLD;
+
+	ipfs::Json jtv = get_atom_json(tvpred, *root);
+	fmt = LINK_FORMAT_STRINGS;
+	if (jtv.is_object() and jtv.end() != jtv.find("format"))
+		fmt = jtv["format"].get<int>();
+	_link_format = fmt;
+	return fmt;
 }
 
 /* ================================================================ */
@@ -461,32 +955,86 @@ void IPFSAtomStorage::set_stall_writers(bool stall)
 	_write_queue.stall(stall);
 }
 
+/// Set the write-combining window, in milliseconds. Zero turns
+/// write combining off.
+void IPFSAtomStorage::set_write_combine_window(unsigned int msec)
+{
+	{
+		// Start the thread that stores held-back atoms, on first use.
+		std::lock_guard<std::mutex> lck(_combine_mutex);
+		if (0 < msec and not _combine_thread.joinable())
+			_combine_thread = std::thread(combine_thread, this);
+	}
+	_combine_msec = msec;
+	if (0 == msec) flush_combined();
+}
+
 void IPFSAtomStorage::clear_stats(void)
 {
+	// Carry over what the counters counted so far. The lock keeps the
+	// export from seeing both the carry and the counts carried.
+	std::lock_guard<std::mutex> lck(_metrics_mutex);
+	if (0 < _stats_time)
+	{
+		IPFSMetrics m;
+		collect_metrics(m);
+		m.carry_into(_metrics_carry);
+	}
+
 	_stats_time = time(0);
+	_block_cache.clear_stats();
 	_load_count = 0;
 	_store_count = 0;
 	_valuation_stores = 0;
 	_value_stores = 0;
 
 	_write_queue.clear_stats();
+	_io_pool.clear_stats();
+	conn_pool.clear_stats();
+	_rpc_stats.clear_stats();
+	_combined_count = 0;
+	_wb_store_count = 0;
+	_wb_store_usecs = 0;
+	_flow_increases = 0;
+	_flow_backoffs = 0;
+	_flow_stalls = 0;
 
 	_num_get_atoms = 0;
+	_num_get_atom_hits = 0;
+	_num_pending_reads = 0;
 	_num_got_nodes = 0;
 	_num_got_links = 0;
+	_num_shared_fetches = 0;
+	_num_closure_fetches = 0;
+	_num_closure_blocks = 0;
+	_num_root_updates = 0;
+	_num_announces = 0;
+	_num_announces_heard = 0;
+	_resolver->clear_stats();
 	_num_get_insets = 0;
 	_num_get_inlinks = 0;
 	_num_node_inserts = 0;
 	_num_link_inserts = 0;
 	_num_atom_removes = 0;
 	_num_atom_deletes = 0;
+	_num_syncs = 0;
+	_num_sync_fetches = 0;
+	_num_merges = 0;
+	_num_merge_conflicts = 0;
+	_num_commits = 0;
+	_num_commit_conflicts = 0;
+	_num_rebases = 0;
+	_num_value_blocks = 0;
+	_num_value_block_reuses = 0;
+	_num_value_block_fetches = 0;
+	_num_value_block_hits = 0;
 }
 
 void IPFSAtomStorage::print_stats(void)
 {
 	printf("ipfs-stats: Currently open URI: %s\n", _uri.c_str());
-	printf("ipfs-stats: IPNS name: /ipns/%s\n", _key_cid.c_str());
-	printf("ipfs-stats: curr CID : /ipfs/%s\n", _atomspace_cid.c_str());
+	printf("ipfs-stats: IPNS name: %s\n", get_ipns_key().c_str());
+	printf("ipfs-stats: curr CID : /ipfs/%s\n", pin_root()->c_str());
 	time_t now = time(0);
 	// ctime returns string with newline at end of it.
 	printf("ipfs-stats: Time since stats reset=%lu secs, at %s",
@@ -508,9 +1056,36 @@ void IPFSAtomStorage::print_stats(void)
 	size_t num_atom_deletes = _num_atom_deletes;
 	printf("ipfs-stats: atom remove requests = %zu total atom deletes = %zu\n",
 	       num_atom_removes, num_atom_deletes);
+
+	size_t num_syncs = _num_syncs;
+	size_t num_sync_fetches = _num_sync_fetches;
+	printf("ipfs-stats: root syncs = %zu atoms fetched by sync = %zu\n",
+	       num_syncs, num_sync_fetches);
+
+	size_t num_merges = _num_merges;
+	size_t num_merge_conflicts = _num_merge_conflicts;
+	printf("ipfs-stats: root merges = %zu value conflicts = %zu\n",
+	       num_merges, num_merge_conflicts);
+
+	size_t num_commits = _num_commits;
+	size_t num_commit_conflicts = _num_commit_conflicts;
+	size_t num_rebases = _num_rebases;
+	printf("ipfs-stats: root commits = %zu conflicts = %zu rebases = %zu\n",
+	       num_commits, num_commit_conflicts, num_rebases);
+
+	size_t num_value_blocks = _num_value_blocks;
+	size_t num_value_block_reuses = _num_value_block_reuses;
+	printf("ipfs-stats: value blocks stored = %zu reused = %zu\n",
+	       num_value_blocks, num_value_block_reuses);
+	size_t num_value_block_fetches = _num_value_block_fetches;
+	size_t num_value_block_hits = _num_value_block_hits;
+	printf("ipfs-stats: value blocks fetched = %zu cache hits = %zu\n",
+	       num_value_block_fetches, num_value_block_hits);
 	printf("\n");
 
 	size_t num_get_atoms = _num_get_atoms;
+	size_t num_get_atom_hits = _num_get_atom_hits;
+	size_t num_pending_reads = _num_pending_reads;
 	size_t num_got_nodes = _num_got_nodes;
 	size_t num_got_links = _num_got_links;
 	size_t num_get_insets = _num_get_insets;
@@ -518,8 +1093,24 @@ void IPFSAtomStorage::print_stats(void)
 	size_t num_node_inserts = _num_node_inserts;
 	size_t num_link_inserts = _num_link_inserts;
 
+	size_t num_shared_fetches = _num_shared_fetches;
+
 	printf("num_get_atoms=%zu num_got_nodes=%zu num_got_links=%zu\n",
 	       num_get_atoms, num_got_nodes, num_got_links);
+	printf("atoms found in the block cache=%zu\n", num_get_atom_hits);
+	printf("atoms read from the write queue=%zu\n", num_pending_reads);
+	printf("num_shared_fetches=%zu\n", num_shared_fetches);
+	size_t num_closure_fetches = _num_closure_fetches;
+	size_t num_closure_blocks = _num_closure_blocks;
+	_block_cache.print_stats();
+	printf("closure fetches=%zu atoms in them=%zu threshold=%zu\n",
+	       num_closure_fetches, num_closure_blocks, _closure_threshold);
+	size_t num_root_updates = _num_root_updates;
+	size_t num_announces = _num_announces;
+	size_t num_announces_heard = _num_announces_heard;
+	_resolver->print_stats();
+	printf("roots announced=%zu heard=%zu updates of the loaded AtomSpace=%zu\n",
+	       num_announces, num_announces_heard, num_root_updates);
 
 	frac = num_get_inlinks / ((double) num_get_insets);
 	printf("num_get_incoming_sets=%zu set total=%zu avg set size=%f\n",
@@ -534,6 +1125,7 @@ void IPFSAtomStorage::print_stats(void)
 	// Store queue performance
 	unsigned long item_count = _write_queue._item_count;
 	unsigned long duplicate_count = _write_queue._duplicate_count;
+	unsigned long combined_count = _combined_count;
 	unsigned long flush_count = _write_queue._flush_count;
 	unsigned long drain_count = _write_queue._drain_count;
 	unsigned long drain_msec = _write_queue._drain_msec;
@@ -557,6 +1149,8 @@ void IPFSAtomStorage::print_stats(void)
 	       low_water, stalling? "true" : "false");
 	printf("write items=%lu dup=%lu dupe_frac=%f flushes=%lu flush_ratio=%f\n",
 	       item_count, duplicate_count, dupe_frac, flush_count, flush_frac);
+	printf("combine window=%u msecs combined=%lu\n",
+	       (unsigned int) _combine_msec, combined_count);
 	printf("drains=%lu fill_fraction=%f concurrency=%f\n",
 	       drain_count, fill_frac, drain_ratio);
 	printf("avg drain time=%f seconds; longest drain time=%f\n",
@@ -568,8 +1162,244 @@ void IPFSAtomStorage::print_stats(void)
 
 	printf("current conn_pool free=%u of %d\n", conn_pool.size(),
 	       _initial_conn_pool_size);
+	conn_pool.print_stats();
+	_rpc_stats.print_stats();
+
+	size_t pool_tasks = _io_pool._num_tasks;
+	size_t pool_priority = _io_pool._num_priority;
+	size_t pool_steals = _io_pool._num_steals;
+	size_t pool_helped = _io_pool._num_helped;
+	printf("io threads=%zu queued=%zu tasks=%zu priority=%zu\n",
+	       _io_pool.size(), _io_pool.queued(), pool_tasks, pool_priority);
+	printf("io steals=%zu run by waiting threads=%zu\n",
+	       pool_steals, pool_helped);
 
 	printf("\n");
+	print_flow_stats();
+
+	printf("\n");
+}
+
+/* ================================================================ */
+
+/// All of the statistics, as they are right now.
+void IPFSAtomStorage::collect_metrics(IPFSMetrics& m)
+{
+	m.counter("atomspace_ipfs_loads_total",
+	          "Atoms loaded.", _load_count);
+	m.counter("atomspace_ipfs_stores_total",
+	          "Atoms stored.", _store_count);
+	m.counter("atomspace_ipfs_valuation_stores_total",
+	          "Valuation updates stored.", _valuation_stores);
+	m.counter("atomspace_ipfs_value_stores_total",
+	          "Value updates stored.", _value_stores);
+	m.counter("atomspace_ipfs_atom_remove_requests_total",
+	          "Requests to remove atoms.", _num_atom_removes);
+	m.counter("atomspace_ipfs_atom_deletes_total",
+	          "Atoms deleted.", _num_atom_deletes);
+	m.counter("atomspace_ipfs_syncs_total",
+	          "Syncs of the AtomSpace to a new root.", _num_syncs);
+	m.counter("atomspace_ipfs_sync_fetches_total",
+	          "Atoms fetched by syncs.", _num_sync_fetches);
+	m.counter("atomspace_ipfs_merges_total",
+	          "Merges of roots.", _num_merges);
+	m.counter("atomspace_ipfs_merge_conflicts_total",
+	          "Values changed on both sides of a merge.", _num_merge_conflicts);
+	m.counter("atomspace_ipfs_commits_total",
+	          "Roots committed to the registry.", _num_commits);
+	m.counter("atomspace_ipfs_commit_conflicts_total",
+	          "Commits that found another root registered.",
+	          _num_commit_conflicts);
+	m.counter("atomspace_ipfs_rebases_total",
+	          "Roots rebased onto another committed root.", _num_rebases);
+	m.counter("atomspace_ipfs_value_blocks_stored_total",
+	          "Values stored in blocks of their own.", _num_value_blocks);
+	m.counter("atomspace_ipfs_value_block_reuses_total",
+	          "Value blocks that were already stored.",
+	          _num_value_block_reuses);
+	m.counter("atomspace_ipfs_value_block_fetches_total",
+	          "Value blocks fetched.", _num_value_block_fetches);
+	m.counter("atomspace_ipfs_value_block_hits_total",
+	          "Value blocks found in the cache.", _num_value_block_hits);
+
+	m.counter("atomspace_ipfs_atom_fetches_total",
+	          "Atom blocks fetched from IPFS.", _num_get_atoms);
+	m.counter("atomspace_ipfs_atom_cache_hits_total",
+	          "Atom blocks found in the block cache.", _num_get_atom_hits);
+	m.counter("atomspace_ipfs_pending_reads_total",
+	          "Atoms read from the write queue, not yet stored.",
+	          _num_pending_reads);
+	m.counter("atomspace_ipfs_nodes_fetched_total",
+	          "Nodes fetched.", _num_got_nodes);
+	m.counter("atomspace_ipfs_links_fetched_total",
+	          "Links fetched.", _num_got_links);
+	m.counter("atomspace_ipfs_shared_fetches_total",
+	          "Fetches that joined a fetch already under way.",
+	          _num_shared_fetches);
+	m.counter("atomspace_ipfs_closure_fetches_total",
+	          "Subgraphs fetched at once.", _num_closure_fetches);
+	m.counter("atomspace_ipfs_closure_atoms_total",
+	          "Atoms in the subgraphs fetched at once.", _num_closure_blocks);
+	m.counter("atomspace_ipfs_incoming_set_fetches_total",
+	          "Incoming sets fetched.", _num_get_insets);
+	m.counter("atomspace_ipfs_incoming_links_fetched_total",
+	          "Links in the incoming sets fetched.", _num_get_inlinks);
+	m.counter("atomspace_ipfs_node_stores_total",
+	          "Nodes stored.", _num_node_inserts);
+	m.counter("atomspace_ipfs_link_stores_total",
+	          "Links stored.", _num_link_inserts);
+
+	m.counter("atomspace_ipfs_root_updates_total",
+	          "Updates of the loaded AtomSpace to a newer root.",
+	          _num_root_updates);
+	m.counter("atomspace_ipfs_announces_total",
+	          "Roots announced.", _num_announces);
+	m.counter("atomspace_ipfs_announces_heard_total",
+	          "Roots announced by others.", _num_announces_heard);
+	_resolver->collect_metrics(m);
+
+	// Store queue performance
+	m.counter("atomspace_ipfs_write_queue_items_total",
+	          "Atoms put on the write queue.", _write_queue._item_count);
+	m.counter("atomspace_ipfs_write_queue_duplicates_total",
+	          "Atoms put on the write queue while already on it.",
+	          _write_queue._duplicate_count);
+	m.counter("atomspace_ipfs_write_queue_flushes_total",
+	          "Flushes of the write queue.", _write_queue._flush_count);
+	m.counter("atomspace_ipfs_write_queue_drains_total",
+	          "Drains of the write queue.", _write_queue._drain_count);
+	m.counter("atomspace_ipfs_write_queue_concurrent_drains_total",
+	          "Drains that overlapped another drain.",
+	          _write_queue._drain_concurrent);
+	m.counter("atomspace_ipfs_write_queue_drain_seconds_total",
+	          "Time spent draining the write queue.",
+	          0.001 * _write_queue._drain_msec);
+	m.gauge("atomspace_ipfs_write_queue_longest_drain_seconds",
+	        "Longest drain, since the stats were cleared.",
+	        0.001 * _write_queue._drain_slowest_msec);
+	m.gauge("atomspace_ipfs_write_queue_size",
+	        "Atoms on the write queue.", _write_queue.get_size());
+	m.gauge("atomspace_ipfs_write_queue_busy_writers",
+	        "Write-back threads that are storing.",
+	        _write_queue.get_busy_writers());
+	m.gauge("atomspace_ipfs_write_queue_in_drain",
+	        "Whether the write queue is being drained.",
+	        _write_queue._in_drain ? 1 : 0);
+	m.gauge("atomspace_ipfs_write_queue_high_watermark",
+	        "Queue size above which writers are stalled.",
+	        _write_queue.get_high_watermark());
+	m.gauge("atomspace_ipfs_write_queue_low_watermark",
+	        "Queue size below which writers are let go.",
+	        _write_queue.get_low_watermark());
+	m.gauge("atomspace_ipfs_write_queue_stalling",
+	        "Whether writers are stalled when the queue is full.",
+	        _write_queue.stalling() ? 1 : 0);
+	m.counter("atomspace_ipfs_writes_combined_total",
+	          "Stores combined with a later store.", _combined_count);
+	m.gauge("atomspace_ipfs_write_combine_window_seconds",
+	        "Window for combining stores.", 0.001 * _combine_msec);
+	m.counter("atomspace_ipfs_writeback_stores_total",
+	          "Atoms stored by the write-back threads.", _wb_store_count);
+	m.counter("atomspace_ipfs_writeback_store_seconds_total",
+	          "Time taken by the write-back threads to store.",
+	          1.0e-6 * _wb_store_usecs);
+	collect_flow_metrics(m);
+
+	m.gauge("atomspace_ipfs_conn_pool_size",
+	        "Connections to the IPFS daemon.", _initial_conn_pool_size);
+	conn_pool.collect_metrics(m);
+	_rpc_stats.collect_metrics(m);
+
+	m.counter("atomspace_ipfs_io_tasks_total",
+	          "Tasks run by the I/O threads.", _io_pool._num_tasks);
+	m.counter("atomspace_ipfs_io_priority_tasks_total",
+	          "Tasks run ahead of the others.", _io_pool._num_priority);
+	m.counter("atomspace_ipfs_io_steals_total",
+	          "Tasks taken from the queue of another thread.",
+	          _io_pool._num_steals);
+	m.counter("atomspace_ipfs_io_helped_total",
+	          "Tasks run by threads waiting on them.", _io_pool._num_helped);
+	m.gauge("atomspace_ipfs_io_threads",
+	        "I/O threads.", _io_pool.size());
+	m.gauge("atomspace_ipfs_io_queued",
+	        "Tasks waiting for an I/O thread.", _io_pool.queued());
+
+	_block_cache.collect_metrics(m);
+}
+
+/// Return the statistics in the Prometheus text format, or as json.
+std::string IPFSAtomStorage::get_metrics(bool json)
+{
+	IPFSMetrics m;
+	{
+		std::lock_guard<std::mutex> lck(_metrics_mutex);
+		collect_metrics(m);
+		m.add_carry(_metrics_carry);
+	}
+	return json ? m.json() : m.prometheus();
+}
+
+/// Write the statistics to the file every `secs` seconds. The file
+/// is json if its name ends in `.json`, and otherwise it is in the
+/// Prometheus text format. Zero seconds stops the writing.
+void IPFSAtomStorage::set_metrics_file(const std::string& path,
+                                       unsigned int secs)
+{
+	{
+		// Start the thread that writes the file, on first use.
+		std::lock_guard<std::mutex> lck(_metrics_file_mutex);
+		_metrics_path = path;
+		_metrics_secs = secs;
+		if (0 < secs and not _metrics_thread.joinable())
+			_metrics_thread = std::thread(metrics_thread, this);
+	}
+	_metrics_file_cv.notify_one();
+}
+
+void IPFSAtomStorage::metrics_thread(IPFSAtomStorage* self)
+{
+	std::unique_lock<std::mutex> lck(self->_metrics_file_mutex);
+	while (self->_metrics_keep_going)
+	{
+		if (0 == self->_metrics_secs)
+		{
+			self->_metrics_file_cv.wait(lck);
+			continue;
+		}
+
+		std::string path = self->_metrics_path;
+		unsigned int secs = self->_metrics_secs;
+		lck.unlock();
+		self->write_metrics(path);
+		lck.lock();
+
+		self->_metrics_file_cv.wait_for(lck, std::chrono::seconds(secs));
+	}
+}
+
+/// Write to a temp file, and rename it into place, so that whoever
+/// reads the file never sees a half-written one.
+void IPFSAtomStorage::write_metrics(const std::string& path)
+{
+	static const std::string jext = ".json";
+	bool json = jext.size() < path.size() and
+		0 == path.compare(path.size() - jext.size(), jext.size(), jext);
+	std::string text = get_metrics(json);
+
+	std::string tmp = path + ".tmp";
+	FILE* fh = fopen(tmp.c_str(), "w");
+	if (nullptr == fh)
+	{
+		fprintf(stderr, "Unable to write metrics to %s\n", tmp.c_str());
+		return;
+	}
+	bool ok = (text.size() == fwrite(text.data(), 1, text.size(), fh));
+	ok = (0 == fclose(fh)) and ok;
+	if (not ok or rename(tmp.c_str(), path.c_str()))
+	{
+		fprintf(stderr, "Unable to write metrics to %s\n", path.c_str());
+		remove(tmp.c_str());
+	}
 }
 
 /* ============================= END OF FILE ================= */
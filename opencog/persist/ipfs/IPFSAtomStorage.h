@@ -16,9 +16,15 @@
 #define _OPENCOG_IPFS_ATOM_STORAGE_H
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <set>
+#include <thread>
 #include <vector>
 
 #include <ipfs/client.h>
@@ -37,65 +43,202 @@
 #include <opencog/atomspace/AtomTable.h>
 #include <opencog/atomspace/BackingStore.h>
 
+#include "IPFSAnnouncer.h"
+#include "IPFSBlockCache.h"
+#include "IPFSConnPool.h"
+#include "IPFSIOPool.h"
+#include "IPFSMetrics.h"
+#include "IPFSResolver.h"
+#include "IPFSRootRegistry.h"
+
 namespace opencog
 {
 /** \addtogroup grp_persist
  *  @{
  */
 
-// Number of threads do use for IPFS I/O.
-#define NUM_OMP_THREADS 1
+// Default number of threads to use for IPFS I/O. This can be changed
+// with the `io-threads` URI option.
+#define NUM_IO_THREADS 4
+
+// Default number of IPFS connections kept for foreground reads. This
+// can be changed with the `read-conns` URI option.
+#define NUM_READ_CONNS 2
+
+// Default number of unknown atoms, in one level of an outgoing set,
+// above which the whole subgraph is fetched in one request. This can
+// be changed with the `closure-threshold` URI option; zero turns the
+// closure fetch off.
+#define CLOSURE_THRESHOLD 16
+
+class IPFSAtomCursor;
+class TVBench;
 
 class IPFSAtomStorage : public BackingStore
 {
+	friend class IPFSAtomCursor;
+	friend class TVBench; // tvbench.cc times the value encoders.
+	public:
+		// How to resolve Values changed by both sides of a merge.
+		enum MergeRule { MERGE_OURS, MERGE_THEIRS };
+
 	private:
 		void init(const char *);
 		std::string _uri;
 		std::string _hostname;
 		int _port;
 
+		// Options given in the URI, after the question mark, e.g.
+		//    ipfs:///atomspace-key?io-threads=8&wb-queues=4
+		static size_t get_uri_option(const std::string&, const char*,
+		                             size_t);
+		size_t _io_threads;
+		size_t _wb_queues;
+
 		// Pool of shared connections
-		concurrent_stack<ipfs::Client*> conn_pool;
+		IPFSConnPool conn_pool;
 		int _initial_conn_pool_size;
 
 		Handle tvpred; // the key to a very special valuation.
+		std::string _tvpred_str; // ... and its encoded form.
 
 		// ---------------------------------------------
 		// IPNS Publication happens in it's own thread, because
 		// it's slow. That means it needs a semaphore.
+		std::mutex _publish_mutex;
 		std::condition_variable _publish_cv;
+		bool _publish_pending;
 		bool _publish_keep_going;
+		std::thread _publish_thread;
 		static void publish_thread(IPFSAtomStorage*);
 
 		// The Main IPNS key under which to publish the AtomSpace.
+		// Finding it in the daemon is slow, and making it even more
+		// so; the key IDs are cached locally, and if it's not there,
+		// it's found or made in the background. Use `key_cid()` to
+		// get the ID; it waits for the key, if need be.
 		std::string _keyname;
 		std::string _key_cid;
+		std::thread _key_thread;
+		std::shared_future<void> _key_ready;
+		std::string key_cache_path(void);
+		void find_key(void);
+		void key_found(void);
+		bool has_key(void) {
+			return 0 < _keyname.size() or 0 < _key_cid.size(); }
+		const std::string& key_cid(void);
+
+		// IPNS resolution also happens in it's own thread; the last
+		// resolution is cached, so that nobody waits for it twice.
+		// When the key resolves to a new root, the AtomSpace that was
+		// loaded from the old root can be brought up to date.
+		IPFSResolver* _resolver;
+		std::atomic<bool> _ipns_refresh;
+		std::mutex _refresh_mutex;
+		AtomSpace* _refresh_as;
+		std::string _loaded_root;
+		void ipns_updated(const std::string&, const std::string&);
+		void follow_root(const std::string&);
+
+		// New roots are announced to the other users of the AtomSpace
+		// right away, instead of waiting for IPNS; see IPFSAnnouncer.
+		// The nonce tells our own announcements apart from theirs.
+		// Anyone can announce anything, so an announced root is only
+		// followed once the key resolves to it.
+		IPFSAnnouncer* _announcer;
+		std::string _announce_topic;
+		std::string _announce_nonce;
+		std::mutex _announce_mutex;
+		std::string _last_announced;
+		std::string _announced_root;
+		void announce_root(void);
+		void root_announced(const std::string&);
+
+		// With a root registry, roots are committed with a compare
+		// and swap; see IPFSCommit.cc. The base is the committed root
+		// that the current root was built on; the last seen root is
+		// the one that the next swap expects to find.
+		IPFSRootRegistry* _registry;
+		std::string _commit_base;
+		std::string _commit_seen;
+		std::string rebase_root(const std::string&, const std::string&,
+		                        const std::string&, std::set<std::string>&,
+		                        std::map<Handle, ipfs::Json>&);
 
 		// ---------------------------------------------
-		// The IPFS CID of the current atomspace.
+		// The IPFS CID of the current atomspace. Writers serialize
+		// on the mutex, and publish each new root with an atomic
+		// store. Readers never lock: they pin the current root once,
+		// with an atomic load, and resolve every fetch of a multi-step
+		// read against that pin, so they always see a single root.
+		typedef std::shared_ptr<const std::string> RootPin;
 		std::mutex _atomspace_cid_mutex;
-		std::string _atomspace_cid;
-		void update_atom_in_atomspace(const Handle&,
-		                              const std::string&);
+		RootPin _atomspace_root;
+		RootPin pin_root(void) const {
+			return std::atomic_load(&_atomspace_root); }
+		void set_root(const std::string& cid) {
+			std::atomic_store(&_atomspace_root,
+			                  RootPin(std::make_shared<const std::string>(cid))); }
+		bool update_atom_in_atomspace(const Handle&,
+		                              const std::string&, size_t);
+
+		// A new AtomSpace starts out with the empty root, and the
+		// special atoms are stored with the first write.
+		std::atomic<bool> _fresh_root;
+		void ensure_root(void);
 		std::mutex _json_mutex;
 		std::map<Handle, ipfs::Json> _json_map;
+
+		// Bumped, under both mutexes, when a rebase replaces cached
+		// json. Stores note it when they take the json, and are
+		// built again if it changed before they got to the root.
+		std::atomic<size_t> _json_gen;
 		ipfs::Json get_atom_json(const Handle&);
+		ipfs::Json get_atom_json(const Handle&, const std::string&);
 
 		// ---------------------------------------------
 		// Fetching of atoms.
-		ipfs::Json fetch_atom_dag(const std::string&);
+		ipfs::Json fetch_atom_dag(const std::string&,
+		                          ipfs::Client* = nullptr);
 		Handle decodeStrAtom(const std::string&);
-		Handle decodeJSONAtom(const ipfs::Json&);
+		typedef std::unordered_map<std::string, Handle> GuidMap;
+		Handle decodeJSONAtom(const ipfs::Json&, GuidMap* = nullptr);
+		Handle lookup_guid(const std::string&);
+		static std::string json_guid(const ipfs::Json&);
+		void fetch_guid_dags(const std::vector<std::string>&,
+		                     std::unordered_map<std::string, ipfs::Json>&);
+
+		// Fetch of whole subgraphs, with one dag/export request.
+		// Used when more than _closure_threshold atoms of one level
+		// of an outgoing set are not yet known.
+		size_t _closure_threshold;
+		static void curl_init(void);
+		std::string dag_export(const std::string&);
+		void fetch_closure(const std::vector<std::string>&,
+		                   std::unordered_map<std::string, ipfs::Json>&);
 		Handle do_fetch_atom(Handle&);
+		Handle do_fetch_atom(Handle&, const std::string&);
 
 		// --------------------------
 		// Storing of atoms
 
 		std::string encodeValueToStr(const ValuePtr&);
+		std::string encodeFloatToStr(double);
+		double decodeStrToFloat(const std::string&, size_t&);
 		std::string encodeAtomToStr(const Handle& h) {
 			return h->to_short_string(); }
 		ipfs::Json encodeAtomToJSON(const Handle&);
 
+		// The encoding of outgoing sets. Version 1 holds the guids as
+		// plain strings; version 2 as IPLD links, so that the daemon
+		// can walk them; see IPFSClosure.cc. The guid of a link
+		// depends on the version, and so an AtomSpace keeps the one
+		// that it was made with. New roots record it in the entry of
+		// the TruthValue key; roots without it are version 1.
+		enum { LINK_FORMAT_STRINGS = 1, LINK_FORMAT_IPLD = 2 };
+		std::atomic<int> _link_format;
+		int link_format(void);
+
 		std::mutex _guid_mutex;
 		std::unordered_map<Handle, std::string> _guid_map;
 
@@ -103,6 +246,11 @@ class IPFSAtomStorage : public BackingStore
 		std::mutex _inv_mutex;
 		std::unordered_map<std::string, Handle> _guid_inv_map;
 
+		// Guids being fetched right now, so that concurrent fetches
+		// of the same guid share a single request. Under _inv_mutex.
+		std::unordered_map<std::string,
+		                   std::shared_future<ipfs::Json>> _guid_inflight;
+
 		std::mutex _atom_cid_mutex;
 		std::unordered_map<Handle, std::string> _atom_cid_map;
 
@@ -112,6 +260,41 @@ class IPFSAtomStorage : public BackingStore
 
 		bool guid_not_yet_stored(const Handle&);
 
+		// Atoms queued for storing, but not yet stored, each with
+		// the generation of its latest storeAtom() call. Reads look
+		// here first, so that a process always sees its own writes.
+		// The pending links are also indexed by their outgoing atoms,
+		// for the incoming-set fetches.
+		std::mutex _pending_mutex;
+		std::map<Handle, size_t> _pending_writes;
+		std::map<Handle, HandleSet> _pending_incoming;
+		size_t _pending_gen;
+		void note_pending_write(const Handle&);
+		size_t pending_write_gen(const Handle&);
+		void done_pending_write(const Handle&, size_t);
+		Handle get_pending_write(const Handle&);
+		bool have_pending_writes(void);
+		HandleSeq get_pending_incoming(const Handle&);
+
+		// --------------------------
+		// Write combining. Atoms that are stored again, before the
+		// window since their last store has closed, are held back
+		// until it closes. Then only their latest state is stored.
+		typedef std::chrono::steady_clock::time_point combine_time;
+		std::atomic<unsigned int> _combine_msec;
+		std::mutex _combine_mutex;
+		std::condition_variable _combine_cv;
+		std::condition_variable _combine_idle_cv;
+		std::unordered_map<Handle, combine_time> _last_store_time;
+		std::unordered_map<Handle, combine_time> _combine_pending;
+		size_t _combine_busy;
+		bool _combine_keep_going;
+		std::thread _combine_thread;
+		static void combine_thread(IPFSAtomStorage*);
+		bool combine_store(const Handle&);
+		void store_combined(const HandleSeq&);
+		void flush_combined(void);
+
 		// --------------------------
 		// Bulk load and store
 		bool bulk_load;
@@ -126,18 +309,108 @@ class IPFSAtomStorage : public BackingStore
 		void get_atom_values(Handle &, const ipfs::Json&);
 
 		ipfs::Json encodeValuesToJSON(const Handle&);
+		ipfs::Json encodeValueToJSON(const ValuePtr&);
+		ipfs::Json encodeTVToJSON(const Handle&);
+		ValuePtr decodeJSONValue(const ipfs::Json&);
 		ValuePtr decodeStrValue(const std::string&);
 
+		// Values whose encoding is at least this long are stored in
+		// blocks of their own, and are shared by all Atoms holding
+		// the same Value. Zero means that all Values are inlined.
+		std::atomic<size_t> _value_block_size;
+		std::mutex _value_block_mutex;
+		std::unordered_map<std::string, std::string> _value_cid_map;
+		std::unordered_map<std::string, ValuePtr> _cid_value_map;
+
+		// Optional restriction on the keys of the values that get
+		// loaded. The allow-list holds the encoded key strings, so
+		// that unwanted keys can be skipped without parsing them.
+		// The filter is copied out under the mutex, and applied
+		// outside of it; the allow-list is shared, and never changed
+		// in place, so that the copy is cheap.
+		typedef std::shared_ptr<const std::set<std::string>> KeyAllow;
+		std::mutex _key_filter_mutex;
+		KeyAllow _key_allow;
+		std::function<bool(const Handle&)> _key_pred;
+		void get_key_filter(KeyAllow&, std::function<bool(const Handle&)>&);
+		Handle decodeWantedKey(const std::string&);
+		bool want_tv(void);
+		bool have_key_filter(void);
+
+		// --------------------------
+		// Snapshots
+		size_t flatten_atoms(const HandleSeq&, HandleSeq&);
+		std::string put_file(const std::string&);
+		std::string get_file(const std::string&);
+		void load_snapshot_atoms(AtomTable&, const std::string&, HandleSeq&);
+
+		// --------------------------
+		// Comparison of AtomSpace roots. Maps the Atom label to the
+		// CID of the Atom-with-values.
+		typedef std::map<std::string, std::string> RootEntries;
+		std::string path_to_cid(const std::string&);
+		void get_root_entries(const std::string&, RootEntries&);
+		std::string merge_atom(const std::string&, const std::string&,
+		                       const std::string&, MergeRule,
+		                       ipfs::Client*);
+		std::string merge_roots(const RootEntries&, const RootEntries&,
+		                        const RootEntries&, const std::string&,
+		                        MergeRule);
+
+		// --------------------------
+		// Local image cache, for read-only AtomSpaces.
+		bool _read_only;
+		std::string cache_dir(const std::string&);
+		std::string image_path(const std::string&);
+		bool load_image(AtomSpace*, const std::string&);
+		void save_image(const std::string&, const HandleSeq&);
+
 		// --------------------------
 		// Incoming set management
 		void store_incoming_of(const Handle &, const Handle&);
 		void remove_incoming_of(const Handle &, const std::string&);
 
+		// --------------------------
+		// Adaptive flow control of the write-back queue. Writers
+		// wait at a gate, which lets at most `_flow_writers` of them
+		// store at the same time. Unless flow control is on, or the
+		// writers are capped, the gate stands open, and is skipped.
+		std::mutex _flow_mutex;
+		std::condition_variable _flow_cv;
+		std::condition_variable _flow_tick_cv;
+		bool _flow_adaptive;
+		std::atomic<bool> _flow_gated;
+		bool _flow_keep_going;
+		std::thread _flow_thread;
+		int _flow_max_writers;
+		int _flow_writers;
+		int _flow_active;
+		int _flow_peak;
+		double _flow_rate;
+		double _flow_latency;
+		double _flow_min_latency;
+		size_t _flow_last_depth;
+		std::string _flow_decision;
+		static void flow_thread(IPFSAtomStorage*);
+		void flow_adjust(double, size_t&, size_t&);
+		bool flow_enter(void);
+		void flow_leave(bool);
+		void print_flow_stats(void);
+		void collect_flow_metrics(IPFSMetrics&);
+
 		// --------------------------
 		// Performance statistics
 		std::atomic<size_t> _num_get_atoms;
+		std::atomic<size_t> _num_get_atom_hits;
+		std::atomic<size_t> _num_pending_reads;
 		std::atomic<size_t> _num_got_nodes;
 		std::atomic<size_t> _num_got_links;
+		std::atomic<size_t> _num_shared_fetches;
+		std::atomic<size_t> _num_closure_fetches;
+		std::atomic<size_t> _num_closure_blocks;
+		std::atomic<size_t> _num_root_updates;
+		std::atomic<size_t> _num_announces;
+		std::atomic<size_t> _num_announces_heard;
 		std::atomic<size_t> _num_get_insets;
 		std::atomic<size_t> _num_get_inlinks;
 		std::atomic<size_t> _num_node_inserts;
@@ -148,8 +421,68 @@ class IPFSAtomStorage : public BackingStore
 		std::atomic<size_t> _store_count;
 		std::atomic<size_t> _valuation_stores;
 		std::atomic<size_t> _value_stores;
+		std::atomic<size_t> _num_syncs;
+		std::atomic<size_t> _num_sync_fetches;
+		std::atomic<size_t> _num_merges;
+		std::atomic<size_t> _num_merge_conflicts;
+		std::atomic<size_t> _num_commits;
+		std::atomic<size_t> _num_commit_conflicts;
+		std::atomic<size_t> _num_rebases;
+		std::atomic<size_t> _num_value_blocks;
+		std::atomic<size_t> _num_value_block_reuses;
+		std::atomic<size_t> _num_value_block_fetches;
+		std::atomic<size_t> _num_value_block_hits;
+		std::atomic<size_t> _combined_count;
+		std::atomic<size_t> _wb_store_count;
+		std::atomic<size_t> _wb_store_usecs;
+		std::atomic<size_t> _flow_increases;
+		std::atomic<size_t> _flow_backoffs;
+		std::atomic<size_t> _flow_stalls;
 		time_t _stats_time;
 
+		// --------------------------
+		// Export of the statistics; see IPFSMetrics. Counters carry
+		// over what they counted before the stats were cleared, so
+		// that the exported counters never go down. The export can
+		// also be written to a file, every so often.
+		IPFSRpcStats _rpc_stats;
+		std::mutex _metrics_mutex;
+		IPFSMetrics::Carry _metrics_carry;
+		void collect_metrics(IPFSMetrics&);
+
+		std::mutex _metrics_file_mutex;
+		std::condition_variable _metrics_file_cv;
+		std::string _metrics_path;
+		unsigned int _metrics_secs;
+		bool _metrics_keep_going;
+		std::thread _metrics_thread;
+		static void metrics_thread(IPFSAtomStorage*);
+		void write_metrics(const std::string&);
+
+		// --------------------------
+		// Speculative fetch of the neighborhood of incoming sets,
+		// for traversals that go hop by hop. The cache must be
+		// declared before the I/O pool, which fills it. What one
+		// traversal step may prefetch is limited by a budget, shared
+		// by all of the fetches queued for that step.
+		IPFSBlockCache _block_cache;
+		std::atomic<int> _prefetch_depth;
+		struct PrefetchBudget
+		{
+			std::atomic<long> atoms;
+			std::atomic<long> bytes;
+		};
+		typedef std::shared_ptr<PrefetchBudget> PrefetchBudgetPtr;
+		void prefetch_neighbors(const Handle&, const HandleSeq&,
+		                        const RootPin&);
+		void prefetch_block(const std::string&, int,
+		                    const PrefetchBudgetPtr&);
+
+		// --------------------------
+		// Threads that run all fetches and stores. This must be
+		// declared before the write queue, which submits to it.
+		IPFSIOPool _io_pool;
+
 		// --------------------------
 		// Provider of asynchronous store of atoms.
 		// async_caller<IPFSAtomStorage, Handle> _write_queue;
@@ -171,9 +504,22 @@ class IPFSAtomStorage : public BackingStore
 		std::string get_atom_guid(const Handle&);
 		Handle fetch_atom(const std::string&);
 		void load_atomspace(AtomSpace*, const std::string&);
+		HandleSeq sync_atomspace(AtomSpace*, const std::string&,
+		                         const std::string&);
+		std::string merge_atomspace(const std::string&, const std::string&,
+		                            const std::string&, MergeRule = MERGE_OURS);
+		std::string commit_root(void);
 
 		void kill_data(void); // destroy DB contents
 
+		// Restrict value loading to only some keys.
+		void set_value_keys(const HandleSeq&);
+		void set_value_key_predicate(std::function<bool(const Handle&)>);
+		void clear_value_key_filter(void);
+
+		// Store large Values in blocks of their own.
+		void set_value_block_size(size_t);
+
 		void registerWith(AtomSpace*);
 		void unregisterWith(AtomSpace*);
 		void extract_callback(const AtomPtr&);
@@ -184,19 +530,37 @@ class IPFSAtomStorage : public BackingStore
 		Handle getLink(Type, const HandleSeq&);
 		void getIncomingSet(AtomTable&, const Handle&);
 		void getIncomingByType(AtomTable&, const Handle&, Type t);
+		void loadNeighborhood(AtomTable&, const Handle&, int hops);
+
+		// Scans over the stored atoms; see IPFSAtomCursor.
+		std::vector<std::string> root_atom_cids(const std::string&);
+		HandleSeq fetch_atoms(const std::vector<std::string>&, bool values);
 		void storeAtom(const Handle&, bool synchronous = false);
+		void storeValue(const Handle& atom, const Handle& key);
+		void loadValue(const Handle& atom, const Handle& key);
 		void removeAtom(const Handle&, bool recursive);
 		void loadType(AtomTable&, Type);
 		void loadAtomSpace(AtomTable&); // Load entire contents
 		void storeAtomSpace(const AtomTable&); // Store entire contents
+
+		// Packed snapshots of entire AtomSpaces
+		std::string snapshot_atomspace(const AtomTable&);
+		void load_snapshot(AtomTable&, const std::string&);
 		void barrier();
 		void flushStoreQueue();
 
 		// Debugging and performance monitoring
 		void print_stats(void);
 		void clear_stats(void); // reset stats counters.
+		std::string get_metrics(bool json);
+		void set_metrics_file(const std::string&, unsigned int secs);
 		void set_hilo_watermarks(int, int);
 		void set_stall_writers(bool);
+		void set_write_combine_window(unsigned int);
+		void set_adaptive_flow(bool);
+		void set_prefetch(size_t);
+		void set_prefetch_depth(int);
+		void set_ipns_refresh(bool);
 };
 
 
@@ -32,15 +32,28 @@ void IPFSAtomStorage::storeAtom(const Handle& h, bool synchronous)
 {
 	rethrow();
 
-	// If a synchronous store, avoid the queues entirely.
+	// If a synchronous store, avoid the queues entirely. It is still
+	// pending, until it is done; see have_pending_writes().
 	if (synchronous)
 	{
-		if (guid_not_yet_stored(h)) do_store_atom(h);
-		store_atom_values(h);
+		note_pending_write(h);
+		size_t gen = pending_write_gen(h);
+		try
+		{
+			if (guid_not_yet_stored(h)) do_store_atom(h);
+			store_atom_values(h);
+		}
+		catch (...)
+		{
+			done_pending_write(h, gen);
+			throw;
+		}
+		done_pending_write(h, gen);
 		return;
 	}
 
 	// _write_queue.enqueue(h);
+	note_pending_write(h);
 	_write_queue.insert(h);
 }
 
@@ -79,17 +92,171 @@ void IPFSAtomStorage::do_store_atom(const Handle& h)
 /// when it gets dequeued, this method is called to store it.
 /// Take careful note of the design here: the only things that
 ///
+/// The store itself is run as a task in the I/O pool, so that reads
+/// and writes share the same threads. While waiting for it, this
+/// thread runs other queued I/O tasks, reads included.
 void IPFSAtomStorage::vdo_store_atom(const Handle& h)
 {
+	size_t gen = pending_write_gen(h);
 	try
 	{
-		do_store_atom(h);
-		store_atom_values(h);
+		if (0 < _combine_msec and combine_store(h)) return;
+
+		bool gated = flow_enter();
+		auto start = std::chrono::steady_clock::now();
+		try
+		{
+			_io_pool.run([&](void)
+			{
+				IPFSConnPool::ClassGuard bg(IPFSConnPool::BACKGROUND);
+				do_store_atom(h);
+				store_atom_values(h);
+			});
+		}
+		catch (...)
+		{
+			flow_leave(gated);
+			throw;
+		}
+		flow_leave(gated);
+
+		auto usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start);
+		_wb_store_usecs += usecs.count();
+		_wb_store_count++;
 	}
 	catch (...)
 	{
 		_async_write_queue_exception = std::current_exception();
 	}
+	done_pending_write(h, gen);
+}
+
+/* ================================================================ */
+
+/// Write combining. Counters and the like are stored over and over,
+/// in bursts; each store results in a DagPut of the atom, and a patch
+/// of the AtomSpace root. If the atom was last stored less than the
+/// combine window ago, then hold it back, until that window closes.
+/// Any further stores of it, while it is being held, are combined
+/// into one; it is the state of the atom at the end of the window
+/// that gets stored. Return true if the atom was held back.
+bool IPFSAtomStorage::combine_store(const Handle& h)
+{
+	combine_time now = std::chrono::steady_clock::now();
+	std::chrono::milliseconds window(_combine_msec);
+
+	std::lock_guard<std::mutex> lck(_combine_mutex);
+	if (_combine_pending.end() != _combine_pending.find(h))
+	{
+		_combined_count++;
+		return true;
+	}
+
+	auto plast = _last_store_time.find(h);
+	if (_last_store_time.end() != plast and now < plast->second + window)
+	{
+		_combine_pending[h] = plast->second + window;
+		_combine_cv.notify_one();
+		return true;
+	}
+
+	_last_store_time[h] = now;
+	return false;
+}
+
+/// Store the atoms that were held back.
+void IPFSAtomStorage::store_combined(const HandleSeq& hseq)
+{
+	IPFSConnPool::ClassGuard bg(IPFSConnPool::BACKGROUND);
+	for (const Handle& h: hseq)
+	{
+		size_t gen = pending_write_gen(h);
+		try
+		{
+			do_store_atom(h);
+			store_atom_values(h);
+		}
+		catch (...)
+		{
+			_async_write_queue_exception = std::current_exception();
+		}
+		done_pending_write(h, gen);
+	}
+}
+
+/// Store the held-back atoms as their windows close.
+void IPFSAtomStorage::combine_thread(IPFSAtomStorage* self)
+{
+	std::unique_lock<std::mutex> lck(self->_combine_mutex);
+	while (self->_combine_keep_going)
+	{
+		combine_time now = std::chrono::steady_clock::now();
+		combine_time next = now + std::chrono::seconds(1);
+
+		HandleSeq due;
+		auto pend = self->_combine_pending.begin();
+		while (self->_combine_pending.end() != pend)
+		{
+			if (pend->second <= now)
+			{
+				due.push_back(pend->first);
+				pend = self->_combine_pending.erase(pend);
+				continue;
+			}
+			if (pend->second < next) next = pend->second;
+			pend++;
+		}
+
+		if (0 == due.size())
+		{
+			// Forget atoms whose window has closed long ago.
+			std::chrono::milliseconds window(self->_combine_msec);
+			auto last = self->_last_store_time.begin();
+			while (self->_last_store_time.end() != last)
+			{
+				if (last->second + window < now)
+					last = self->_last_store_time.erase(last);
+				else
+					last++;
+			}
+			self->_combine_cv.wait_until(lck, next);
+			continue;
+		}
+
+		for (const Handle& h: due)
+			self->_last_store_time[h] = now;
+
+		self->_combine_busy++;
+		lck.unlock();
+		self->store_combined(due);
+		lck.lock();
+		self->_combine_busy--;
+		self->_combine_idle_cv.notify_all();
+	}
+}
+
+/// Store all held-back atoms right away, and wait for any stores of
+/// held-back atoms, in the combine thread, to finish.
+void IPFSAtomStorage::flush_combined(void)
+{
+	std::unique_lock<std::mutex> lck(_combine_mutex);
+	HandleSeq due;
+	combine_time now = std::chrono::steady_clock::now();
+	for (const auto& pend: _combine_pending)
+	{
+		due.push_back(pend.first);
+		_last_store_time[pend.first] = now;
+	}
+	_combine_pending.clear();
+
+	if (0 < due.size())
+	{
+		lck.unlock();
+		store_combined(due);
+		lck.lock();
+	}
+	_combine_idle_cv.wait(lck, [this] { return 0 == _combine_busy; });
 }
 
 bool IPFSAtomStorage::guid_not_yet_stored(const Handle& h)
@@ -100,6 +267,86 @@ bool IPFSAtomStorage::guid_not_yet_stored(const Handle& h)
 
 /* ================================================================ */
 
+/// Record that the atom is queued for storing. The atom itself is
+/// kept, as it holds the values that are to be stored.
+void IPFSAtomStorage::note_pending_write(const Handle& h)
+{
+	std::lock_guard<std::mutex> lck(_pending_mutex);
+	_pending_gen++;
+	auto pw = _pending_writes.find(h);
+	if (_pending_writes.end() != pw)
+	{
+		pw->second = _pending_gen;
+		return;
+	}
+	_pending_writes.insert({h, _pending_gen});
+	if (h->is_link())
+		for (const Handle& ho: h->getOutgoingSet())
+			_pending_incoming[ho].insert(h);
+}
+
+/// Return the generation of the latest pending write of the atom,
+/// or zero, if there is none.
+size_t IPFSAtomStorage::pending_write_gen(const Handle& h)
+{
+	std::lock_guard<std::mutex> lck(_pending_mutex);
+	auto pw = _pending_writes.find(h);
+	if (_pending_writes.end() == pw) return 0;
+	return pw->second;
+}
+
+/// The store that was started at generation `gen` is done. If the
+/// atom was queued again since then, it is still pending.
+void IPFSAtomStorage::done_pending_write(const Handle& h, size_t gen)
+{
+	std::lock_guard<std::mutex> lck(_pending_mutex);
+	auto pw = _pending_writes.find(h);
+	if (_pending_writes.end() == pw or pw->second != gen) return;
+
+	if (h->is_link())
+	{
+		for (const Handle& ho: h->getOutgoingSet())
+		{
+			auto pi = _pending_incoming.find(ho);
+			if (_pending_incoming.end() == pi) continue;
+			pi->second.erase(pw->first);
+			if (0 == pi->second.size()) _pending_incoming.erase(pi);
+		}
+	}
+	_pending_writes.erase(pw);
+}
+
+/// Return true if any stores are queued, or under way. Until these
+/// are done, the root does not hold all of the local changes.
+bool IPFSAtomStorage::have_pending_writes(void)
+{
+	if (0 < _write_queue.get_size()) return true;
+	std::lock_guard<std::mutex> lck(_pending_mutex);
+	return 0 < _pending_writes.size();
+}
+
+/// Return the atom queued for storing that is the same as `h`, or
+/// the null handle, if it is not queued.
+Handle IPFSAtomStorage::get_pending_write(const Handle& h)
+{
+	std::lock_guard<std::mutex> lck(_pending_mutex);
+	auto pw = _pending_writes.find(h);
+	if (_pending_writes.end() == pw) return Handle();
+	return pw->first;
+}
+
+/// Return the links queued for storing that contain `h`. These are
+/// not yet in the stored incoming set of `h`.
+HandleSeq IPFSAtomStorage::get_pending_incoming(const Handle& h)
+{
+	std::lock_guard<std::mutex> lck(_pending_mutex);
+	auto pi = _pending_incoming.find(h);
+	if (_pending_incoming.end() == pi) return HandleSeq();
+	return HandleSeq(pi->second.begin(), pi->second.end());
+}
+
+/* ================================================================ */
+
 /// Convert a single C++ Atom into a json expression.
 /// But only the minimalist Atom itself, and not any Values,
 /// nor any of it's incoming set. So the resulting Json is
@@ -116,11 +363,19 @@ ipfs::Json IPFSAtomStorage::encodeAtomToJSON(const Handle& h)
 	else
 	if (h->is_link())
 	{
+		// The outgoing set is a list of IPLD links, so that the
+		// daemon can walk the whole subgraph under a link; see
+		// fetch_closure(). AtomSpaces made before that keep plain
+		// strings, so that their links keep their guids.
+		bool ipld = (LINK_FORMAT_IPLD == link_format());
 		ipfs::Json oset;
 		int i=0;
 		for (const Handle& hout: h->getOutgoingSet())
 		{
-			oset[i] = get_atom_guid(hout);
+			if (ipld)
+				oset[i] = {{"/", get_atom_guid(hout)}};
+			else
+				oset[i] = get_atom_guid(hout);
 			i++;
 		}
 		jatom["outgoing"] = oset;
@@ -150,7 +405,8 @@ void IPFSAtomStorage::do_store_single_atom(const Handle& h)
 	// We can't just catch here, we need to re-throw too.
 	ipfs::Json result;
 	ipfs::Client* conn = conn_pool.pop();
-	conn->DagPut(jatom, &result);
+	_rpc_stats.timed(IPFSRpcStats::DAG_PUT,
+		[&]{ conn->DagPut(jatom, &result); });
 	conn_pool.push(conn);
 
 	std::string guid = result["Cid"]["/"];
@@ -166,7 +422,9 @@ void IPFSAtomStorage::do_store_single_atom(const Handle& h)
 	}
 
 	// OK, the atom itself is in IPFS; add it to the atomspace, too.
-	update_atom_in_atomspace(h, guid);
+	// Its json does not come from the cache, so that any json
+	// generation will do; only the patch is tried again.
+	while (not update_atom_in_atomspace(h, guid, _json_gen)) {}
 
 	// Cache the json, but only if we don't already have a version
 	// of it. I guess that there is a very slight chance that some
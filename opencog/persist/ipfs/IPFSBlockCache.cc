@@ -0,0 +1,177 @@
+/*
+ * IPFSBlockCache.cc
+ * Byte-bounded cache of IPFS blocks, fed by the prefetcher.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <stdio.h>
+
+#include "IPFSBlockCache.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+
+IPFSBlockCache::IPFSBlockCache(void) :
+	_max_bytes(0), _bytes(0)
+{
+	clear_stats();
+}
+
+/// Set the size of the cache, in bytes of json. Zero turns the cache
+/// off, and empties it.
+void IPFSBlockCache::set_max_bytes(size_t nbytes)
+{
+	std::lock_guard<std::mutex> lck(_mtx);
+	_max_bytes = nbytes;
+	evict();
+}
+
+/// Remove one entry. Prefetched blocks that were never used count
+/// as wasted. Must be called under the lock.
+void IPFSBlockCache::drop(std::unordered_map<std::string, Entry>::iterator it)
+{
+	if (it->second.prefetched and not it->second.used)
+		_wasted_bytes += it->second.bytes;
+	_bytes -= it->second.bytes;
+	_lru.erase(it->second.lru);
+	_map.erase(it);
+}
+
+/// Evict the least-recently-used entries, until under budget.
+/// Must be called under the lock.
+void IPFSBlockCache::evict(void)
+{
+	while (_max_bytes < _bytes and 0 < _lru.size())
+		drop(_map.find(_lru.back()));
+}
+
+bool IPFSBlockCache::get(const std::string& path, ipfs::Json& json)
+{
+	if (not enabled()) return false;
+
+	std::lock_guard<std::mutex> lck(_mtx);
+	_num_lookups++;
+	auto it = _map.find(path);
+	if (_map.end() == it) return false;
+
+	Entry& ent = it->second;
+	if (ent.prefetched and not ent.used) _prefetch_hits++;
+	ent.used = true;
+	_lru.splice(_lru.begin(), _lru, ent.lru);
+	_num_hits++;
+	json = ent.json;
+	return true;
+}
+
+bool IPFSBlockCache::contains(const std::string& path)
+{
+	std::lock_guard<std::mutex> lck(_mtx);
+	return _map.end() != _map.find(path);
+}
+
+/// Add an entry. Returns its size in bytes, or zero if it was not
+/// added, because it was already there, or is too big.
+size_t IPFSBlockCache::put(const std::string& path, const ipfs::Json& json,
+                           bool prefetched)
+{
+	if (not enabled()) return 0;
+
+	size_t nbytes = path.size() + json.dump().size();
+	std::lock_guard<std::mutex> lck(_mtx);
+	if (_map.end() != _map.find(path)) return 0;
+	if (_max_bytes < nbytes) return 0;
+
+	_lru.push_front(path);
+	_map[path] = {json, nbytes, prefetched, false, _lru.begin()};
+	_bytes += nbytes;
+	if (prefetched)
+	{
+		_num_prefetched++;
+		_prefetched_bytes += nbytes;
+	}
+	evict();
+	return nbytes;
+}
+
+void IPFSBlockCache::clear(void)
+{
+	std::lock_guard<std::mutex> lck(_mtx);
+	while (0 < _lru.size())
+		drop(_map.find(_lru.back()));
+}
+
+/* ================================================================ */
+
+void IPFSBlockCache::clear_stats(void)
+{
+	_num_lookups = 0;
+	_num_hits = 0;
+	_num_prefetched = 0;
+	_prefetched_bytes = 0;
+	_prefetch_hits = 0;
+	_wasted_bytes = 0;
+}
+
+void IPFSBlockCache::print_stats(void)
+{
+	size_t lookups = _num_lookups;
+	size_t hits = _num_hits;
+	size_t prefetched = _num_prefetched;
+	size_t prefetched_bytes = _prefetched_bytes;
+	size_t prefetch_hits = _prefetch_hits;
+	size_t wasted_bytes = _wasted_bytes;
+
+	size_t bytes, entries;
+	{
+		std::lock_guard<std::mutex> lck(_mtx);
+		bytes = _bytes;
+		entries = _map.size();
+	}
+
+	double hit_rate = 0.0;
+	if (0 < lookups) hit_rate = ((double) hits) / lookups;
+	double prefetch_rate = 0.0;
+	if (0 < prefetched) prefetch_rate = ((double) prefetch_hits) / prefetched;
+
+	printf("block cache: entries=%zu bytes=%zu of %zu lookups=%zu "
+	       "hits=%zu hit rate=%f\n",
+	       entries, bytes, _max_bytes.load(), lookups, hits, hit_rate);
+	printf("prefetch: blocks=%zu bytes=%zu used=%zu hit rate=%f "
+	       "wasted bytes=%zu\n",
+	       prefetched, prefetched_bytes, prefetch_hits, prefetch_rate,
+	       wasted_bytes);
+}
+
+void IPFSBlockCache::collect_metrics(IPFSMetrics& m)
+{
+	size_t bytes, entries;
+	{
+		std::lock_guard<std::mutex> lck(_mtx);
+		bytes = _bytes;
+		entries = _map.size();
+	}
+
+	m.counter("atomspace_ipfs_block_cache_lookups_total",
+	          "Lookups in the block cache.", _num_lookups);
+	m.counter("atomspace_ipfs_block_cache_hits_total",
+	          "Lookups in the block cache that found the block.", _num_hits);
+	m.counter("atomspace_ipfs_prefetched_blocks_total",
+	          "Blocks put in the cache by prefetching.", _num_prefetched);
+	m.counter("atomspace_ipfs_prefetched_bytes_total",
+	          "Bytes put in the cache by prefetching.", _prefetched_bytes);
+	m.counter("atomspace_ipfs_prefetch_hits_total",
+	          "Prefetched blocks that were used.", _prefetch_hits);
+	m.counter("atomspace_ipfs_prefetch_wasted_bytes_total",
+	          "Prefetched bytes that were evicted unused.", _wasted_bytes);
+	m.gauge("atomspace_ipfs_block_cache_entries",
+	        "Blocks in the block cache.", entries);
+	m.gauge("atomspace_ipfs_block_cache_bytes",
+	        "Bytes in the block cache.", bytes);
+	m.gauge("atomspace_ipfs_block_cache_max_bytes",
+	        "Size limit of the block cache.", _max_bytes);
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,91 @@
+/*
+ * FILE:
+ * opencog/persist/ipfs/IPFSBlockCache.h
+
+ * FUNCTION:
+ * Byte-bounded cache of IPFS blocks, fed by the prefetcher.
+ *
+ * HISTORY:
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_IPFS_BLOCK_CACHE_H
+#define _OPENCOG_IPFS_BLOCK_CACHE_H
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <ipfs/client.h>
+
+#include "IPFSMetrics.h"
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// A cache of the json of IPFS blocks, keyed by the path that was
+/// fetched: either a guid, or an AtomSpace root CID followed by the
+/// name of an atom. Both of these are immutable, and so the cache
+/// never needs to be invalidated; entries are only ever evicted,
+/// least-recently-used first, to keep the total size under budget.
+///
+/// Entries put here by the prefetcher are marked as such, so that
+/// the prefetch hit rate and the bytes that were fetched but never
+/// used can be reported.
+class IPFSBlockCache
+{
+	private:
+		struct Entry
+		{
+			ipfs::Json json;
+			size_t bytes;
+			bool prefetched;
+			bool used;
+			std::list<std::string>::iterator lru;
+		};
+
+		std::mutex _mtx;
+		std::unordered_map<std::string, Entry> _map;
+		std::list<std::string> _lru;   // Most recently used first
+		std::atomic<size_t> _max_bytes;
+		size_t _bytes;
+
+		void drop(std::unordered_map<std::string, Entry>::iterator);
+		void evict(void);
+
+	public:
+		IPFSBlockCache(void);
+
+		void set_max_bytes(size_t);
+		size_t max_bytes(void) const { return _max_bytes; }
+		bool enabled(void) const { return 0 < _max_bytes; }
+
+		bool get(const std::string&, ipfs::Json&);
+		bool contains(const std::string&);
+		size_t put(const std::string&, const ipfs::Json&, bool prefetched);
+		void clear(void);
+
+		// Performance statistics
+		std::atomic<size_t> _num_lookups;
+		std::atomic<size_t> _num_hits;
+		std::atomic<size_t> _num_prefetched;
+		std::atomic<size_t> _prefetched_bytes;
+		std::atomic<size_t> _prefetch_hits;
+		std::atomic<size_t> _wasted_bytes;
+		void clear_stats(void);
+		void print_stats(void);
+		void collect_metrics(IPFSMetrics&);
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_IPFS_BLOCK_CACHE_H
@@ -23,7 +23,8 @@ using namespace opencog;
 
 /// load_atomspace -- load AtomSpace from path.
 /// The path could be a CID, or it could be /ipfs/CID or it could
-/// be /ipns/CID. In the later case, the IPNS lookup is performed.
+/// be /ipns/CID. In the later case, the IPNS lookup is performed,
+/// unless it was already done once before; see IPFSResolver.
 void IPFSAtomStorage::load_atomspace(AtomSpace* as, const std::string& path)
 {
 	rethrow();
@@ -42,16 +43,10 @@ void IPFSAtomStorage::load_atomspace(AtomSpace* as, const std::string& path)
 
 	if (std::string::npos != path.find("/ipns/"))
 	{
-		// Caution: as of this writing, name resolution takes
-		// exactly 60 seconds.
-		std::string ipfs_path;
-		ipfs::Client* conn = conn_pool.pop();
-		conn->NameResolve(path, &ipfs_path);
-		conn_pool.push(conn);
-
-		// We are expecting the name to resolve into a string
-		// of the form "/ipfs/Qm..."
-		load_as_from_cid(as, &ipfs_path[sizeof("/ipfs/") - 1]);
+		// Name resolution is slow, so the last resolution is used,
+		// if there is one; it is refreshed in the background.
+		size_t pos = path.find("/ipns/") + sizeof("/ipns/") - 1;
+		load_as_from_cid(as, _resolver->lookup(path.substr(pos), true));
 		return;
 	}
 
@@ -67,6 +62,14 @@ void IPFSAtomStorage::load_as_from_cid(AtomSpace* as, const std::string& cid)
 {
 	rethrow();
 
+	// AtomSpaces opened by IPFS CID never change, so a local image
+	// of them can be used, if there is one.
+	if (_read_only and load_image(as, cid))
+	{
+		as->barrier();
+		return;
+	}
+
 	size_t start_count = _load_count;
 	printf("Loading all atoms from %s\n", cid.c_str());
 	bulk_load = true;
@@ -74,10 +77,18 @@ void IPFSAtomStorage::load_as_from_cid(AtomSpace* as, const std::string& cid)
 
 	ipfs::Json dag;
 	ipfs::Client* conn = conn_pool.pop();
-	conn->DagGet(cid, &dag);
+	_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+		[&]{ conn->DagGet(cid, &dag); });
 	conn_pool.push(conn);
 	// std::cout << "The atomspace dag is:" << dag.dump(2) << std::endl;
 
+	// Write an image, only if all of the values are being loaded.
+	bool make_image = _read_only and not have_key_filter();
+	HandleSeq loaded;
+	std::mutex loaded_mutex;
+
+	// The atoms are fetched in parallel, in the I/O pool.
+	std::vector<IPFSIOPool::Task> fetches;
 	auto atom_list = dag["links"];
 	for (auto acid: atom_list)
 	{
@@ -87,9 +98,19 @@ void IPFSAtomStorage::load_as_from_cid(AtomSpace* as, const std::string& cid)
 		// but is instead the IPFS CID of the Atom, with values
 		// attached to it. So we have to fetch that, to get the latest
 		// values on the atom.
-		as->add_atom(fetch_atom(acid["Cid"]["/"]));
-		_load_count++;
+		std::string atom_cid = acid["Cid"]["/"];
+		fetches.push_back([&, atom_cid](void)
+		{
+			IPFSConnPool::ClassGuard bg(IPFSConnPool::BACKGROUND);
+			Handle h(fetch_atom(atom_cid));
+			as->add_atom(h);
+			_load_count++;
+			if (not make_image) return;
+			std::lock_guard<std::mutex> lck(loaded_mutex);
+			loaded.push_back(h);
+		});
 	}
+	_io_pool.run_all(fetches);
 
 	time_t secs = time(0) - bulk_start;
 	double rate = ((double) _load_count) / secs;
@@ -97,6 +118,8 @@ void IPFSAtomStorage::load_as_from_cid(AtomSpace* as, const std::string& cid)
 		(_load_count - start_count), (int) secs, (int) rate);
 	bulk_load = false;
 
+	if (make_image) save_image(cid, loaded);
+
 	// synchrnonize!
 	as->barrier();
 }
@@ -110,22 +133,30 @@ void IPFSAtomStorage::loadType(AtomTable &table, Type atom_type)
 
 	ipfs::Json dag;
 	ipfs::Client* conn = conn_pool.pop();
-	conn->DagGet(_atomspace_cid, &dag);
+	_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+		[&]{ conn->DagGet(*pin_root(), &dag); });
 	conn_pool.push(conn);
 	// std::cout << "The atomspace dag is:" << dag.dump(2) << std::endl;
 
+	std::vector<IPFSIOPool::Task> fetches;
 	auto atom_list = dag["links"];
 	for (auto acid: atom_list)
 	{
 		// std::cout << "Atom CID is: " << acid["Cid"]["/"] << std::endl;
 
-		Handle h(fetch_atom(acid["Cid"]["/"]));
-		if (h->get_type() == atom_type)
+		std::string atom_cid = acid["Cid"]["/"];
+		fetches.push_back([&, atom_cid](void)
 		{
-			table.add(h, false);
-			_load_count++;
-		}
+			IPFSConnPool::ClassGuard bg(IPFSConnPool::BACKGROUND);
+			Handle h(fetch_atom(atom_cid));
+			if (h->get_type() == atom_type)
+			{
+				table.add(h, false);
+				_load_count++;
+			}
+		});
 	}
+	_io_pool.run_all(fetches);
 }
 
 /// Store all of the atoms in the atom table.
@@ -155,15 +186,22 @@ void IPFSAtomStorage::storeAtomSpace(const AtomTable &table)
 	double rate = ((double) _store_count) / secs;
 	printf("\tFinished storing %lu atoms total, in %d seconds (%d per second)\n",
 		(unsigned long) _store_count, (int) secs, (int) rate);
-	printf("\tAtomSpace CID: %s\n", _atomspace_cid.c_str());
+	printf("\tAtomSpace CID: %s\n", pin_root()->c_str());
 }
 
 void IPFSAtomStorage::loadAtomSpace(AtomTable &table)
 {
 	// Perform an IPNS lookup, if a key was given.
-	if (0 < _keyname.size()) resolve_atomspace();
+	resolve_atomspace();
+
+	RootPin root = pin_root();
+	load_atomspace(table.getAtomSpace(), *root);
 
-	load_atomspace(table.getAtomSpace(), _atomspace_cid);
+	// Remember where the AtomSpace came from, so that it can be
+	// updated when the key resolves to something newer.
+	std::lock_guard<std::mutex> lck(_refresh_mutex);
+	_loaded_root = *root;
+	_refresh_as = table.getAtomSpace();
 }
 
 /* ============================= END OF FILE ================= */
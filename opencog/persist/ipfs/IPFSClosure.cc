@@ -0,0 +1,280 @@
+/*
+ * IPFSClosure.cc
+ * Fetch of whole subgraphs, with a single request.
+ *
+ * The outgoing set of a link is a list of IPLD links to the guids of
+ * the atoms in it. Thus, the daemon can walk the whole subgraph under
+ * a link, and hand it over as one CAR (content-addressed archive)
+ * stream, with `dag/export`. The blocks in the stream are decoded
+ * here, locally. This is much faster than fetching the atoms one at
+ * a time, when the subgraph is large and not yet known.
+ *
+ * The ipfs-http-client has no call for `dag/export`, so curl is used
+ * directly.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <stdint.h>
+
+#include <mutex>
+
+#include <curl/curl.h>
+
+#include "IPFSAtomStorage.h"
+
+using namespace opencog;
+
+// Multicodec of dag-cbor blocks.
+#define CODEC_DAG_CBOR 0x71
+
+// CBOR tag for IPLD links.
+#define CBOR_TAG_CID 42
+
+/* ================================================================ */
+// Decoding of CAR streams.
+
+/// Read an unsigned LEB128 varint.
+static uint64_t read_varint(const uint8_t*& p, const uint8_t* end)
+{
+	uint64_t val = 0;
+	int shift = 0;
+	while (p < end)
+	{
+		uint8_t byte = *p++;
+		val |= ((uint64_t) (byte & 0x7f)) << shift;
+		if (0 == (byte & 0x80)) return val;
+		shift += 7;
+		if (63 < shift) break;
+	}
+	throw IOException(TRACE_INFO, "Bad varint in CAR stream\n");
+}
+
+static std::string base32_encode(const uint8_t* p, size_t len)
+{
+	static const char alpha[] = "abcdefghijklmnopqrstuvwxyz234567";
+	std::string out;
+	uint32_t buf = 0;
+	int bits = 0;
+	for (size_t i=0; i<len; i++)
+	{
+		buf = (buf << 8) | p[i];
+		bits += 8;
+		while (5 <= bits)
+		{
+			out += alpha[(buf >> (bits - 5)) & 0x1f];
+			bits -= 5;
+		}
+	}
+	if (0 < bits) out += alpha[(buf << (5 - bits)) & 0x1f];
+	return out;
+}
+
+static std::string base58_encode(const uint8_t* p, size_t len)
+{
+	static const char alpha[] =
+		"123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+	// Leading zero bytes become leading ones.
+	size_t zeros = 0;
+	while (zeros < len and 0 == p[zeros]) zeros++;
+
+	std::vector<uint8_t> digits;
+	for (size_t i=zeros; i<len; i++)
+	{
+		int carry = p[i];
+		for (uint8_t& d: digits)
+		{
+			carry += 256 * d;
+			d = carry % 58;
+			carry /= 58;
+		}
+		while (0 < carry)
+		{
+			digits.push_back(carry % 58);
+			carry /= 58;
+		}
+	}
+
+	std::string out(zeros, '1');
+	for (auto it = digits.rbegin(); it != digits.rend(); it++)
+		out += alpha[*it];
+	return out;
+}
+
+/// Return the string form of a binary CID, the same as the daemon
+/// prints: base58 for version 0, and base32 for version 1.
+static std::string cid_to_string(const uint8_t* p, size_t len)
+{
+	if (34 == len and 0x12 == p[0] and 0x20 == p[1])
+		return base58_encode(p, len);
+	return "b" + base32_encode(p, len);
+}
+
+/// Read a binary CID; return its length, and the codec.
+static size_t read_cid(const uint8_t* p, const uint8_t* end, uint64_t& codec)
+{
+	// Version 0 is a bare sha2-256 multihash, of dag-pb.
+	if (p + 34 <= end and 0x12 == p[0] and 0x20 == p[1])
+	{
+		codec = 0x70;
+		return 34;
+	}
+
+	const uint8_t* start = p;
+	uint64_t version = read_varint(p, end);
+	if (1 != version)
+		throw IOException(TRACE_INFO, "Unknown CID version %lu\n",
+		                  (unsigned long) version);
+	codec = read_varint(p, end);
+	read_varint(p, end);  // multihash function
+	uint64_t dlen = read_varint(p, end);
+	if (end < p + dlen)
+		throw IOException(TRACE_INFO, "Truncated CID in CAR stream\n");
+	return (p + dlen) - start;
+}
+
+/// Turn the decoded IPLD links back into the `{"/": cid}` form that
+/// `DagGet` returns. With the tags ignored, a link is a byte string
+/// holding a zero byte followed by the binary CID; atoms have no
+/// other byte strings in them.
+static void unlink_json(ipfs::Json& j)
+{
+	if (j.is_binary())
+	{
+		const auto& bin = j.get_binary();
+		if (0 < bin.size() and 0 == bin[0])
+			j = {{"/", cid_to_string(bin.data() + 1, bin.size() - 1)}};
+		return;
+	}
+	if (j.is_structured())
+		for (auto& jc: j) unlink_json(jc);
+}
+
+/* ================================================================ */
+
+static size_t car_write(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+	std::string* car = (std::string*) userdata;
+	car->append(ptr, size * nmemb);
+	return size * nmemb;
+}
+
+/// Set up curl, once per process, before any thread uses it;
+/// curl_easy_init() is not thread safe without this. Called when
+/// storage is opened.
+void IPFSAtomStorage::curl_init(void)
+{
+	static std::once_flag once;
+	std::call_once(once, []{ curl_global_init(CURL_GLOBAL_DEFAULT); });
+}
+
+/// Return the whole DAG under the CID, as a CAR stream.
+std::string IPFSAtomStorage::dag_export(const std::string& cid)
+{
+	std::string url = "http://" + _hostname + ":" +
+		std::to_string(_port) + "/api/v0/dag/export?arg=" + cid;
+
+	CURL* curl = curl_easy_init();
+	if (nullptr == curl)
+		throw IOException(TRACE_INFO, "Unable to create curl handle\n");
+
+	std::string car;
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, car_write);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &car);
+	_rpc_stats.timed(IPFSRpcStats::DAG_EXPORT, [&]{
+		CURLcode rc = curl_easy_perform(curl);
+		long status = 0;
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+		curl_easy_cleanup(curl);
+
+		if (CURLE_OK != rc)
+			throw IOException(TRACE_INFO, "dag/export of %s failed: %s\n",
+			                  cid.c_str(), curl_easy_strerror(rc));
+		if (200 != status)
+			throw IOException(TRACE_INFO,
+			                  "dag/export of %s failed: HTTP %ld\n",
+			                  cid.c_str(), status);
+	});
+	return car;
+}
+
+/// Fetch the atoms under the guids, and all of the atoms under those,
+/// with a single `dag/export`, and put their json into `dags`. A
+/// single guid is exported directly. Several are exported by way of
+/// a small block that links to all of them.
+///
+/// Caution: that block is written to the daemon, and so this read
+/// does a write. It is a few hundred bytes, holds nothing but links
+/// to blocks that are already there, is never linked to from any
+/// AtomSpace, and is content addressed, so that asking for the same
+/// set again does not add more. The daemon has no way to export
+/// several DAGs at once without it.
+void IPFSAtomStorage::fetch_closure(const std::vector<std::string>& guids,
+                          std::unordered_map<std::string, ipfs::Json>& dags)
+{
+	if (0 == guids.size()) return;
+
+	std::string top;
+	if (1 == guids.size())
+		top = guids[0];
+	else
+	{
+		ipfs::Json bundle;
+		for (const std::string& guid: guids)
+			bundle["closure"].push_back({{"/", guid}});
+
+		ipfs::Json result;
+		IPFSConnPool::ConnGuard conn(conn_pool);
+		_rpc_stats.timed(IPFSRpcStats::DAG_PUT,
+			[&]{ conn->DagPut(bundle, &result); });
+		top = result["Cid"]["/"];
+	}
+
+	std::string car(dag_export(top));
+	const uint8_t* p = (const uint8_t*) car.data();
+	const uint8_t* end = p + car.size();
+
+	// Skip the header; it only repeats the root.
+	uint64_t hlen = read_varint(p, end);
+	p += hlen;
+
+	size_t nblocks = 0;
+	while (p < end)
+	{
+		uint64_t slen = read_varint(p, end);
+		const uint8_t* send = p + slen;
+		if (end < send)
+			throw IOException(TRACE_INFO, "Truncated CAR stream for %s\n",
+			                  top.c_str());
+
+		uint64_t codec;
+		size_t clen = read_cid(p, send, codec);
+		std::string cid(cid_to_string(p, clen));
+		p += clen;
+
+		if (CODEC_DAG_CBOR == codec)
+		{
+			ipfs::Json jblock = ipfs::Json::from_cbor(p, send, true, true,
+				ipfs::Json::cbor_tag_handler_t::ignore);
+			unlink_json(jblock);
+
+			// Only the atoms; not the bundle, nor the value blocks.
+			if (jblock.is_object() and jblock.end() != jblock.find("type"))
+			{
+				dags[cid] = jblock;
+				nblocks++;
+			}
+		}
+		p = send;
+	}
+
+	_num_closure_fetches++;
+	_num_closure_blocks += nblocks;
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,163 @@
+/*
+ * IPFSCommit.cc
+ * Optimistic commits of AtomSpace roots, for several writers.
+ *
+ * Each writer works on its own root, starting from the committed one.
+ * To commit, the writer swaps its root into the registry, but only if
+ * the registered root is still the one it started from. If some other
+ * writer got there first, the changes made here are replayed on top
+ * of the new registered root, using the merge code, and the swap is
+ * tried again. Only the entries that differ between the roots are
+ * examined; no store is redone.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <opencog/atoms/base/Atom.h>
+
+#include "IPFSAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+
+/// Commit the current root to the registry, rebasing it onto the
+/// roots committed by the other writers, as often as need be.
+/// Returns the committed root. Without a registry, this does nothing
+/// but return the current root.
+///
+/// The rebase fetches a great deal, and so it is done without the
+/// root mutex; writers carry on meanwhile. If one of them changed the
+/// root in the meantime, the rebase is thrown away, and done again,
+/// with that change. Once the rebased root is in place, the cached
+/// json of the atoms that the others changed is replaced, and the
+/// json generation is bumped, so that any store that was built from
+/// the old json is built again; see update_atom_in_atomspace().
+std::string IPFSAtomStorage::commit_root(void)
+{
+	if (nullptr == _registry) return *pin_root();
+	rethrow();
+
+	std::unique_lock<std::mutex> lck(_atomspace_cid_mutex);
+	while (true)
+	{
+		std::string ours = *pin_root();
+		if (ours == _commit_base) return ours;
+
+		std::string current;
+		if (_registry->compare_and_swap(_keyname, _commit_seen,
+		                                ours, current))
+		{
+			_commit_base = ours;
+			_commit_seen = ours;
+			_num_commits++;
+			return ours;
+		}
+		_num_commit_conflicts++;
+
+		// If the registry moved to the root that we are already
+		// based on (e.g. one that was followed) there is nothing
+		// to replay. Likewise if the registry was wiped.
+		if (0 == current.size() or current == _commit_base)
+		{
+			_commit_base = current;
+			_commit_seen = current;
+			continue;
+		}
+
+		std::string base = _commit_base;
+		std::set<std::string> changed;
+		std::map<Handle, ipfs::Json> jsons;
+		lck.unlock();
+		std::string rebased = rebase_root(base, ours, current,
+		                                  changed, jsons);
+		lck.lock();
+		if (*pin_root() != ours or _commit_base != base) continue;
+
+		{
+			std::lock_guard<std::mutex> jlck(_json_mutex);
+
+			// An atom that they changed, and that was cached while
+			// the rebase ran, was cached from the old root.
+			bool stale = false;
+			for (const auto& [h, jatom]: _json_map)
+			{
+				if (jsons.end() != jsons.find(h)) continue;
+				if (changed.end() == changed.find(h->to_short_string()))
+					continue;
+				stale = true;
+				break;
+			}
+			if (stale) continue;
+
+			for (const auto& [h, dag]: jsons)
+			{
+				auto pj = _json_map.find(h);
+				if (_json_map.end() != pj and 0 < dag.size())
+					pj->second = dag;
+			}
+			_json_gen++;
+		}
+
+		set_root(rebased);
+		_commit_base = current;
+		_commit_seen = current;
+		_num_rebases++;
+	}
+}
+
+/// Replay the changes made in `ours`, since the commit base, on top
+/// of the root `theirs`. Entries changed on both sides are merged
+/// value by value, with our values winning. Returns the new root.
+///
+/// The names of the entries that they changed are returned in
+/// `changed`, and the rebased json of the cached atoms among these
+/// in `jsons`, so that later stores start from their changes, and not
+/// from the stale copy. Does not touch the root; must be called
+/// without the root mutex held.
+std::string IPFSAtomStorage::rebase_root(const std::string& base,
+                                         const std::string& ours,
+                                         const std::string& theirs,
+                                         std::set<std::string>& changed,
+                                         std::map<Handle, ipfs::Json>& jsons)
+{
+	RootEntries base_ents;
+	RootEntries our_ents;
+	RootEntries their_ents;
+	get_root_entries(base, base_ents);
+	get_root_entries(ours, our_ents);
+	get_root_entries(theirs, their_ents);
+
+	// Patch their root with our changes; thus, in the merge, we are
+	// "theirs".
+	std::string rebased = merge_roots(base_ents, their_ents, our_ents,
+	                                  theirs, MERGE_THEIRS);
+
+	auto cid_of = [](const RootEntries& ents, const std::string& name)
+		-> std::string
+	{
+		auto it = ents.find(name);
+		if (ents.end() == it) return "";
+		return it->second;
+	};
+
+	for (const auto& [name, cid]: their_ents)
+		if (cid != cid_of(base_ents, name)) changed.insert(name);
+	for (const auto& [name, cid]: base_ents)
+		if (their_ents.end() == their_ents.find(name)) changed.insert(name);
+
+	HandleSeq cached;
+	{
+		std::lock_guard<std::mutex> lck(_json_mutex);
+		for (const auto& [h, jatom]: _json_map)
+			if (changed.end() != changed.find(h->to_short_string()))
+				cached.push_back(h);
+	}
+	for (const Handle& h: cached)
+		jsons[h] = get_atom_json(h, rebased);
+
+	return rebased;
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,163 @@
+/*
+ * IPFSConnPool.cc
+ * Pool of IPFS client connections, with priority classes.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <stdio.h>
+
+#include <chrono>
+
+#include "IPFSConnPool.h"
+
+using namespace opencog;
+
+static thread_local IPFSConnPool::Class _thread_class =
+	IPFSConnPool::FOREGROUND;
+
+static const char* class_name[] = { "foreground", "background" };
+
+/* ================================================================ */
+
+IPFSConnPool::ClassGuard::ClassGuard(Class cls) :
+	_prev(_thread_class)
+{
+	_thread_class = cls;
+}
+
+IPFSConnPool::ClassGuard::~ClassGuard()
+{
+	_thread_class = _prev;
+}
+
+IPFSConnPool::Class IPFSConnPool::get_class(void)
+{
+	return _thread_class;
+}
+
+/* ================================================================ */
+
+IPFSConnPool::IPFSConnPool(void) :
+	_reserved(0)
+{
+	for (int c=0; c<NUM_CLASSES; c++) _waiting[c] = 0;
+	clear_stats();
+}
+
+/// Reserve this many connections for the foreground class.
+void IPFSConnPool::set_reserved(size_t nres)
+{
+	std::lock_guard<std::mutex> lck(_mtx);
+	_reserved = nres;
+}
+
+unsigned int IPFSConnPool::size(void)
+{
+	std::lock_guard<std::mutex> lck(_mtx);
+	return _free.size();
+}
+
+void IPFSConnPool::push(ipfs::Client* conn)
+{
+	std::lock_guard<std::mutex> lck(_mtx);
+	_free.push_back(conn);
+
+	// Foreground first.
+	if (0 < _waiting[FOREGROUND])
+		_cv[FOREGROUND].notify_one();
+	else
+		_cv[BACKGROUND].notify_one();
+}
+
+/// Get a connection, waiting for one if need be. Background threads
+/// leave the reserved connections alone, and also wait while there
+/// are foreground threads waiting.
+ipfs::Client* IPFSConnPool::pop(void)
+{
+	Class cls = _thread_class;
+	std::unique_lock<std::mutex> lck(_mtx);
+
+	auto can_take = [&](void)
+	{
+		if (FOREGROUND == cls) return 0 < _free.size();
+		return _reserved < _free.size() and 0 == _waiting[FOREGROUND];
+	};
+
+	_num_pops[cls]++;
+	if (not can_take())
+	{
+		auto start = std::chrono::steady_clock::now();
+		_waiting[cls]++;
+		_cv[cls].wait(lck, can_take);
+		_waiting[cls]--;
+
+		size_t usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count();
+		_num_waits[cls]++;
+		_wait_usecs[cls] += usecs;
+		if (_max_wait_usecs[cls] < usecs) _max_wait_usecs[cls] = usecs;
+	}
+
+	ipfs::Client* conn = _free.back();
+	_free.pop_back();
+
+	// If there are still connections left over, and nobody in the
+	// foreground is waiting, let a background thread try.
+	if (0 < _free.size() and 0 == _waiting[FOREGROUND])
+		_cv[BACKGROUND].notify_one();
+
+	return conn;
+}
+
+/* ================================================================ */
+
+void IPFSConnPool::clear_stats(void)
+{
+	for (int c=0; c<NUM_CLASSES; c++)
+	{
+		_num_pops[c] = 0;
+		_num_waits[c] = 0;
+		_wait_usecs[c] = 0;
+		_max_wait_usecs[c] = 0;
+	}
+}
+
+void IPFSConnPool::print_stats(void)
+{
+	for (int c=0; c<NUM_CLASSES; c++)
+	{
+		size_t pops = _num_pops[c];
+		size_t waits = _num_waits[c];
+		size_t wait_usecs = _wait_usecs[c];
+		size_t max_wait_usecs = _max_wait_usecs[c];
+		double avg = 0.0;
+		if (0 < pops) avg = 0.001 * wait_usecs / pops;
+		printf("conn_pool %s: checkouts=%zu waited=%zu "
+		       "avg wait=%f msecs longest=%f msecs\n",
+		       class_name[c], pops, waits, avg, 0.001 * max_wait_usecs);
+	}
+}
+
+void IPFSConnPool::collect_metrics(IPFSMetrics& m)
+{
+	m.gauge("atomspace_ipfs_conn_pool_free",
+	        "Connections to the IPFS daemon not in use.", size());
+	for (int c=0; c<NUM_CLASSES; c++)
+	{
+		IPFSMetrics::Labels lab = {{"class", class_name[c]}};
+		m.counter("atomspace_ipfs_conn_checkouts_total",
+		          "Connections taken from the pool.", _num_pops[c], lab);
+		m.counter("atomspace_ipfs_conn_waits_total",
+		          "Connections that had to be waited for.", _num_waits[c], lab);
+		m.counter("atomspace_ipfs_conn_wait_seconds_total",
+		          "Time spent waiting for connections.",
+		          1.0e-6 * _wait_usecs[c], lab);
+		m.gauge("atomspace_ipfs_conn_wait_longest_seconds",
+		        "Longest wait for a connection, since the stats were cleared.",
+		        1.0e-6 * _max_wait_usecs[c], lab);
+	}
+}
+
+/* ============================= END OF FILE ================= */
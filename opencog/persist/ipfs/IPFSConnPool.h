@@ -0,0 +1,102 @@
+/*
+ * FILE:
+ * opencog/persist/ipfs/IPFSConnPool.h
+
+ * FUNCTION:
+ * Pool of IPFS client connections, with priority classes.
+ *
+ * HISTORY:
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_IPFS_CONN_POOL_H
+#define _OPENCOG_IPFS_CONN_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <ipfs/client.h>
+
+#include "IPFSMetrics.h"
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// A pool of IPFS connections, shared by all threads. Each thread is
+/// in one of two classes: foreground (the default) or background.
+/// Bulk stores and bulk loads run in the background class; everything
+/// else is foreground. Some of the connections are reserved for the
+/// foreground: background threads wait, rather than take one of these.
+/// When a connection is returned, waiting foreground threads get it
+/// first. Thus, interactive reads do not queue up behind bulk stores.
+class IPFSConnPool
+{
+	public:
+		enum Class { FOREGROUND, BACKGROUND, NUM_CLASSES };
+
+		/// Put the current thread into the given class, for as long
+		/// as this object is in scope.
+		class ClassGuard
+		{
+			Class _prev;
+		public:
+			ClassGuard(Class);
+			~ClassGuard();
+		};
+
+		/// Take a connection from the pool, for as long as this
+		/// object is in scope. It is given back even if the code
+		/// using it throws.
+		class ConnGuard
+		{
+			IPFSConnPool& _pool;
+			ipfs::Client* _conn;
+		public:
+			ConnGuard(IPFSConnPool& pool) :
+				_pool(pool), _conn(pool.pop()) {}
+			~ConnGuard() { _pool.push(_conn); }
+			ConnGuard(const ConnGuard&) = delete;
+			ConnGuard& operator=(const ConnGuard&) = delete;
+			ipfs::Client* operator->() { return _conn; }
+		};
+
+	private:
+		std::mutex _mtx;
+		std::condition_variable _cv[NUM_CLASSES];
+		std::vector<ipfs::Client*> _free;
+		size_t _waiting[NUM_CLASSES];
+		size_t _reserved;
+
+	public:
+		IPFSConnPool(void);
+
+		void push(ipfs::Client*);
+		ipfs::Client* pop(void);
+		unsigned int size(void);
+		bool is_empty(void) { return 0 == size(); }
+		void set_reserved(size_t);
+
+		static Class get_class(void);
+
+		// Performance statistics, per class.
+		std::atomic<size_t> _num_pops[NUM_CLASSES];
+		std::atomic<size_t> _num_waits[NUM_CLASSES];
+		std::atomic<size_t> _wait_usecs[NUM_CLASSES];
+		std::atomic<size_t> _max_wait_usecs[NUM_CLASSES];
+		void clear_stats(void);
+		void print_stats(void);
+		void collect_metrics(IPFSMetrics&);
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_IPFS_CONN_POOL_H
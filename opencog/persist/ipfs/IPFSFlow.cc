@@ -0,0 +1,251 @@
+/*
+ * IPFSFlow.cc
+ * Adaptive flow control for the write-back queue.
+ *
+ * The write-back queue has static knobs: the high and low watermarks,
+ * and whether or not to stall writers when the queue is full. The
+ * best settings depend on the workload, and on how fast the IPFS
+ * daemon is. The controller here watches the store latency, the
+ * store rate and the queue depth, and adjusts these, as well as the
+ * number of writer threads that may talk to the daemon at once.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "IPFSAtomStorage.h"
+
+using namespace opencog;
+
+// How often the controller runs.
+#define FLOW_TICK_MSEC 1000
+
+// Aim for a full queue to drain in about this long.
+#define FLOW_TARGET_DRAIN_SECS 2.0
+
+// Bounds on the high watermark.
+#define FLOW_MIN_HIGH_WATER 100
+#define FLOW_MAX_HIGH_WATER 100000
+
+// Back off when the store latency rises this much above the best
+// latency seen recently.
+#define FLOW_LATENCY_BACKOFF 2.0
+
+/* ================================================================ */
+
+/// Called by a writer thread before it stores an atom. Blocks if
+/// the controller has limited the number of active writers, and
+/// that many are already busy. With the gate open, as it is when
+/// flow control is off, this does not lock anything. Returns true
+/// if the writer went through the gate; pass this to flow_leave().
+///
+/// Writers that went by the open gate are not counted, and so, just
+/// after the gate closes, a few more than allowed may be storing.
+bool IPFSAtomStorage::flow_enter(void)
+{
+	if (not _flow_gated) return false;
+
+	std::unique_lock<std::mutex> lck(_flow_mutex);
+	_flow_cv.wait(lck, [this] { return _flow_active < _flow_writers; });
+	_flow_active++;
+	if (_flow_peak < _flow_active) _flow_peak = _flow_active;
+	return true;
+}
+
+void IPFSAtomStorage::flow_leave(bool gated)
+{
+	if (not gated) return;
+	{
+		std::lock_guard<std::mutex> lck(_flow_mutex);
+		_flow_active--;
+	}
+	_flow_cv.notify_one();
+}
+
+/* ================================================================ */
+
+/// Turn adaptive flow control on or off. When it is turned off, the
+/// watermarks are left as they were last set, stalling is turned off,
+/// and all writer threads are allowed to run, up to the max-writers
+/// cap, if one was given in the URI.
+void IPFSAtomStorage::set_adaptive_flow(bool on)
+{
+	{
+		std::lock_guard<std::mutex> lck(_flow_mutex);
+		_flow_adaptive = on;
+		if (not on)
+		{
+			_flow_writers = _flow_max_writers;
+			_flow_decision = "off";
+		}
+		_flow_gated = on or _flow_max_writers < (int) _wb_queues;
+
+		// Start the controller thread, on first use.
+		if (on and not _flow_thread.joinable())
+			_flow_thread = std::thread(flow_thread, this);
+	}
+	if (not on) _write_queue.stall(false);
+	_flow_cv.notify_all();
+	_flow_tick_cv.notify_one();
+}
+
+void IPFSAtomStorage::flow_thread(IPFSAtomStorage* self)
+{
+	size_t last_stores = self->_wb_store_count;
+	size_t last_usecs = self->_wb_store_usecs;
+	auto last = std::chrono::steady_clock::now();
+
+	std::unique_lock<std::mutex> lck(self->_flow_mutex);
+	while (self->_flow_keep_going)
+	{
+		self->_flow_tick_cv.wait_for(lck,
+			std::chrono::milliseconds(FLOW_TICK_MSEC));
+		if (not self->_flow_keep_going) break;
+		if (not self->_flow_adaptive) continue;
+
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::duration<double> secs = now - last;
+		last = now;
+
+		lck.unlock();
+		self->flow_adjust(secs.count(), last_stores, last_usecs);
+		lck.lock();
+	}
+}
+
+/// One step of the controller.
+///
+/// The number of active writers is adjusted with additive-increase,
+/// multiplicative-decrease, on the store latency: while there is work
+/// queued up, and the latency stays close to the best seen, one more
+/// writer is allowed; when the latency climbs, the daemon is saturated,
+/// and the number of writers is halved.
+///
+/// The high watermark is set so that a full queue can be drained, at
+/// the current store rate, in about FLOW_TARGET_DRAIN_SECS. If the
+/// queue is above the high watermark, and still growing, the callers
+/// of storeAtom() are stalled, so that the queue cannot grow without
+/// bound.
+void IPFSAtomStorage::flow_adjust(double secs,
+                                  size_t& last_stores, size_t& last_usecs)
+{
+	size_t stores = _wb_store_count;
+	size_t usecs = _wb_store_usecs;
+
+	// The counters were reset by clear_stats().
+	if (stores < last_stores or usecs < last_usecs)
+	{
+		last_stores = 0;
+		last_usecs = 0;
+	}
+	size_t nstores = stores - last_stores;
+	size_t nusecs = usecs - last_usecs;
+	last_stores = stores;
+	last_usecs = usecs;
+
+	size_t depth = _write_queue.get_size();
+	double rate = nstores / secs;
+	double latency = 0.0;
+	if (0 < nstores) latency = 0.001 * nusecs / nstores;
+
+	std::lock_guard<std::mutex> lck(_flow_mutex);
+	if (not _flow_adaptive) return;
+
+	_flow_rate = rate;
+	_flow_latency = latency;
+
+	// Number of writers. Let the best latency drift upwards, so that
+	// a single lucky interval does not pin it down forever.
+	if (0 < nstores)
+	{
+		if (0.0 == _flow_min_latency or latency < _flow_min_latency)
+			_flow_min_latency = latency;
+		else
+			_flow_min_latency *= 1.05;
+
+		if (FLOW_LATENCY_BACKOFF * _flow_min_latency < latency and
+		    1 < _flow_writers)
+		{
+			_flow_writers = std::max(1, _flow_writers / 2);
+			_flow_backoffs++;
+			_flow_decision = "backoff";
+		}
+		else if (0 < depth and _flow_writers < _flow_max_writers)
+		{
+			_flow_writers++;
+			_flow_increases++;
+			_flow_decision = "increase";
+		}
+		else
+			_flow_decision = "hold";
+	}
+
+	// Watermarks.
+	if (0 < nstores)
+	{
+		size_t high = rate * FLOW_TARGET_DRAIN_SECS;
+		high = std::min(std::max(high, (size_t) FLOW_MIN_HIGH_WATER),
+		                (size_t) FLOW_MAX_HIGH_WATER);
+		_write_queue.set_watermarks(high, high / 4);
+	}
+
+	// Stall, if the queue is over the high watermark, and growing.
+	size_t high = _write_queue.get_high_watermark();
+	bool stall = high < depth and _flow_last_depth < depth;
+	if (stall and not _write_queue.stalling()) _flow_stalls++;
+	_write_queue.stall(stall);
+	_flow_last_depth = depth;
+
+	_flow_cv.notify_all();
+}
+
+/* ================================================================ */
+
+void IPFSAtomStorage::print_flow_stats(void)
+{
+	std::lock_guard<std::mutex> lck(_flow_mutex);
+	size_t flow_increases = _flow_increases;
+	size_t flow_backoffs = _flow_backoffs;
+	size_t flow_stalls = _flow_stalls;
+	printf("adaptive flow=%s last decision=%s\n",
+	       _flow_adaptive? "on" : "off", _flow_decision.c_str());
+	printf("writers allowed=%d of %d active=%d most active=%d\n",
+	       _flow_writers, _flow_max_writers, _flow_active, _flow_peak);
+	printf("store rate=%f per sec latency=%f msecs best=%f msecs\n",
+	       _flow_rate, _flow_latency, _flow_min_latency);
+	printf("writer increases=%zu backoffs=%zu stalls=%zu\n",
+	       flow_increases, flow_backoffs, flow_stalls);
+}
+
+void IPFSAtomStorage::collect_flow_metrics(IPFSMetrics& m)
+{
+	std::lock_guard<std::mutex> lck(_flow_mutex);
+	m.counter("atomspace_ipfs_flow_increases_total",
+	          "Times more writers were let in.", _flow_increases);
+	m.counter("atomspace_ipfs_flow_backoffs_total",
+	          "Times fewer writers were let in.", _flow_backoffs);
+	m.counter("atomspace_ipfs_flow_stalls_total",
+	          "Times writers waited at the gate.", _flow_stalls);
+	m.gauge("atomspace_ipfs_flow_adaptive",
+	        "Whether adaptive flow control is on.", _flow_adaptive ? 1 : 0);
+	m.gauge("atomspace_ipfs_flow_writers_allowed",
+	        "Writers let in at the same time.", _flow_writers);
+	m.gauge("atomspace_ipfs_flow_max_writers",
+	        "Most writers that can be let in.", _flow_max_writers);
+	m.gauge("atomspace_ipfs_flow_active_writers",
+	        "Writers that are storing.", _flow_active);
+	m.gauge("atomspace_ipfs_flow_peak_writers",
+	        "Most writers that were storing at the same time.", _flow_peak);
+	m.gauge("atomspace_ipfs_flow_store_rate",
+	        "Stores per second.", _flow_rate);
+	m.gauge("atomspace_ipfs_flow_latency_seconds",
+	        "Time taken per store.", 0.001 * _flow_latency);
+	m.gauge("atomspace_ipfs_flow_best_latency_seconds",
+	        "Least time taken per store.", 0.001 * _flow_min_latency);
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,242 @@
+/*
+ * IPFSIOPool.cc
+ * Work-stealing thread pool for IPFS reads and writes.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <chrono>
+#include <memory>
+
+#include "IPFSIOPool.h"
+
+using namespace opencog;
+
+// The pool, and the index in it, of the current thread, if it is a
+// pool thread.
+static thread_local IPFSIOPool* _self_pool = nullptr;
+static thread_local int _self_idx = -1;
+
+/* ================================================================ */
+
+IPFSIOPool::IPFSIOPool(size_t nthreads) :
+	_keep_going(true), _queued(0), _pending(0), _next(0)
+{
+	clear_stats();
+	if (0 == nthreads) nthreads = 1;
+	for (size_t i=0; i<nthreads; i++)
+		_workers.push_back(new Worker());
+	for (size_t i=0; i<nthreads; i++)
+		_threads.push_back(std::thread(&IPFSIOPool::worker_loop, this, i));
+}
+
+IPFSIOPool::~IPFSIOPool()
+{
+	barrier();
+	{
+		std::lock_guard<std::mutex> lck(_mutex);
+		_keep_going = false;
+	}
+	_work_cv.notify_all();
+	for (std::thread& t: _threads) t.join();
+	for (Worker* w: _workers) delete w;
+}
+
+void IPFSIOPool::clear_stats(void)
+{
+	_num_tasks = 0;
+	_num_priority = 0;
+	_num_steals = 0;
+	_num_helped = 0;
+}
+
+/* ================================================================ */
+
+/// Return the index of the calling thread in this pool, or -1 if
+/// it is not one of the pool threads.
+int IPFSIOPool::self_index(void)
+{
+	if (this != _self_pool) return -1;
+	return _self_idx;
+}
+
+/// Queue a task. Tasks queued by a pool thread go onto that thread's
+/// own queue; all others are spread round-robin. The task is counted
+/// before it is queued, so that `_queued` never goes below zero when
+/// some other thread takes it right away.
+void IPFSIOPool::submit(const Task& task, Lane lane)
+{
+	_pending++;
+	_queued++;
+	_num_tasks++;
+	if (PRIORITY == lane)
+	{
+		_num_priority++;
+		std::lock_guard<std::mutex> lck(_prio_mutex);
+		_prio_tasks.push_back(task);
+	}
+	else
+	{
+		int idx = self_index();
+		if (idx < 0) idx = _next++ % _workers.size();
+		Worker* w = _workers[idx];
+		std::lock_guard<std::mutex> lck(w->mtx);
+		w->tasks.push_back(task);
+	}
+
+	std::lock_guard<std::mutex> lck(_mutex);
+	_work_cv.notify_one();
+}
+
+/// Find a task to run: first from the priority lane, then from our
+/// own queue (newest first), and then by stealing from the others
+/// (oldest first). With `prio_only`, only the priority lane is
+/// looked at.
+bool IPFSIOPool::try_pop(int self, Task& task, bool prio_only)
+{
+	if (0 == _queued) return false;
+	{
+		std::lock_guard<std::mutex> lck(_prio_mutex);
+		if (0 < _prio_tasks.size())
+		{
+			task = std::move(_prio_tasks.front());
+			_prio_tasks.pop_front();
+			_queued--;
+			return true;
+		}
+	}
+	if (prio_only) return false;
+
+	if (0 <= self)
+	{
+		Worker* w = _workers[self];
+		std::lock_guard<std::mutex> lck(w->mtx);
+		if (0 < w->tasks.size())
+		{
+			task = std::move(w->tasks.back());
+			w->tasks.pop_back();
+			_queued--;
+			return true;
+		}
+	}
+
+	size_t nw = _workers.size();
+	size_t start = (0 <= self) ? self + 1 : _next.load();
+	for (size_t i=0; i<nw; i++)
+	{
+		Worker* w = _workers[(start + i) % nw];
+		std::lock_guard<std::mutex> lck(w->mtx);
+		if (0 < w->tasks.size())
+		{
+			task = std::move(w->tasks.front());
+			w->tasks.pop_front();
+			_queued--;
+			if (0 <= self) _num_steals++;
+			return true;
+		}
+	}
+	return false;
+}
+
+/// Tasks are expected to deal with their own exceptions; see
+/// `run_all()`.
+void IPFSIOPool::run_task(Task& task)
+{
+	task();
+	if (0 == --_pending)
+	{
+		std::lock_guard<std::mutex> lck(_mutex);
+		_idle_cv.notify_all();
+	}
+}
+
+void IPFSIOPool::worker_loop(int self)
+{
+	_self_pool = this;
+	_self_idx = self;
+	while (true)
+	{
+		Task task;
+		if (try_pop(self, task))
+		{
+			run_task(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lck(_mutex);
+		if (not _keep_going) break;
+		_work_cv.wait_for(lck, std::chrono::milliseconds(100),
+			[this] { return 0 < _queued or not _keep_going; });
+	}
+}
+
+/* ================================================================ */
+
+void IPFSIOPool::run(const Task& task, Lane lane)
+{
+	run_all({task}, lane);
+}
+
+/// Run all of the tasks, and wait for them to finish. The calling
+/// thread runs queued tasks while it waits; when waiting on priority
+/// tasks, only other priority tasks, so that an interactive read
+/// does not end up running a bulk load or store. If any of the tasks
+/// throws, the first exception is rethrown, after all tasks are done.
+void IPFSIOPool::run_all(const std::vector<Task>& tasks, Lane lane)
+{
+	struct Latch
+	{
+		std::atomic<size_t> count;
+		std::mutex mtx;
+		std::exception_ptr ex;
+	};
+	std::shared_ptr<Latch> latch(std::make_shared<Latch>());
+	latch->count = tasks.size();
+
+	for (const Task& task: tasks)
+	{
+		submit([this, latch, task](void)
+		{
+			try { task(); }
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lck(latch->mtx);
+				if (nullptr == latch->ex)
+					latch->ex = std::current_exception();
+			}
+			if (0 == --latch->count)
+			{
+				std::lock_guard<std::mutex> lck(_mutex);
+				_idle_cv.notify_all();
+			}
+		}, lane);
+	}
+
+	int self = self_index();
+	bool prio_only = (PRIORITY == lane);
+	while (0 < latch->count)
+	{
+		Task task;
+		if (try_pop(self, task, prio_only))
+		{
+			_num_helped++;
+			run_task(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> lck(_mutex);
+		_idle_cv.wait_for(lck, std::chrono::milliseconds(10),
+			[&latch] { return 0 == latch->count; });
+	}
+
+	if (latch->ex) std::rethrow_exception(latch->ex);
+}
+
+/// Wait until all tasks queued so far have finished.
+void IPFSIOPool::barrier(void)
+{
+	std::unique_lock<std::mutex> lck(_mutex);
+	_idle_cv.wait(lck, [this] { return 0 == _pending; });
+}
+
+/* ============================= END OF FILE ================= */
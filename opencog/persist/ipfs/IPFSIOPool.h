@@ -0,0 +1,102 @@
+/*
+ * FILE:
+ * opencog/persist/ipfs/IPFSIOPool.h
+
+ * FUNCTION:
+ * Work-stealing thread pool for IPFS reads and writes.
+ *
+ * HISTORY:
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_IPFS_IO_POOL_H
+#define _OPENCOG_IPFS_IO_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// A pool of threads that run IPFS fetch and store tasks. Each thread
+/// has a queue of its own; threads that run out of work steal from the
+/// others. Tasks in the priority lane are run before all others; this
+/// is for interactive reads, which should not wait behind bulk loads
+/// or bulk stores.
+///
+/// Threads that wait for their tasks to finish, with `run()` or
+/// `run_all()`, run queued tasks while they wait. Thus, waiting never
+/// deadlocks, even when all of the pool threads are busy, or when a
+/// pool thread itself is the one waiting. Threads that wait on the
+/// priority lane only help with priority tasks.
+class IPFSIOPool
+{
+	public:
+		enum Lane { PRIORITY, NORMAL };
+		typedef std::function<void(void)> Task;
+
+	private:
+		struct Worker
+		{
+			std::mutex mtx;
+			std::deque<Task> tasks;
+		};
+		std::vector<Worker*> _workers;
+		std::vector<std::thread> _threads;
+
+		std::mutex _prio_mutex;
+		std::deque<Task> _prio_tasks;
+
+		// For sleeping while there is no work.
+		std::mutex _mutex;
+		std::condition_variable _work_cv;
+		std::condition_variable _idle_cv;
+		bool _keep_going;
+
+		std::atomic<size_t> _queued;   // queued, not yet started
+		std::atomic<size_t> _pending;  // submitted, not yet finished
+		std::atomic<size_t> _next;     // round-robin for outsiders
+
+		int self_index(void);
+		bool try_pop(int, Task&, bool prio_only = false);
+		void run_task(Task&);
+		void worker_loop(int);
+
+	public:
+		IPFSIOPool(size_t nthreads);
+		IPFSIOPool(const IPFSIOPool&) = delete;
+		IPFSIOPool& operator=(const IPFSIOPool&) = delete;
+		~IPFSIOPool();
+
+		void submit(const Task&, Lane = NORMAL);
+		void run(const Task&, Lane = NORMAL);
+		void run_all(const std::vector<Task>&, Lane = NORMAL);
+		void barrier(void);
+
+		size_t size(void) const { return _threads.size(); }
+		size_t queued(void) const { return _queued; }
+
+		// Performance statistics
+		std::atomic<size_t> _num_tasks;
+		std::atomic<size_t> _num_priority;
+		std::atomic<size_t> _num_steals;
+		std::atomic<size_t> _num_helped;
+		void clear_stats(void);
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_IPFS_IO_POOL_H
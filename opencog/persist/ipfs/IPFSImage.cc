@@ -0,0 +1,463 @@
+/*
+ * IPFSImage.cc
+ * Local, memory-mapped images of read-only AtomSpaces.
+ *
+ * An AtomSpace that is opened by IPFS CID (i.e. with a URI of the form
+ * `ipfs:///ipfs/Qm...`) can never change. So, the first time that it
+ * is loaded, a flat image of all of its atoms and values is written
+ * to a local cache directory.  Later loads of the same CID, by any
+ * process on this machine, map that image into memory, and create
+ * the atoms directly from the mapped pages, without talking to the
+ * IPFS daemon at all.
+ *
+ * The image is in native byte order; it is meant to be shared between
+ * processes on one machine, and not to be moved between machines.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/atom_types/NameServer.h>
+#include <opencog/atoms/base/Link.h>
+#include <opencog/atoms/base/Node.h>
+#include <opencog/atoms/truthvalue/SimpleTruthValue.h>
+#include <opencog/atoms/truthvalue/TruthValue.h>
+#include <opencog/atomspace/AtomSpace.h>
+
+#include "IPFSAtomStorage.h"
+
+using namespace opencog;
+
+// Magic string at the start of every image. The last byte is the
+// format version.
+static const char IMAGE_MAGIC[8] = {'A','S','-','I','P','F','S', 1};
+
+// Byte-order check; an image written on a machine of the other
+// endianness will fail this check, and be ignored.
+static const uint32_t IMAGE_BYTE_ORDER = 0x01020304;
+
+// Kinds of values in the value section.
+enum
+{
+	IMAGE_TV = 0,      // SimpleTruthValue; two doubles.
+	IMAGE_FLOAT = 1,   // FloatValue; count, followed by doubles.
+	IMAGE_STRING = 2,  // Anything else, as a scheme string.
+};
+
+// Marker for the key of a SimpleTruthValue.
+#define IMAGE_TV_KEY 0xffffffff
+
+/* ================================================================ */
+
+/// Return the name of the local cache directory `subdir`, creating
+/// it, if needed. The cache root is `$ATOMSPACE_IPFS_CACHE`, if that
+/// is set; else `$XDG_CACHE_HOME/atomspace-ipfs`, else
+/// `$HOME/.cache/atomspace-ipfs`. Returns the empty string if the
+/// directory cannot be created.
+std::string IPFSAtomStorage::cache_dir(const std::string& subdir)
+{
+	std::string dir;
+	const char* env = getenv("ATOMSPACE_IPFS_CACHE");
+	if (env and *env)
+		dir = env;
+	else if ((env = getenv("XDG_CACHE_HOME")) and *env)
+		dir = std::string(env) + "/atomspace-ipfs";
+	else if ((env = getenv("HOME")) and *env)
+		dir = std::string(env) + "/.cache/atomspace-ipfs";
+	else
+		return "";
+
+	dir += "/" + subdir;
+
+	// The equivalent of `mkdir -p`
+	for (size_t pos = 1; pos != std::string::npos; )
+	{
+		pos = dir.find('/', pos+1);
+		std::string part = dir.substr(0, pos);
+		if (mkdir(part.c_str(), 0755) and EEXIST != errno)
+			return "";
+	}
+	return dir;
+}
+
+std::string IPFSAtomStorage::image_path(const std::string& cid)
+{
+	std::string dir = cache_dir("images");
+	if (0 == dir.size()) return "";
+	return dir + "/" + path_to_cid(cid) + ".img";
+}
+
+/* ================================================================ */
+// Helpers for writing the image.
+
+static void put_u32(std::string& buf, uint32_t v)
+{
+	buf.append((const char*) &v, sizeof(v));
+}
+
+static void put_u64(std::string& buf, uint64_t v)
+{
+	buf.append((const char*) &v, sizeof(v));
+}
+
+static void put_double(std::string& buf, double v)
+{
+	buf.append((const char*) &v, sizeof(v));
+}
+
+static void put_str(std::string& buf, const std::string& s)
+{
+	put_u32(buf, s.size());
+	buf.append(s);
+}
+
+/// Write an image holding the given atoms, and the values on them.
+/// The image is written to a temp file, and then renamed into place,
+/// so that other processes never see a partial image.
+void IPFSAtomStorage::save_image(const std::string& cid,
+                                 const HandleSeq& atoms)
+{
+	std::string path = image_path(cid);
+	if (0 == path.size()) return;
+
+	HandleSeq order;
+	size_t num_nodes = flatten_atoms(atoms, order);
+
+	std::unordered_map<Handle, uint64_t> index;
+	index.reserve(order.size());
+	for (size_t i=0; i<order.size(); i++)
+		index[order[i]] = i;
+
+	std::map<Type, uint32_t> type_index;
+	std::vector<Type> types;
+	std::map<Handle, uint32_t> key_index;
+	HandleSeq keys;
+
+	// The atom section
+	std::string abuf;
+	for (size_t i=0; i<order.size(); i++)
+	{
+		const Handle& h = order[i];
+		Type t = h->get_type();
+		auto ti = type_index.find(t);
+		if (type_index.end() == ti)
+		{
+			ti = type_index.insert({t, types.size()}).first;
+			types.push_back(t);
+		}
+		put_u32(abuf, ti->second);
+
+		if (i < num_nodes)
+		{
+			put_str(abuf, h->get_name());
+			continue;
+		}
+
+		put_u32(abuf, h->get_arity());
+		for (const Handle& ho: h->getOutgoingSet())
+			put_u64(abuf, index[ho]);
+	}
+
+	// The value section
+	std::string vbuf;
+	uint64_t num_values = 0;
+	for (size_t i=0; i<order.size(); i++)
+	{
+		const Handle& h = order[i];
+		for (const Handle& key: h->getKeys())
+		{
+			ValuePtr pap = h->getValue(key);
+			if (key == tvpred)
+			{
+				TruthValuePtr tv(TruthValueCast(pap));
+				if (tv->isDefaultTV()) continue;
+				if (SIMPLE_TRUTH_VALUE == tv->get_type())
+				{
+					put_u64(vbuf, i);
+					put_u32(vbuf, IMAGE_TV_KEY);
+					put_u32(vbuf, IMAGE_TV);
+					put_double(vbuf, tv->get_mean());
+					put_double(vbuf, tv->get_confidence());
+					num_values++;
+					continue;
+				}
+			}
+
+			auto ki = key_index.find(key);
+			if (key_index.end() == ki)
+			{
+				ki = key_index.insert({key, keys.size()}).first;
+				keys.push_back(key);
+			}
+
+			put_u64(vbuf, i);
+			put_u32(vbuf, ki->second);
+			if (FLOAT_VALUE == pap->get_type())
+			{
+				const std::vector<double>& fv = FloatValueCast(pap)->value();
+				put_u32(vbuf, IMAGE_FLOAT);
+				put_u64(vbuf, fv.size());
+				for (double d: fv) put_double(vbuf, d);
+			}
+			else
+			{
+				put_u32(vbuf, IMAGE_STRING);
+				put_str(vbuf, encodeValueToStr(pap));
+			}
+			num_values++;
+		}
+	}
+
+	// Put it all together.
+	std::string buf;
+	buf.append(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	put_u32(buf, IMAGE_BYTE_ORDER);
+	put_u32(buf, types.size());
+	put_u64(buf, num_nodes);
+	put_u64(buf, order.size());
+	put_u64(buf, keys.size());
+	put_u64(buf, num_values);
+
+	for (Type t: types)
+		put_str(buf, nameserver().getTypeName(t));
+	for (const Handle& key: keys)
+		put_str(buf, encodeAtomToStr(key));
+	buf.append(abuf);
+	buf.append(vbuf);
+
+	std::string tmp = path + ".tmp." + std::to_string(getpid());
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return;
+
+	const char* p = buf.data();
+	size_t left = buf.size();
+	while (0 < left)
+	{
+		ssize_t n = write(fd, p, left);
+		if (n <= 0) break;
+		p += n;
+		left -= n;
+	}
+	close(fd);
+
+	if (0 < left or rename(tmp.c_str(), path.c_str()))
+	{
+		unlink(tmp.c_str());
+		return;
+	}
+
+	printf("Wrote image of %zu atoms to %s\n", order.size(), path.c_str());
+}
+
+/* ================================================================ */
+// Helpers for reading the image. All reads are bounds-checked;
+// a short or damaged image throws, and is then ignored.
+
+namespace {
+class ImageReader
+{
+	const char* _p;
+	const char* _end;
+
+	void need(size_t n)
+	{
+		if ((size_t) (_end - _p) < n)
+			throw IOException(TRACE_INFO, "Truncated AtomSpace image");
+	}
+
+public:
+	ImageReader(const char* start, size_t len) :
+		_p(start), _end(start + len) {}
+
+	// Bytes left to read. Counts read from the image are checked
+	// against this, before reserving space for them.
+	size_t left(void) const { return _end - _p; }
+
+	uint32_t u32(void)
+	{
+		uint32_t v;
+		need(sizeof(v));
+		memcpy(&v, _p, sizeof(v));
+		_p += sizeof(v);
+		return v;
+	}
+	uint64_t u64(void)
+	{
+		uint64_t v;
+		need(sizeof(v));
+		memcpy(&v, _p, sizeof(v));
+		_p += sizeof(v);
+		return v;
+	}
+	double dbl(void)
+	{
+		double v;
+		need(sizeof(v));
+		memcpy(&v, _p, sizeof(v));
+		_p += sizeof(v);
+		return v;
+	}
+	std::string str(void)
+	{
+		uint32_t len = u32();
+		need(len);
+		std::string s(_p, len);
+		_p += len;
+		return s;
+	}
+	bool magic(void)
+	{
+		need(sizeof(IMAGE_MAGIC));
+		bool ok = (0 == memcmp(_p, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)));
+		_p += sizeof(IMAGE_MAGIC);
+		return ok;
+	}
+};
+}
+
+/// Load the atoms in the AtomSpace at `cid` from the local image,
+/// if there is one. Returns false if there is no usable image.
+bool IPFSAtomStorage::load_image(AtomSpace* as, const std::string& cid)
+{
+	std::string path = image_path(cid);
+	if (0 == path.size()) return false;
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) or 0 == st.st_size)
+	{
+		close(fd);
+		return false;
+	}
+
+	size_t len = st.st_size;
+	void* map = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map) return false;
+	madvise(map, len, MADV_SEQUENTIAL);
+
+	bulk_start = time(0);
+	HandleSeq atoms;
+	try
+	{
+		ImageReader rd((const char*) map, len);
+		if (not rd.magic() or IMAGE_BYTE_ORDER != rd.u32())
+			throw IOException(TRACE_INFO, "Bad AtomSpace image");
+
+		uint32_t num_types = rd.u32();
+		uint64_t num_nodes = rd.u64();
+		uint64_t num_atoms = rd.u64();
+		uint64_t num_keys = rd.u64();
+		uint64_t num_values = rd.u64();
+
+		std::vector<Type> types;
+		for (uint32_t i=0; i<num_types; i++)
+			types.push_back(nameserver().getType(rd.str()));
+
+		// Unwanted keys are left as null handles.
+		HandleSeq keys;
+		for (uint64_t i=0; i<num_keys; i++)
+			keys.push_back(decodeWantedKey(rd.str()));
+		bool want_tvs = nullptr != decodeWantedKey(encodeAtomToStr(tvpred));
+
+		atoms.reserve(std::min<uint64_t>(num_atoms,
+		                                 rd.left() / sizeof(uint32_t)));
+		for (uint64_t i=0; i<num_atoms; i++)
+		{
+			uint32_t ti = rd.u32();
+			if (num_types <= ti)
+				throw IOException(TRACE_INFO, "Bad type in AtomSpace image");
+
+			if (i < num_nodes)
+			{
+				atoms.push_back(createNode(types[ti], rd.str()));
+				continue;
+			}
+
+			uint32_t arity = rd.u32();
+			HandleSeq oset;
+			oset.reserve(std::min<size_t>(arity,
+			                              rd.left() / sizeof(uint64_t)));
+			for (uint32_t j=0; j<arity; j++)
+			{
+				uint64_t idx = rd.u64();
+				if (i <= idx)
+					throw IOException(TRACE_INFO, "Bad link in AtomSpace image");
+				oset.push_back(atoms[idx]);
+			}
+			atoms.push_back(createLink(oset, types[ti]));
+		}
+
+		for (uint64_t i=0; i<num_values; i++)
+		{
+			uint64_t ai = rd.u64();
+			uint32_t ki = rd.u32();
+			uint32_t kind = rd.u32();
+			// Truth values, and only truth values, have the TV key.
+			bool tv_key = (IMAGE_TV_KEY == ki);
+			if (num_atoms <= ai or IMAGE_STRING < kind or
+			    tv_key != (IMAGE_TV == kind) or
+			    (not tv_key and num_keys <= ki))
+				throw IOException(TRACE_INFO, "Bad value in AtomSpace image");
+
+			if (IMAGE_TV == kind)
+			{
+				double strength = rd.dbl();
+				double confidence = rd.dbl();
+				if (want_tvs)
+					atoms[ai]->setTruthValue(
+						createSimpleTruthValue(strength, confidence));
+			}
+			else if (IMAGE_FLOAT == kind)
+			{
+				uint64_t n = rd.u64();
+				std::vector<double> fv;
+				fv.reserve(std::min<uint64_t>(n, rd.left() / sizeof(double)));
+				for (uint64_t j=0; j<n; j++) fv.push_back(rd.dbl());
+				if (keys[ki])
+					atoms[ai]->setValue(keys[ki], createFloatValue(fv));
+			}
+			else
+			{
+				std::string sv = rd.str();
+				if (keys[ki])
+					atoms[ai]->setValue(keys[ki], decodeStrValue(sv));
+			}
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		munmap(map, len);
+		std::cerr << "Ignoring AtomSpace image " << path << ": "
+		          << ex.what() << std::endl;
+		return false;
+	}
+	munmap(map, len);
+
+	for (const Handle& h: atoms)
+		as->add_atom(h);
+	_load_count += atoms.size();
+
+	time_t secs = time(0) - bulk_start;
+	printf("Finished loading %zu atoms from image %s in %d seconds\n",
+		atoms.size(), path.c_str(), (int) secs);
+	return true;
+}
+
+/* ============================= END OF FILE ================= */
@@ -28,39 +28,49 @@ void IPFSAtomStorage::store_incoming_of(const Handle& atom,
 	// cache.  Oh, and we need to do this atomically, because other
 	// threads might be writing. So lock must hold for the entire
 	// duration of the json edit.
+	//
+	// The incoming set is kept sorted, so that the json (and thus the
+	// CID) depends only on the contents of the incoming set, and not
+	// on the order in which the holders happened to be stored.
+	//
+	// If a rebase replaces the cached json before the root is
+	// patched, do it over.
 	ipfs::Json jatom;
+	std::string atoid;
+	size_t gen;
+	do
 	{
-		std::string holder_guid = get_atom_guid(holder);
-		std::lock_guard<std::mutex> lck(_json_mutex);
-		jatom = _json_map.find(atom)->second;
-
-		ipfs::Json jinco;
-		auto incli = jatom.find("incoming");
-		if (jatom.end() != incli)
 		{
+			std::string holder_guid = get_atom_guid(holder);
+			std::lock_guard<std::mutex> lck(_json_mutex);
+			gen = _json_gen;
+			jatom = _json_map.find(atom)->second;
+
+			std::set<std::string> inco;
+			auto incli = jatom.find("incoming");
+			if (jatom.end() != incli)
+				inco = incli->get<std::set<std::string>>();
+
 			// Is the atom already a part of the incoming set?
 			// If so, then there's nothing to do.
-			auto havit = incli->find(holder_guid);
-			if (incli->end() != havit) return;
-			jinco = *incli;
-		}
+			if (not inco.insert(holder_guid).second) return;
 
-		jinco.push_back(holder_guid);
-		jatom["incoming"] = jinco;
-		_json_map[atom] = jatom;
-	}
-
-	// Store the thing in IPFS
-	ipfs::Json result;
-	ipfs::Client* conn = conn_pool.pop();
-	conn->DagPut(jatom, &result);
-	conn_pool.push(conn);
+			jatom["incoming"] = inco;
+			_json_map[atom] = jatom;
+		}
 
-	std::string atoid = result["Cid"]["/"];
-	// std::cout << "Incoming Atom: " << encodeAtomToStr(atom)
-	//          << " CID: " << atoid << std::endl;
+		// Store the thing in IPFS
+		ipfs::Json result;
+		ipfs::Client* conn = conn_pool.pop();
+		_rpc_stats.timed(IPFSRpcStats::DAG_PUT,
+			[&]{ conn->DagPut(jatom, &result); });
+		conn_pool.push(conn);
 
-	update_atom_in_atomspace(atom, atoid);
+		atoid = result["Cid"]["/"];
+		// std::cout << "Incoming Atom: " << encodeAtomToStr(atom)
+		//          << " CID: " << atoid << std::endl;
+	}
+	while (not update_atom_in_atomspace(atom, atoid, gen));
 }
 
 /* ================================================================== */
@@ -76,41 +86,49 @@ void IPFSAtomStorage::remove_incoming_of(const Handle& atom,
 	// ask IPFS for the current json, or we can work out of what we
 	// have in the cache. Use the cache for speed. All edits to the
 	// json must be don atomically, since there may be other threads
-	// racing with us.
+	// racing with us. If a rebase replaces the cached json before
+	// the root is patched, do it over.
 	ipfs::Json jatom;
+	std::string atoid;
+	size_t gen;
+	do
 	{
-		std::lock_guard<std::mutex> lck(_json_mutex);
-		auto patom = _json_map.find(atom);
-		if (_json_map.end() == patom)
-			jatom = get_atom_json(atom);
-		else
-			jatom = patom->second; // jatom = _json_map[atom];
-
-		// Remove the holder from the incoming set ...
-		auto pinco = jatom.find("incoming");
-		if (jatom.end() == pinco)
-			throw RuntimeException(TRACE_INFO,
-				"Error: Atom is missing incoming set! WTF!?\n");
-
-		std::set<std::string> inco = *pinco; // inco = jatom["incoming"];
-		inco.erase(holder);
-		if (0 < inco.size())
-			jatom["incoming"] = inco;
-		else
-			jatom.erase("incoming");
-		// std::cout << "Atom after erasure: " << jatom.dump(2) << std::endl;
-		_json_map[atom] = jatom;
-	}
+		{
+			std::lock_guard<std::mutex> lck(_json_mutex);
+			gen = _json_gen;
+			auto patom = _json_map.find(atom);
+			if (_json_map.end() == patom)
+				jatom = get_atom_json(atom);
+			else
+				jatom = patom->second; // jatom = _json_map[atom];
+
+			// Remove the holder from the incoming set ...
+			auto pinco = jatom.find("incoming");
+			if (jatom.end() == pinco)
+				throw RuntimeException(TRACE_INFO,
+					"Error: Atom is missing incoming set! WTF!?\n");
 
-	// Store the edited Atom back into IPFS...
-	ipfs::Json result;
-	ipfs::Client* conn = conn_pool.pop();
-	conn->DagPut(jatom, &result);
-	conn_pool.push(conn);
+			std::set<std::string> inco = *pinco; // inco = jatom["incoming"];
+			inco.erase(holder);
+			if (0 < inco.size())
+				jatom["incoming"] = inco;
+			else
+				jatom.erase("incoming");
+			// std::cout << "Atom after erasure: " << jatom.dump(2) << std::endl;
+			_json_map[atom] = jatom;
+		}
 
-	// Finally, update the Atomspace with this revised Atom.
-	std::string atoid = result["Cid"]["/"];
-	update_atom_in_atomspace(atom, atoid);
+		// Store the edited Atom back into IPFS...
+		ipfs::Json result;
+		ipfs::Client* conn = conn_pool.pop();
+		_rpc_stats.timed(IPFSRpcStats::DAG_PUT,
+			[&]{ conn->DagPut(jatom, &result); });
+		conn_pool.push(conn);
+
+		// Finally, update the Atomspace with this revised Atom.
+		atoid = result["Cid"]["/"];
+	}
+	while (not update_atom_in_atomspace(atom, atoid, gen));
 }
 
 /* ================================================================ */
@@ -123,26 +141,44 @@ void IPFSAtomStorage::getIncomingSet(AtomTable& table, const Handle& h)
 {
 	rethrow();
 
-	// Get the incoming set of the atom.
-	std::string path = _atomspace_cid + "/" + h->to_short_string();
-	ipfs::Json dag;
-	ipfs::Client* conn = conn_pool.pop();
-	conn->DagGet(path, &dag);
-	conn_pool.push(conn);
+	// Get the incoming set of the atom. Pin the root, so that the
+	// incoming set and the values all come from the same root.
+	RootPin root = pin_root();
+	ipfs::Json dag(get_atom_json(h, *root));
 	// std::cout << "The dag is:" << dag.dump(2) << std::endl;
 
+	std::mutex hmtx;
+	HandleSeq holders;
+	std::vector<IPFSIOPool::Task> fetches;
 	auto iset = dag["incoming"];
 	for (auto acid: iset)
 	{
 		// std::cout << "The incoming is:" << acid.dump(2) << std::endl;
 		// Fetch once, to get it's type & name/outgoing
 		// Fetch a second time to get the current values.
-		Handle h(fetch_atom(acid));
-		table.add(do_fetch_atom(h), false);
+		std::string guid = acid;
+		fetches.push_back([&, guid](void)
+		{
+			IPFSConnPool::ClassGuard fg(IPFSConnPool::FOREGROUND);
+			Handle hi(fetch_atom(guid));
+			Handle hl(do_fetch_atom(hi, *root));
+			table.add(hl, false);
+			std::lock_guard<std::mutex> lck(hmtx);
+			holders.push_back(hl);
+		});
 	}
+	_io_pool.run_all(fetches, IPFSIOPool::PRIORITY);
+
+	// Guess that the caller will go on to the neighbors.
+	prefetch_neighbors(h, holders, root);
+
+	// Links that are still queued for storing.
+	HandleSeq pending(get_pending_incoming(h));
+	for (const Handle& hl: pending)
+		table.add(hl, false);
 
 	_num_get_insets++;
-	_num_get_inlinks += iset.size();
+	_num_get_inlinks += iset.size() + pending.size();
 }
 
 /**
@@ -155,25 +191,144 @@ void IPFSAtomStorage::getIncomingByType(AtomTable& table, const Handle& h, Type
 
 	// Code is almost same as above. It's not terribly efficient.
 	// But it works, at least.
-	std::string path = _atomspace_cid + "/" + h->to_short_string();
-
-	ipfs::Json dag;
-	ipfs::Client* conn = conn_pool.pop();
-	conn->DagGet(path, &dag);
-	conn_pool.push(conn);
+	RootPin root = pin_root();
+	ipfs::Json dag(get_atom_json(h, *root));
 
+	std::mutex hmtx;
+	HandleSeq holders;
+	std::vector<IPFSIOPool::Task> fetches;
 	auto iset = dag["incoming"];
 	for (auto acid: iset)
 	{
-		Handle h(fetch_atom(acid));
-		if (t == h->get_type())
+		std::string guid = acid;
+		fetches.push_back([&, guid](void)
 		{
-			table.add(h, false);
-			_num_get_inlinks ++;
-		}
+			IPFSConnPool::ClassGuard fg(IPFSConnPool::FOREGROUND);
+			Handle h(fetch_atom(guid));
+			if (t == h->get_type())
+			{
+				table.add(h, false);
+				_num_get_inlinks ++;
+				std::lock_guard<std::mutex> lck(hmtx);
+				holders.push_back(h);
+			}
+		});
+	}
+	_io_pool.run_all(fetches, IPFSIOPool::PRIORITY);
+
+	// Guess that the caller will go on to the neighbors.
+	prefetch_neighbors(h, holders, root);
+
+	// Links that are still queued for storing.
+	for (const Handle& hl: get_pending_incoming(h))
+	{
+		if (t != hl->get_type()) continue;
+		table.add(hl, false);
+		_num_get_inlinks ++;
 	}
 
 	_num_get_insets++;
 }
 
+/**
+ * Load the atom, and everything within `hops` hops of it, following
+ * both the outgoing and the incoming sets, together with the values.
+ *
+ * This is a breadth-first walk. The atoms of each level are fetched
+ * at once, and so are the holders that they have. Holders that are
+ * already known, by guid, are not fetched again. Each level is added
+ * to the table once it is complete. The root is pinned, so that the
+ * whole neighborhood comes from one version of the AtomSpace.
+ */
+void IPFSAtomStorage::loadNeighborhood(AtomTable& table, const Handle& h,
+                                       int hops)
+{
+	rethrow();
+	RootPin root = pin_root();
+
+	HandleSet seen;
+	seen.insert(h);
+	HandleSeq frontier({h});
+	for (int hop = 0; 0 < frontier.size(); hop++)
+	{
+		bool expand = hop < hops;
+
+		// The values and the incoming sets of this level.
+		std::mutex nmtx;
+		std::set<std::string> inguids;
+		std::vector<IPFSIOPool::Task> fetches;
+		for (const Handle& ha: frontier)
+		{
+			fetches.push_back([&, ha](void)
+			{
+				IPFSConnPool::ClassGuard fg(IPFSConnPool::FOREGROUND);
+				ipfs::Json dag = get_atom_json(ha, *root);
+				if (0 == dag.size()) return;
+
+				Handle hv(ha);
+				get_atom_values(hv, dag);
+				if (not expand) return;
+
+				auto pinc = dag.find("incoming");
+				if (dag.end() == pinc) return;
+				std::lock_guard<std::mutex> lck(nmtx);
+				for (const auto& jguid: *pinc)
+					inguids.insert(json_guid(jguid));
+			});
+		}
+		_io_pool.run_all(fetches, IPFSIOPool::PRIORITY);
+
+		for (const Handle& ha: frontier)
+			table.add(ha, false);
+		_load_count += frontier.size();
+		if (not expand) break;
+
+		// The next level: the outgoing sets ...
+		HandleSeq next;
+		for (const Handle& ha: frontier)
+		{
+			if (not ha->is_link()) continue;
+			for (const Handle& ho: ha->getOutgoingSet())
+				if (seen.insert(ho).second) next.push_back(ho);
+		}
+
+		// ... and the holders. Fetch only those not known yet.
+		HandleSeq holders;
+		std::vector<std::string> unknown;
+		for (const std::string& guid: inguids)
+		{
+			Handle hk(lookup_guid(guid));
+			if (hk) holders.push_back(hk);
+			else unknown.push_back(guid);
+		}
+
+		std::unordered_map<std::string, ipfs::Json> dags;
+		fetch_guid_dags(unknown, dags);
+
+		std::vector<IPFSIOPool::Task> decodes;
+		for (const std::string& guid: unknown)
+		{
+			decodes.push_back([&, guid](void)
+			{
+				IPFSConnPool::ClassGuard fg(IPFSConnPool::FOREGROUND);
+				auto pd = dags.find(guid);
+				if (dags.end() == pd or 0 == pd->second.size()) return;
+				Handle hn(decodeJSONAtom(pd->second));
+				{
+					std::lock_guard<std::mutex> lck(_inv_mutex);
+					hn = _guid_inv_map.insert({guid, hn}).first->second;
+				}
+				std::lock_guard<std::mutex> lck(nmtx);
+				holders.push_back(hn);
+			});
+		}
+		_io_pool.run_all(decodes, IPFSIOPool::PRIORITY);
+
+		for (const Handle& hl: holders)
+			if (seen.insert(hl).second) next.push_back(hl);
+
+		frontier.swap(next);
+	}
+}
+
 /* ============================= END OF FILE ================= */
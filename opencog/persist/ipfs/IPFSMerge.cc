@@ -0,0 +1,244 @@
+/*
+ * IPFSMerge.cc
+ * Three-way merge of forked AtomSpace roots.
+ *
+ * When two writers start from the same AtomSpace root, and each of
+ * them stores Atoms, the result is two different roots: the AtomSpace
+ * has been forked.  The code here merges two such forks, given the
+ * common ancestor root. Only those directory entries whose CID differs
+ * between the roots are examined; Atoms that were not changed by
+ * either writer are never fetched.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <stdlib.h>
+#include <time.h>
+
+#include <opencog/atoms/base/Atom.h>
+
+#include "IPFSAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+
+/// Three-way merge of one json object, key by key. Any key changed
+/// on only one side takes that change; keys changed on both sides
+/// are resolved with the merge rule. Deleted keys are null.
+/// Returns the number of conflicts.
+static size_t merge_keys(const ipfs::Json& base,
+                         const ipfs::Json& ours,
+                         const ipfs::Json& theirs,
+                         ipfs::Json& merged,
+                         IPFSAtomStorage::MergeRule rule)
+{
+	static const ipfs::Json none;
+	auto get = [](const ipfs::Json& obj, const std::string& key)
+		-> const ipfs::Json&
+	{
+		auto it = obj.find(key);
+		if (obj.end() == it) return none;
+		return *it;
+	};
+
+	size_t conflicts = 0;
+	merged = ours.is_object() ? ours : ipfs::Json::object();
+	if (not theirs.is_object()) return 0;
+
+	for (const auto& [key, tval]: theirs.items())
+	{
+		const ipfs::Json& oval = get(ours, key);
+		const ipfs::Json& bval = get(base, key);
+		if (oval == tval or tval == bval) continue;
+		if (oval == bval or IPFSAtomStorage::MERGE_THEIRS == rule)
+			merged[key] = tval;
+		if (oval != bval) conflicts++;
+	}
+
+	// Keys that they deleted. Delete them too, unless we changed them.
+	if (base.is_object())
+	{
+		for (const auto& [key, bval]: base.items())
+		{
+			if (theirs.end() != theirs.find(key)) continue;
+			const ipfs::Json& oval = get(ours, key);
+			if (oval.is_null()) continue;
+			if (oval == bval or IPFSAtomStorage::MERGE_THEIRS == rule)
+				merged.erase(key);
+			if (oval != bval) conflicts++;
+		}
+	}
+	return conflicts;
+}
+
+/// Merge two versions of an Atom, given the common ancestor version.
+/// The Atom itself is the same in all three; only the incoming set,
+/// the TruthValue and the values can differ. The incoming sets are
+/// unioned; the values are merged key-by-key. Any of the CIDs may be
+/// empty, if that version of the Atom does not exist. Returns the CID
+/// of the merged Atom. All I/O is done on the connection `conn`, which
+/// the caller holds for the whole merge.
+std::string IPFSAtomStorage::merge_atom(const std::string& base_cid,
+                                        const std::string& our_cid,
+                                        const std::string& their_cid,
+                                        MergeRule rule,
+                                        ipfs::Client* conn)
+{
+	ipfs::Json base;
+	if (0 < base_cid.size()) base = fetch_atom_dag(base_cid, conn);
+	ipfs::Json ours = fetch_atom_dag(our_cid, conn);
+	ipfs::Json theirs = fetch_atom_dag(their_cid, conn);
+
+	ipfs::Json merged = ours;
+
+	// Union of the incoming sets.
+	std::set<std::string> inco;
+	auto poi = ours.find("incoming");
+	if (ours.end() != poi)
+		for (const std::string& guid: *poi) inco.insert(guid);
+	auto pti = theirs.find("incoming");
+	if (theirs.end() != pti)
+		for (const std::string& guid: *pti) inco.insert(guid);
+	if (0 < inco.size())
+		merged["incoming"] = inco;
+
+	// Key-by-key merge of the values.
+	ipfs::Json none;
+	auto values_of = [&](const ipfs::Json& jatom) -> const ipfs::Json&
+	{
+		auto pvals = jatom.find("values");
+		if (jatom.end() == pvals) return none;
+		return *pvals;
+	};
+	ipfs::Json vals;
+	_num_merge_conflicts +=
+		merge_keys(values_of(base), values_of(ours), values_of(theirs),
+		           vals, rule);
+	if (0 < vals.size())
+		merged["values"] = vals;
+	else
+		merged.erase("values");
+
+	// The SimpleTruthValue is stored outside of the values, but is
+	// merged as if it were one more key.
+	auto tv_of = [](const ipfs::Json& jatom) -> ipfs::Json
+	{
+		ipfs::Json jtv = ipfs::Json::object();
+		auto ptv = jatom.find("tv");
+		if (jatom.end() != ptv) jtv["tv"] = *ptv;
+		return jtv;
+	};
+	ipfs::Json tvs;
+	_num_merge_conflicts +=
+		merge_keys(tv_of(base), tv_of(ours), tv_of(theirs), tvs, rule);
+	auto ptv = tvs.find("tv");
+	if (tvs.end() != ptv)
+		merged["tv"] = *ptv;
+	else
+		merged.erase("tv");
+
+	ipfs::Json result;
+	_rpc_stats.timed(IPFSRpcStats::DAG_PUT,
+		[&]{ conn->DagPut(merged, &result); });
+
+	return result["Cid"]["/"];
+}
+
+/* ================================================================ */
+
+/// Three-way merge of the AtomSpace roots `ours` and `theirs`, which
+/// both descend from the root `base`. Returns the CID of the merged
+/// root. The merged root is built by patching `ours`, so that only
+/// the entries that they changed are touched:
+///  * Entries changed by them, but not by us, are taken from them.
+///  * Entries changed by both are merged with `merge_atom()`.
+///  * Entries deleted by them are deleted, unless we changed them.
+///  * Entries deleted by us, but changed by them, are kept.
+/// Entries that are the same in `base` and `theirs` are never fetched.
+std::string IPFSAtomStorage::merge_atomspace(const std::string& base_path,
+                                             const std::string& our_path,
+                                             const std::string& their_path,
+                                             MergeRule rule)
+{
+	rethrow();
+
+	RootEntries base;
+	RootEntries ours;
+	RootEntries theirs;
+	get_root_entries(base_path, base);
+	get_root_entries(our_path, ours);
+	get_root_entries(their_path, theirs);
+
+	return merge_roots(base, ours, theirs, path_to_cid(our_path), rule);
+}
+
+/// The merge itself, given the entries of all three roots, and the
+/// CID of our root.
+std::string IPFSAtomStorage::merge_roots(const RootEntries& base,
+                                         const RootEntries& ours,
+                                         const RootEntries& theirs,
+                                         const std::string& our_cid,
+                                         MergeRule rule)
+{
+	auto cid_of = [](const RootEntries& ents, const std::string& name)
+		-> std::string
+	{
+		auto it = ents.find(name);
+		if (ents.end() == it) return "";
+		return it->second;
+	};
+
+	time_t start = time(0);
+	size_t num_changed = 0;
+	std::string merged = our_cid;
+	ipfs::Client* conn = conn_pool.pop();
+	try
+	{
+		for (const auto& [name, tcid]: theirs)
+		{
+			std::string bcid = cid_of(base, name);
+			std::string ocid = cid_of(ours, name);
+			if (tcid == bcid or tcid == ocid) continue;
+
+			std::string new_cid = tcid;
+			if (0 < ocid.size() and ocid != bcid)
+				new_cid = merge_atom(bcid, ocid, tcid, rule, conn);
+
+			std::string new_root;
+			_rpc_stats.timed(IPFSRpcStats::OBJECT_PATCH,
+				[&, &label = name]{
+					conn->ObjectPatchAddLink(merged, label, new_cid, &new_root); });
+			merged = new_root;
+			num_changed++;
+		}
+
+		for (const auto& [name, bcid]: base)
+		{
+			if (theirs.end() != theirs.find(name)) continue;
+			if (bcid != cid_of(ours, name)) continue;
+
+			std::string new_root;
+			_rpc_stats.timed(IPFSRpcStats::OBJECT_PATCH,
+				[&, &label = name]{
+					conn->ObjectPatchRmLink(merged, label, &new_root); });
+			merged = new_root;
+			num_changed++;
+		}
+	}
+	catch (...)
+	{
+		conn_pool.push(conn);
+		throw;
+	}
+	conn_pool.push(conn);
+
+	_num_merges++;
+	printf("Merged %zu changed atoms in %d seconds\n",
+	       num_changed, (int) (time(0) - start));
+	printf("Merged AtomSpace CID: %s\n", merged.c_str());
+
+	return merged;
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,200 @@
+/*
+ * IPFSMetrics.cc
+ * Export of the performance statistics, for monitoring.
+ *
+ * The Prometheus text format is described at
+ * https://prometheus.io/docs/instrumenting/exposition_formats/
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include <set>
+
+#include <ipfs/client.h>
+
+#include "IPFSMetrics.h"
+
+using namespace opencog;
+
+static const char* rpc_name[] = {
+	"dag_get", "dag_put", "object_patch", "files_add", "files_get",
+	"key", "name_publish", "dag_export" };
+
+/* ================================================================ */
+
+void IPFSMetrics::counter(const std::string& name, const std::string& help,
+                          double value, const Labels& labels)
+{
+	_samples.push_back({name, help, COUNTER, labels, value});
+}
+
+void IPFSMetrics::gauge(const std::string& name, const std::string& help,
+                        double value, const Labels& labels)
+{
+	_samples.push_back({name, help, GAUGE, labels, value});
+}
+
+std::string IPFSMetrics::key(const Sample& s)
+{
+	std::string k = s.name + "{";
+	for (const auto& [lab, val]: s.labels)
+		k += lab + "=" + val + ",";
+	return k + "}";
+}
+
+/// Add the counters to what was carried over so far.
+void IPFSMetrics::carry_into(Carry& carry) const
+{
+	for (const Sample& s: _samples)
+		if (COUNTER == s.type) carry[key(s)] += s.value;
+}
+
+/// Add what was carried over to the counters.
+void IPFSMetrics::add_carry(const Carry& carry)
+{
+	for (Sample& s: _samples)
+	{
+		if (COUNTER != s.type) continue;
+		auto it = carry.find(key(s));
+		if (carry.end() != it) s.value += it->second;
+	}
+}
+
+/* ================================================================ */
+
+static std::string escape(const std::string& str, bool quotes)
+{
+	std::string out;
+	for (char c: str)
+	{
+		if ('\\' == c) out += "\\\\";
+		else if ('\n' == c) out += "\\n";
+		else if (quotes and '"' == c) out += "\\\"";
+		else out += c;
+	}
+	return out;
+}
+
+static std::string number(double value)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%.15g", value);
+	return buf;
+}
+
+/// The Prometheus text exposition format. All of the samples of one
+/// metric must be together, under one HELP and TYPE line; they are
+/// grouped here, in the order in which the metrics were first seen.
+std::string IPFSMetrics::prometheus(void) const
+{
+	std::string out;
+	std::set<std::string> done;
+	for (const Sample& first: _samples)
+	{
+		if (not done.insert(first.name).second) continue;
+
+		out += "# HELP " + first.name + " " + escape(first.help, false) + "\n";
+		out += "# TYPE " + first.name + " " +
+			(COUNTER == first.type ? "counter" : "gauge") + "\n";
+
+		for (const Sample& s: _samples)
+		{
+			if (s.name != first.name) continue;
+			out += s.name;
+			if (0 < s.labels.size())
+			{
+				out += "{";
+				const char* sep = "";
+				for (const auto& [lab, val]: s.labels)
+				{
+					out += sep + lab + "=\"" + escape(val, true) + "\"";
+					sep = ",";
+				}
+				out += "}";
+			}
+			out += " " + number(s.value) + "\n";
+		}
+	}
+	return out;
+}
+
+/// A json object, holding the time of the reading, and a list with
+/// one entry per sample.
+std::string IPFSMetrics::json(void) const
+{
+	ipfs::Json jsamples = ipfs::Json::array();
+	for (const Sample& s: _samples)
+	{
+		ipfs::Json jlabels = ipfs::Json::object();
+		for (const auto& [lab, val]: s.labels)
+			jlabels[lab] = val;
+
+		jsamples.push_back({
+			{"name", s.name},
+			{"type", COUNTER == s.type ? "counter" : "gauge"},
+			{"help", s.help},
+			{"labels", jlabels},
+			{"value", s.value}});
+	}
+
+	ipfs::Json jmetrics = {{"time", (long) time(0)}, {"metrics", jsamples}};
+	return jmetrics.dump(1);
+}
+
+/* ================================================================ */
+
+IPFSRpcStats::IPFSRpcStats(void)
+{
+	clear_stats();
+}
+
+void IPFSRpcStats::add_time(Rpc rpc,
+                            std::chrono::steady_clock::time_point start)
+{
+	_usecs[rpc] += std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+void IPFSRpcStats::clear_stats(void)
+{
+	for (int r=0; r<NUM_RPCS; r++)
+	{
+		_num_calls[r] = 0;
+		_num_errors[r] = 0;
+		_usecs[r] = 0;
+	}
+}
+
+void IPFSRpcStats::print_stats(void)
+{
+	for (int r=0; r<NUM_RPCS; r++)
+	{
+		size_t calls = _num_calls[r];
+		size_t errors = _num_errors[r];
+		size_t usecs = _usecs[r];
+		if (0 == calls) continue;
+		printf("rpc %s: calls=%zu errors=%zu avg time=%f msecs\n",
+		       rpc_name[r], calls, errors, 0.001 * usecs / calls);
+	}
+}
+
+void IPFSRpcStats::collect_metrics(IPFSMetrics& m)
+{
+	for (int r=0; r<NUM_RPCS; r++)
+	{
+		IPFSMetrics::Labels lab = {{"rpc", rpc_name[r]}};
+		m.counter("atomspace_ipfs_rpc_calls_total",
+		          "Calls made to the IPFS daemon.", _num_calls[r], lab);
+		m.counter("atomspace_ipfs_rpc_errors_total",
+		          "Calls to the IPFS daemon that failed.", _num_errors[r], lab);
+		m.counter("atomspace_ipfs_rpc_seconds_total",
+		          "Time spent in calls to the IPFS daemon.",
+		          1.0e-6 * _usecs[r], lab);
+	}
+}
+
+/* ============================= END OF FILE ================= */
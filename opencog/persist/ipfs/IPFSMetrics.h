@@ -0,0 +1,117 @@
+/*
+ * FILE:
+ * opencog/persist/ipfs/IPFSMetrics.h
+
+ * FUNCTION:
+ * Export of the performance statistics, for monitoring.
+ *
+ * HISTORY:
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_IPFS_METRICS_H
+#define _OPENCOG_IPFS_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// One reading of the performance statistics, as a list of samples,
+/// that can be written out in the Prometheus text format, or as json.
+/// Counters only ever go up; anything that can also go down, or that
+/// is a maximum or a current setting, is a gauge.
+class IPFSMetrics
+{
+	public:
+		enum Type { COUNTER, GAUGE };
+		typedef std::vector<std::pair<std::string, std::string>> Labels;
+
+		struct Sample
+		{
+			std::string name;
+			std::string help;
+			Type type;
+			Labels labels;
+			double value;
+		};
+
+		void counter(const std::string& name, const std::string& help,
+		             double value, const Labels& = Labels());
+		void gauge(const std::string& name, const std::string& help,
+		           double value, const Labels& = Labels());
+
+		// The statistics can be cleared, but exported counters must
+		// not go backwards. What the counters counted before they were
+		// cleared is carried over, keyed by name and labels.
+		typedef std::map<std::string, double> Carry;
+		void carry_into(Carry&) const;
+		void add_carry(const Carry&);
+
+		std::string prometheus(void) const;
+		std::string json(void) const;
+
+	private:
+		std::vector<Sample> _samples;
+		static std::string key(const Sample&);
+};
+
+/// Calls to the IPFS daemon, by kind: how many were made, how many
+/// failed, and how long they took, in all. Wrap each call with
+/// `timed()`, for example
+///
+///    _rpc_stats.timed(IPFSRpcStats::DAG_GET, [&]{ conn->DagGet(cid, &dag); });
+///
+/// A call that throws is counted as failed; the exception is passed on.
+class IPFSRpcStats
+{
+	public:
+		enum Rpc { DAG_GET, DAG_PUT, OBJECT_PATCH, FILES_ADD, FILES_GET,
+		           KEY, NAME_PUBLISH, DAG_EXPORT, NUM_RPCS };
+
+		IPFSRpcStats(void);
+
+		template<typename F>
+		void timed(Rpc rpc, F&& f)
+		{
+			auto start = std::chrono::steady_clock::now();
+			_num_calls[rpc]++;
+			try
+			{
+				f();
+			}
+			catch (...)
+			{
+				_num_errors[rpc]++;
+				add_time(rpc, start);
+				throw;
+			}
+			add_time(rpc, start);
+		}
+
+		void clear_stats(void);
+		void print_stats(void);
+		void collect_metrics(IPFSMetrics&);
+
+	private:
+		std::atomic<size_t> _num_calls[NUM_RPCS];
+		std::atomic<size_t> _num_errors[NUM_RPCS];
+		std::atomic<size_t> _usecs[NUM_RPCS];
+		void add_time(Rpc, std::chrono::steady_clock::time_point);
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_IPFS_METRICS_H
@@ -24,6 +24,7 @@ IPFSPersistSCM::IPFSPersistSCM(AtomSpace *as)
 {
     _as = as;
     _backing = nullptr;
+    _cursor_count = 0;
 
     static bool is_init = false;
     if (is_init) return;
@@ -50,18 +51,39 @@ void IPFSPersistSCM::init(void)
     define_scheme_primitive("ipfs-close", &IPFSPersistSCM::do_close, this, "persist-ipfs");
     define_scheme_primitive("ipfs-stats", &IPFSPersistSCM::do_stats, this, "persist-ipfs");
     define_scheme_primitive("ipfs-clear-stats", &IPFSPersistSCM::do_clear_stats, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-metrics", &IPFSPersistSCM::do_metrics, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-metrics-file", &IPFSPersistSCM::do_metrics_file, this, "persist-ipfs");
 
     define_scheme_primitive("ipfs-atom-cid", &IPFSPersistSCM::do_atom_cid, this, "persist-ipfs");
     define_scheme_primitive("ipfs-fetch-atom", &IPFSPersistSCM::do_fetch_atom, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-store-value", &IPFSPersistSCM::do_store_value, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-fetch-value", &IPFSPersistSCM::do_fetch_value, this, "persist-ipfs");
     define_scheme_primitive("ipfs-load-atomspace", &IPFSPersistSCM::do_load_atomspace, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-load-neighborhood", &IPFSPersistSCM::do_load_neighborhood, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-cursor-open", &IPFSPersistSCM::do_cursor_open, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-cursor-next", &IPFSPersistSCM::do_cursor_next, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-cursor-position", &IPFSPersistSCM::do_cursor_position, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-cursor-close", &IPFSPersistSCM::do_cursor_close, this, "persist-ipfs");
     define_scheme_primitive("ipfs-atomspace-cid", &IPFSPersistSCM::do_ipfs_atomspace, this, "persist-ipfs");
     define_scheme_primitive("ipns-atomspace-cid", &IPFSPersistSCM::do_ipns_atomspace, this, "persist-ipfs");
     define_scheme_primitive("ipfs-publish-atomspace", &IPFSPersistSCM::do_publish_atomspace, this, "persist-ipfs");
     define_scheme_primitive("ipfs-resolve-atomspace", &IPFSPersistSCM::do_resolve_atomspace, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-ipns-refresh", &IPFSPersistSCM::do_ipns_refresh, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-value-keys", &IPFSPersistSCM::do_value_keys, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-value-blocks", &IPFSPersistSCM::do_value_blocks, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-write-combine", &IPFSPersistSCM::do_write_combine, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-adaptive-flow", &IPFSPersistSCM::do_adaptive_flow, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-prefetch", &IPFSPersistSCM::do_prefetch, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-prefetch-depth", &IPFSPersistSCM::do_prefetch_depth, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-snapshot", &IPFSPersistSCM::do_snapshot, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-load-snapshot", &IPFSPersistSCM::do_load_snapshot, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-sync-atomspace", &IPFSPersistSCM::do_sync_atomspace, this, "persist-ipfs");
+    define_scheme_primitive("ipfs-merge-atomspace", &IPFSPersistSCM::do_merge_atomspace, this, "persist-ipfs");
 }
 
 IPFSPersistSCM::~IPFSPersistSCM()
 {
+    close_cursors();
     if (_backing) delete _backing;
 }
 
@@ -109,6 +131,9 @@ void IPFSPersistSCM::do_close(void)
     IPFSAtomStorage *backing = _backing;
     _backing = nullptr;
 
+    // The cursors use the backing store.
+    close_cursors();
+
     // The destructor might run for a while before its done; it will
     // be emptying the pending store queues, which might take a while.
     // So unhook the atomspace first -- this will prevent new writes
@@ -136,6 +161,91 @@ Handle IPFSPersistSCM::do_fetch_atom(const std::string& cid)
     return _as->add_atom(_backing->fetch_atom(cid));
 }
 
+void IPFSPersistSCM::do_store_value(const Handle& atom, const Handle& key)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-store-value: Error: Database not open");
+
+    _backing->storeValue(atom, key);
+}
+
+Handle IPFSPersistSCM::do_fetch_value(const Handle& atom, const Handle& key)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-fetch-value: Error: Database not open");
+
+    Handle ha(_as->add_atom(atom));
+    _backing->loadValue(ha, key);
+    return ha;
+}
+
+Handle IPFSPersistSCM::do_load_neighborhood(const Handle& atom, int hops)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-load-neighborhood: Error: Database not open");
+
+    if (hops < 0)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-load-neighborhood: Error: hops must not be negative");
+
+    Handle ha(_as->add_atom(atom));
+    _backing->loadNeighborhood(_as->get_atomtable(), ha, hops);
+    return ha;
+}
+
+std::string IPFSPersistSCM::do_cursor_open(const std::string& token,
+                                           int batch, bool values)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-cursor-open: Error: Database not open");
+
+    if (batch <= 0)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-cursor-open: Error: batch size must be positive");
+
+    IPFSAtomCursor* cur = new IPFSAtomCursor(_backing, token, batch, values);
+    std::string name = "cursor-" + std::to_string(++_cursor_count);
+    _cursors[name] = cur;
+    return name;
+}
+
+IPFSAtomCursor* IPFSPersistSCM::get_cursor(const std::string& name,
+                                           const char* fn)
+{
+    auto it = _cursors.find(name);
+    if (_cursors.end() == it)
+        throw RuntimeException(TRACE_INFO,
+            "%s: Error: No cursor named '%s'", fn, name.c_str());
+    return it->second;
+}
+
+void IPFSPersistSCM::close_cursors(void)
+{
+    for (auto& nc: _cursors)
+        delete nc.second;
+    _cursors.clear();
+}
+
+HandleSeq IPFSPersistSCM::do_cursor_next(const std::string& name)
+{
+    return get_cursor(name, "ipfs-cursor-next")->next();
+}
+
+std::string IPFSPersistSCM::do_cursor_position(const std::string& name)
+{
+    return get_cursor(name, "ipfs-cursor-position")->position();
+}
+
+void IPFSPersistSCM::do_cursor_close(const std::string& name)
+{
+    delete get_cursor(name, "ipfs-cursor-close");
+    _cursors.erase(name);
+}
+
 void IPFSPersistSCM::do_load_atomspace(const std::string& cid)
 {
     if (nullptr == _backing)
@@ -181,6 +291,135 @@ void IPFSPersistSCM::do_resolve_atomspace(void)
     return _backing->resolve_atomspace();
 }
 
+void IPFSPersistSCM::do_ipns_refresh(bool on)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-ipns-refresh: Error: Database not open");
+
+    _backing->set_ipns_refresh(on);
+}
+
+void IPFSPersistSCM::do_value_keys(const HandleSeq& keys)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-value-keys: Error: Database not open");
+
+    _backing->set_value_keys(keys);
+}
+
+void IPFSPersistSCM::do_value_blocks(int size)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-value-blocks: Error: Database not open");
+
+    if (size < 0)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-value-blocks: Error: size must not be negative");
+
+    _backing->set_value_block_size(size);
+}
+
+void IPFSPersistSCM::do_write_combine(int msec)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-write-combine: Error: Database not open");
+
+    if (msec < 0)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-write-combine: Error: window must not be negative");
+
+    _backing->set_write_combine_window(msec);
+}
+
+void IPFSPersistSCM::do_adaptive_flow(bool on)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-adaptive-flow: Error: Database not open");
+
+    _backing->set_adaptive_flow(on);
+}
+
+void IPFSPersistSCM::do_prefetch(int nbytes)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-prefetch: Error: Database not open");
+
+    if (nbytes < 0)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-prefetch: Error: size must not be negative");
+
+    _backing->set_prefetch(nbytes);
+}
+
+void IPFSPersistSCM::do_prefetch_depth(int depth)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-prefetch-depth: Error: Database not open");
+
+    if (depth < 1 or 2 < depth)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-prefetch-depth: Error: depth must be 1 or 2");
+
+    _backing->set_prefetch_depth(depth);
+}
+
+std::string IPFSPersistSCM::do_snapshot(void)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-snapshot: Error: Database not open");
+
+    return "/ipfs/" + _backing->snapshot_atomspace(_as->get_atomtable());
+}
+
+void IPFSPersistSCM::do_load_snapshot(const std::string& cid)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-load-snapshot: Error: Database not open");
+
+    _backing->load_snapshot(_as->get_atomtable(), cid);
+}
+
+HandleSeq IPFSPersistSCM::do_sync_atomspace(const std::string& from,
+                                            const std::string& to)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-sync-atomspace: Error: Database not open");
+
+    return _backing->sync_atomspace(_as, from, to);
+}
+
+std::string IPFSPersistSCM::do_merge_atomspace(const std::string& base,
+                                               const std::string& ours,
+                                               const std::string& theirs,
+                                               const std::string& rule)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-merge-atomspace: Error: Database not open");
+
+    IPFSAtomStorage::MergeRule mr;
+    if (0 == rule.compare("ours"))
+        mr = IPFSAtomStorage::MERGE_OURS;
+    else if (0 == rule.compare("theirs"))
+        mr = IPFSAtomStorage::MERGE_THEIRS;
+    else
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-merge-atomspace: Error: Unknown merge rule '%s'",
+            rule.c_str());
+
+    return "/ipfs/" + _backing->merge_atomspace(base, ours, theirs, mr);
+}
+
 void IPFSPersistSCM::do_stats(void)
 {
     if (nullptr == _backing) {
@@ -202,6 +441,34 @@ void IPFSPersistSCM::do_clear_stats(void)
     _backing->clear_stats();
 }
 
+std::string IPFSPersistSCM::do_metrics(const std::string& format)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-metrics: Error: Database not open");
+
+    if (0 == format.compare("prometheus"))
+        return _backing->get_metrics(false);
+    if (0 == format.compare("json"))
+        return _backing->get_metrics(true);
+
+    throw RuntimeException(TRACE_INFO,
+        "ipfs-metrics: Error: Unknown format '%s'", format.c_str());
+}
+
+void IPFSPersistSCM::do_metrics_file(const std::string& path, int secs)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-metrics-file: Error: Database not open");
+
+    if (secs < 0)
+        throw RuntimeException(TRACE_INFO,
+            "ipfs-metrics-file: Error: interval must not be negative");
+
+    _backing->set_metrics_file(path, secs);
+}
+
 void opencog_persist_ipfs_init(void)
 {
     static IPFSPersistSCM patty(NULL);
@@ -9,10 +9,12 @@
 #ifndef _OPENCOG_IPFS_PERSIST_SCM_H
 #define _OPENCOG_IPFS_PERSIST_SCM_H
 
+#include <map>
 #include <string>
 
 #include <opencog/atomspace/AtomSpace.h>
 #include <opencog/atoms/base/Handle.h>
+#include <opencog/persist/ipfs/IPFSAtomCursor.h>
 #include <opencog/persist/ipfs/IPFSAtomStorage.h>
 
 namespace opencog
@@ -32,6 +34,12 @@ private:
 	IPFSAtomStorage *_backing;
 	AtomSpace *_as;
 
+	// Open cursors, by name.
+	std::map<std::string, IPFSAtomCursor*> _cursors;
+	unsigned long _cursor_count;
+	IPFSAtomCursor* get_cursor(const std::string&, const char*);
+	void close_cursors(void);
+
 public:
 	IPFSPersistSCM(AtomSpace*);
 	~IPFSPersistSCM();
@@ -41,14 +49,35 @@ public:
 	void do_load(void);
 	std::string do_atom_cid(const Handle&);
 	Handle do_fetch_atom(const std::string&);
+	void do_store_value(const Handle&, const Handle&);
+	Handle do_fetch_value(const Handle&, const Handle&);
+	Handle do_load_neighborhood(const Handle&, int);
+	std::string do_cursor_open(const std::string&, int, bool);
+	HandleSeq do_cursor_next(const std::string&);
+	std::string do_cursor_position(const std::string&);
+	void do_cursor_close(const std::string&);
 	void do_load_atomspace(const std::string&);
 	std::string do_ipfs_atomspace(void);
 	std::string do_ipns_atomspace(void);
 	void do_publish_atomspace(void);
 	void do_resolve_atomspace(void);
+	void do_ipns_refresh(bool);
+	void do_value_keys(const HandleSeq&);
+	void do_value_blocks(int);
+	void do_write_combine(int);
+	void do_adaptive_flow(bool);
+	void do_prefetch(int);
+	void do_prefetch_depth(int);
+	std::string do_snapshot(void);
+	void do_load_snapshot(const std::string&);
+	HandleSeq do_sync_atomspace(const std::string&, const std::string&);
+	std::string do_merge_atomspace(const std::string&, const std::string&,
+	                               const std::string&, const std::string&);
 
 	void do_stats(void);
 	void do_clear_stats(void);
+	std::string do_metrics(const std::string&);
+	void do_metrics_file(const std::string&, int);
 }; // class
 
 /** @}*/
@@ -0,0 +1,125 @@
+/*
+ * IPFSPrefetch.cc
+ * Speculative fetch of the neighborhood of incoming sets.
+ *
+ * Traversals, such as those of the pattern matcher, alternate between
+ * getIncomingSet() and fetches of the atoms in the outgoing sets of
+ * the holders, paying a full round trip at each hop. The prefetcher
+ * guesses the next hop: when an incoming set is fetched, the atoms in
+ * the outgoing sets of the holders are fetched in the background, and
+ * put into the block cache. With a depth of two, the incoming sets of
+ * those atoms are fetched as well.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include "IPFSAtomStorage.h"
+
+using namespace opencog;
+
+// Don't prefetch when the I/O pool already has this many tasks per
+// thread queued up; prefetches must not get in the way of real work.
+#define PREFETCH_MAX_QUEUED 8
+
+// Default prefetch depth.
+#define PREFETCH_DEPTH 1
+
+// What one incoming-set fetch may prefetch, in all: at most this many
+// blocks, and at most this fraction of the cache. A depth of two, on
+// a hub atom, would otherwise fetch every one of its many holders.
+#define PREFETCH_MAX_BLOCKS 256
+#define PREFETCH_CACHE_SHARE 8
+
+/* ================================================================ */
+
+/// Set the size of the block cache that the prefetcher fills, in
+/// bytes. Zero turns the prefetcher off, which is the default.
+void IPFSAtomStorage::set_prefetch(size_t nbytes)
+{
+	if (0 == _prefetch_depth) _prefetch_depth = PREFETCH_DEPTH;
+	_block_cache.set_max_bytes(nbytes);
+}
+
+/// How far to prefetch: one fetches the atoms in the outgoing sets
+/// of the holders; two also fetches the incoming sets of these.
+void IPFSAtomStorage::set_prefetch_depth(int depth)
+{
+	if (depth < 1) depth = 1;
+	if (2 < depth) depth = 2;
+	_prefetch_depth = depth;
+}
+
+/* ================================================================ */
+
+/// Queue up background fetches of the atoms in the outgoing sets of
+/// the holders, other than `h` itself, as they are in the given root.
+void IPFSAtomStorage::prefetch_neighbors(const Handle& h,
+                                         const HandleSeq& holders,
+                                         const RootPin& root)
+{
+	if (not _block_cache.enabled()) return;
+	if (PREFETCH_MAX_QUEUED * _io_pool.size() < _io_pool.queued()) return;
+
+	HandleSet nbrs;
+	for (const Handle& hl: holders)
+	{
+		if (nullptr == hl) continue;
+		for (const Handle& ho: hl->getOutgoingSet())
+			if (*ho != *h) nbrs.insert(ho);
+	}
+
+	PrefetchBudgetPtr budget(std::make_shared<PrefetchBudget>());
+	budget->atoms = PREFETCH_MAX_BLOCKS;
+	budget->bytes = _block_cache.max_bytes() / PREFETCH_CACHE_SHARE;
+
+	int depth = _prefetch_depth;
+	size_t queued = 0;
+	for (const Handle& ho: nbrs)
+	{
+		if (PREFETCH_MAX_BLOCKS <= queued) break;
+		std::string path = *root + "/" + ho->to_short_string();
+		if (_block_cache.contains(path)) continue;
+		_io_pool.submit([this, path, depth, budget](void)
+		{
+			prefetch_block(path, depth, budget);
+		}, IPFSIOPool::NORMAL);
+		queued++;
+	}
+}
+
+/// Fetch the block at `path` into the cache. If depth is more than
+/// one, then fetch the holders in its incoming set, too, for as long
+/// as the budget lasts. Failures are ignored; this is only a guess,
+/// and the real fetch will report them.
+void IPFSAtomStorage::prefetch_block(const std::string& path, int depth,
+                                     const PrefetchBudgetPtr& budget)
+{
+	if (budget->atoms-- <= 0 or budget->bytes <= 0) return;
+	IPFSConnPool::ClassGuard bg(IPFSConnPool::BACKGROUND);
+
+	ipfs::Json dag;
+	ipfs::Client* conn = conn_pool.pop();
+	try
+	{
+		_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+			[&]{ conn->DagGet(path, &dag); });
+	}
+	catch (const std::exception& ex) {}
+	conn_pool.push(conn);
+	if (0 == dag.size()) return;
+	budget->bytes -= _block_cache.put(path, dag, true);
+
+	if (depth < 2) return;
+	auto pinc = dag.find("incoming");
+	if (dag.end() == pinc) return;
+	for (const auto& jguid: *pinc)
+	{
+		std::string guid = json_guid(jguid);
+		if (budget->atoms <= 0 or budget->bytes <= 0) return;
+		if (_block_cache.contains(guid) or lookup_guid(guid)) continue;
+		prefetch_block(guid, 1, budget);
+	}
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,337 @@
+/*
+ * IPFSResolver.cc
+ * Background IPNS name resolution, with a local cache.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <stdio.h>
+
+#include <chrono>
+
+#include <ipfs/client.h>
+
+#include <opencog/util/exceptions.h>
+
+#include "IPFSResolver.h"
+
+using namespace opencog;
+
+// A known resolution older than this is refreshed in the background.
+#define RESOLVE_REFRESH_SECS 60
+
+/* ================================================================ */
+
+IPFSResolver::IPFSResolver(const std::string& host, int port,
+                           const std::string& cache_dir) :
+	_state(std::make_shared<State>())
+{
+	_state->keep_going = true;
+	_state->in_callback = false;
+	_state->host = host;
+	_state->port = port;
+	_state->cache_dir = cache_dir;
+	clear_stats();
+}
+
+/// Stop the thread. It might be in the middle of a resolution that
+/// will take another minute; rather than wait for that, let it go.
+/// It holds its own reference to the state, and will quit when the
+/// resolution returns. A callback that is running is waited for,
+/// though, as it refers to the owner of this resolver.
+IPFSResolver::~IPFSResolver()
+{
+	{
+		std::unique_lock<std::mutex> lck(_state->mtx);
+		_state->keep_going = false;
+		_state->callback = nullptr;
+		_state->idle_cv.wait(lck, [this] { return not _state->in_callback; });
+	}
+	_state->work_cv.notify_all();
+	_state->done_cv.notify_all();
+	if (_thread.joinable()) _thread.detach();
+}
+
+/// Set the function to call when a name resolves to a new CID.
+void IPFSResolver::on_resolve(const Callback& cb)
+{
+	std::unique_lock<std::mutex> lck(_state->mtx);
+	_state->idle_cv.wait(lck, [this] { return not _state->in_callback; });
+	_state->callback = cb;
+}
+
+/* ================================================================ */
+// The cache files.
+
+std::string IPFSResolver::cache_file(const State& st, const std::string& name)
+{
+	if (0 == st.cache_dir.size()) return "";
+	std::string fname = name;
+	for (char& c: fname) if ('/' == c) c = '_';
+	return st.cache_dir + "/" + fname;
+}
+
+/// Write the file to a temp file, and rename it into place, so that
+/// other processes never see a half-written file.
+void IPFSResolver::write_cache(const State& st, const std::string& name,
+                               const Resolution& res)
+{
+	std::string path = cache_file(st, name);
+	if (0 == path.size()) return;
+
+	std::string tmp = path + ".tmp";
+	FILE* fh = fopen(tmp.c_str(), "w");
+	if (nullptr == fh) return;
+	fprintf(fh, "%s %ld\n", res.cid.c_str(), (long) res.when);
+	bool ok = (0 == fclose(fh));
+	if (ok) rename(tmp.c_str(), path.c_str());
+	else remove(tmp.c_str());
+}
+
+bool IPFSResolver::read_cache(const std::string& name, Resolution& res)
+{
+	std::string path = cache_file(*_state, name);
+	if (0 == path.size()) return false;
+
+	FILE* fh = fopen(path.c_str(), "r");
+	if (nullptr == fh) return false;
+	char cid[256];
+	long when = 0;
+	int n = fscanf(fh, "%255s %ld", cid, &when);
+	fclose(fh);
+	if (2 != n) return false;
+
+	res.cid = cid;
+	res.when = when;
+	res.fresh = false;
+	res.updated = false;
+	return true;
+}
+
+/* ================================================================ */
+
+/// Queue a background resolution of the name, unless one is already
+/// queued, or, unless `again` is set, running. Must be called under
+/// the lock.
+void IPFSResolver::queue(const std::string& name, bool again)
+{
+	if (_state->pending.end() != _state->pending.find(name)) return;
+	if (not again and _state->busy.end() != _state->busy.find(name)) return;
+	_state->pending.insert(name);
+
+	// Start the thread, on first use.
+	if (not _thread.joinable())
+		_thread = std::thread(run, _state);
+	_state->work_cv.notify_one();
+}
+
+/// Resolve the name in the background. If it is being resolved right
+/// now, it is resolved once more, afterwards, as the running resolution
+/// may have started before the name was last published.
+void IPFSResolver::refresh(const std::string& name)
+{
+	std::lock_guard<std::mutex> lck(_state->mtx);
+	queue(name, true);
+}
+
+/// Record the CID that the name was just published with. This is
+/// newer than anything that IPNS will say for a while, as IPNS records
+/// take a while to propagate. Only the owner of the key can know this;
+/// what others say about the name must not be recorded here.
+void IPFSResolver::update(const std::string& name, const std::string& cid)
+{
+	Resolution res;
+	res.cid = cid;
+	res.when = time(0);
+	res.fresh = true;
+	res.updated = true;
+
+	std::lock_guard<std::mutex> lck(_state->mtx);
+	_state->resolved[name] = res;
+	_state->errors.erase(name);
+	write_cache(*_state, name, res);
+	_state->done_cv.notify_all();
+}
+
+/// Return the CID that the name resolves to. This is the last known
+/// CID, if there is one; it is refreshed in the background, if it is
+/// old. Otherwise, if `wait` is true, wait for the resolution, else
+/// return the empty string.
+std::string IPFSResolver::lookup(const std::string& name, bool wait)
+{
+	std::unique_lock<std::mutex> lck(_state->mtx);
+
+	auto it = _state->resolved.find(name);
+	if (_state->resolved.end() == it)
+	{
+		Resolution res;
+		if (read_cache(name, res))
+			it = _state->resolved.insert({name, res}).first;
+	}
+
+	if (_state->resolved.end() != it)
+	{
+		const Resolution& res = it->second;
+		if (not res.fresh or RESOLVE_REFRESH_SECS < time(0) - res.when)
+			queue(name);
+		_state->num_hits++;
+		return res.cid;
+	}
+
+	_state->errors.erase(name);
+	queue(name);
+	if (not wait) return "";
+
+	_state->num_waits++;
+	_state->done_cv.wait(lck, [&]
+	{
+		return not _state->keep_going or
+			_state->resolved.end() != _state->resolved.find(name) or
+			_state->errors.end() != _state->errors.find(name);
+	});
+
+	auto err = _state->errors.find(name);
+	if (_state->errors.end() != err)
+		throw IOException(TRACE_INFO, "Unable to resolve /ipns/%s: %s\n",
+		                  name.c_str(), err->second.c_str());
+
+	it = _state->resolved.find(name);
+	if (_state->resolved.end() == it)
+		throw IOException(TRACE_INFO, "Resolver stopped while resolving %s\n",
+		                  name.c_str());
+	return it->second.cid;
+}
+
+/* ================================================================ */
+
+void IPFSResolver::run(std::shared_ptr<State> st)
+{
+	ipfs::Client clnt(st->host, st->port);
+	std::unique_lock<std::mutex> lck(st->mtx);
+	while (true)
+	{
+		st->work_cv.wait(lck, [&st]
+			{ return not st->keep_going or 0 < st->pending.size(); });
+		if (not st->keep_going) break;
+
+		std::string name = *st->pending.begin();
+		st->pending.erase(st->pending.begin());
+		st->busy.insert(name);
+		lck.unlock();
+
+		// Caution: as of this writing, name resolution takes
+		// exactly 60 seconds.
+		time_t start = time(0);
+		auto call_start = std::chrono::steady_clock::now();
+		Resolution res;
+		std::string err;
+		try
+		{
+			std::string ipfs_path;
+			st->num_calls++;
+			clnt.NameResolve(name, &ipfs_path);
+			if (0 == ipfs_path.find("/ipfs/"))
+				ipfs_path = ipfs_path.substr(sizeof("/ipfs/") - 1);
+			res.cid = ipfs_path;
+			res.when = time(0);
+			res.fresh = true;
+			res.updated = false;
+		}
+		catch (const std::exception& ex)
+		{
+			err = ex.what();
+		}
+		st->call_usecs += std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - call_start).count();
+
+		lck.lock();
+		st->busy.erase(name);
+		if (not st->keep_going) break;
+
+		std::string old;
+		auto it = st->resolved.find(name);
+		if (st->resolved.end() != it and it->second.updated and
+		    start < it->second.when + RESOLVE_REFRESH_SECS)
+		{
+			// Published recently; that wins.
+			continue;
+		}
+		if (0 < res.cid.size())
+		{
+			if (st->resolved.end() != it) old = it->second.cid;
+			st->resolved[name] = res;
+			write_cache(*st, name, res);
+			st->num_resolves++;
+		}
+		else
+		{
+			st->errors[name] = err;
+			st->num_failures++;
+		}
+		st->done_cv.notify_all();
+
+		if (0 == res.cid.size() or res.cid == old or not st->callback)
+			continue;
+
+		Callback cb = st->callback;
+		st->in_callback = true;
+		lck.unlock();
+		try { cb(name, res.cid); }
+		catch (const std::exception& ex)
+		{
+			fprintf(stderr, "Failed to update to /ipns/%s: %s\n",
+			        name.c_str(), ex.what());
+		}
+		lck.lock();
+		st->in_callback = false;
+		st->idle_cv.notify_all();
+	}
+}
+
+/* ================================================================ */
+
+void IPFSResolver::clear_stats(void)
+{
+	_state->num_resolves = 0;
+	_state->num_failures = 0;
+	_state->num_hits = 0;
+	_state->num_waits = 0;
+	_state->num_calls = 0;
+	_state->call_usecs = 0;
+}
+
+void IPFSResolver::print_stats(void)
+{
+	size_t resolves = _state->num_resolves;
+	size_t failures = _state->num_failures;
+	size_t hits = _state->num_hits;
+	size_t waits = _state->num_waits;
+	printf("ipns: resolves=%zu failures=%zu known lookups=%zu "
+	       "waited lookups=%zu\n", resolves, failures, hits, waits);
+}
+
+void IPFSResolver::collect_metrics(IPFSMetrics& m)
+{
+	m.counter("atomspace_ipfs_ipns_resolves_total",
+	          "IPNS names resolved.", _state->num_resolves);
+	m.counter("atomspace_ipfs_ipns_failures_total",
+	          "IPNS names that failed to resolve.", _state->num_failures);
+	m.counter("atomspace_ipfs_ipns_known_lookups_total",
+	          "Lookups answered from a past resolution.", _state->num_hits);
+	m.counter("atomspace_ipfs_ipns_waited_lookups_total",
+	          "Lookups that waited for a resolution.", _state->num_waits);
+
+	// Name resolution is a call to the daemon, like any other.
+	IPFSMetrics::Labels lab = {{"rpc", "name_resolve"}};
+	m.counter("atomspace_ipfs_rpc_calls_total",
+	          "Calls made to the IPFS daemon.", _state->num_calls, lab);
+	m.counter("atomspace_ipfs_rpc_errors_total",
+	          "Calls to the IPFS daemon that failed.",
+	          _state->num_failures, lab);
+	m.counter("atomspace_ipfs_rpc_seconds_total",
+	          "Time spent in calls to the IPFS daemon.",
+	          1.0e-6 * _state->call_usecs, lab);
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,123 @@
+/*
+ * FILE:
+ * opencog/persist/ipfs/IPFSResolver.h
+
+ * FUNCTION:
+ * Background IPNS name resolution, with a local cache.
+ *
+ * HISTORY:
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_IPFS_RESOLVER_H
+#define _OPENCOG_IPFS_RESOLVER_H
+
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+#include "IPFSMetrics.h"
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// Resolves IPNS names in a background thread. IPNS resolution takes
+/// about a minute (see https://github.com/ipfs/go-ipfs/issues/3860)
+/// and so nobody should have to wait for it, if it can be avoided.
+///
+/// The last CID that each name resolved to is written to a file in
+/// the cache directory, together with the time of the resolution.
+/// A lookup returns the last known CID right away, if there is one,
+/// from this session or from the cache file, and queues up a fresh
+/// resolution in the background, if the known one is old. Only if
+/// nothing at all is known about a name does a lookup have to wait.
+///
+/// When a background resolution finds a CID that differs from the
+/// last known one, the callback is called, from the resolver thread.
+class IPFSResolver
+{
+	public:
+		typedef std::function<void(const std::string&, const std::string&)>
+			Callback;
+
+	private:
+		struct Resolution
+		{
+			std::string cid;
+			time_t when;
+			bool fresh;   // Resolved in this session
+			bool updated; // Published here, not from IPNS
+		};
+
+		// All of the state shared with the thread. The thread owns
+		// a reference to it, so that the thread can be let go, even
+		// while it is stuck in a slow resolution.
+		struct State
+		{
+			std::mutex mtx;
+			std::condition_variable work_cv;
+			std::condition_variable done_cv;
+			std::condition_variable idle_cv;
+			std::set<std::string> pending;
+			std::set<std::string> busy;
+			std::map<std::string, Resolution> resolved;
+			std::map<std::string, std::string> errors;
+			bool keep_going;
+			bool in_callback;
+			Callback callback;
+			std::string host;
+			int port;
+			std::string cache_dir;
+
+			std::atomic<size_t> num_resolves;
+			std::atomic<size_t> num_failures;
+			std::atomic<size_t> num_hits;
+			std::atomic<size_t> num_waits;
+			std::atomic<size_t> num_calls;
+			std::atomic<size_t> call_usecs;
+		};
+		std::shared_ptr<State> _state;
+		std::thread _thread;
+
+		static void run(std::shared_ptr<State>);
+		static std::string cache_file(const State&, const std::string&);
+		static void write_cache(const State&, const std::string&,
+		                        const Resolution&);
+		bool read_cache(const std::string&, Resolution&);
+		void queue(const std::string&, bool again = false);
+
+	public:
+		IPFSResolver(const std::string& host, int port,
+		             const std::string& cache_dir);
+		IPFSResolver(const IPFSResolver&) = delete;
+		IPFSResolver& operator=(const IPFSResolver&) = delete;
+		~IPFSResolver();
+
+		void on_resolve(const Callback&);
+		void refresh(const std::string&);
+		void update(const std::string&, const std::string&);
+		std::string lookup(const std::string&, bool wait);
+
+		void clear_stats(void);
+		void print_stats(void);
+		void collect_metrics(IPFSMetrics&);
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_IPFS_RESOLVER_H
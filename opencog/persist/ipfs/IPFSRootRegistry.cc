@@ -0,0 +1,91 @@
+/*
+ * IPFSRootRegistry.cc
+ * Registry of the committed root of each AtomSpace.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <opencog/util/exceptions.h>
+
+#include "IPFSRootRegistry.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+
+IPFSFileRegistry::IPFSFileRegistry(const std::string& dir) :
+	_dir(dir)
+{
+	if (0 == _dir.size())
+		throw IOException(TRACE_INFO, "No directory for the root registry\n");
+}
+
+std::string IPFSFileRegistry::path(const std::string& name)
+{
+	std::string fname = name;
+	for (char& c: fname) if ('/' == c) c = '_';
+	return _dir + "/" + fname;
+}
+
+/// The file is always replaced by a rename, and so it can be read
+/// without taking the lock.
+std::string IPFSFileRegistry::get(const std::string& name)
+{
+	FILE* fh = fopen(path(name).c_str(), "r");
+	if (nullptr == fh) return "";
+	char cid[256];
+	int n = fscanf(fh, "%255s", cid);
+	fclose(fh);
+	if (1 != n) return "";
+	return cid;
+}
+
+/// The lock is taken on a file of its own, as the root file itself
+/// is replaced on every swap.
+bool IPFSFileRegistry::compare_and_swap(const std::string& name,
+                                        const std::string& expected,
+                                        const std::string& desired,
+                                        std::string& current)
+{
+	std::string rpath = path(name);
+	std::string lpath = rpath + ".lock";
+	int fd = open(lpath.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		throw IOException(TRACE_INFO, "Unable to open %s\n", lpath.c_str());
+	if (flock(fd, LOCK_EX))
+	{
+		close(fd);
+		throw IOException(TRACE_INFO, "Unable to lock %s\n", lpath.c_str());
+	}
+
+	current = get(name);
+	bool swapped = false;
+	if (current == expected)
+	{
+		std::string tmp = rpath + ".tmp";
+		FILE* fh = fopen(tmp.c_str(), "w");
+		if (fh)
+		{
+			fprintf(fh, "%s\n", desired.c_str());
+			bool ok = (0 == fclose(fh));
+			swapped = ok and 0 == rename(tmp.c_str(), rpath.c_str());
+			if (not swapped) remove(tmp.c_str());
+		}
+		if (swapped) current = desired;
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	if (not swapped and current == expected)
+		throw IOException(TRACE_INFO, "Unable to write %s\n", rpath.c_str());
+	return swapped;
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,64 @@
+/*
+ * FILE:
+ * opencog/persist/ipfs/IPFSRootRegistry.h
+
+ * FUNCTION:
+ * Registry of the committed root of each AtomSpace.
+ *
+ * HISTORY:
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_IPFS_ROOT_REGISTRY_H
+#define _OPENCOG_IPFS_ROOT_REGISTRY_H
+
+#include <string>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// Holds the root CID that was last committed for each AtomSpace, by
+/// name. Writers commit with a compare-and-swap: the new root is taken
+/// only if the registered root is still the one that the writer last
+/// saw. Otherwise, the writer is handed the registered root, so that
+/// it can rebase onto it, and try again. An empty string stands for
+/// an AtomSpace that was never committed.
+class IPFSRootRegistry
+{
+	public:
+		virtual ~IPFSRootRegistry() {}
+		virtual std::string get(const std::string& name) = 0;
+		virtual bool compare_and_swap(const std::string& name,
+		                              const std::string& expected,
+		                              const std::string& desired,
+		                              std::string& current) = 0;
+};
+
+/// A registry kept in files, one per AtomSpace, in a directory. The
+/// swap is done under an exclusive `flock()`, and so it is safe for
+/// all of the processes and threads on one host, and for hosts that
+/// share the directory over a file system that supports `flock()`.
+class IPFSFileRegistry : public IPFSRootRegistry
+{
+	private:
+		std::string _dir;
+		std::string path(const std::string&);
+
+	public:
+		IPFSFileRegistry(const std::string& dir);
+
+		std::string get(const std::string&);
+		bool compare_and_swap(const std::string&, const std::string&,
+		                      const std::string&, std::string&);
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_IPFS_ROOT_REGISTRY_H
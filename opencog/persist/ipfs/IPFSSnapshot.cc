@@ -0,0 +1,484 @@
+/*
+ * IPFSSnapshot.cc
+ * Packed, columnar snapshots of entire AtomSpaces.
+ *
+ * Loading an AtomSpace from the root directory requires one DagGet
+ * per Atom, followed by decoding each Atom from json, one at a time.
+ * A snapshot instead packs the entire AtomSpace into a handful of
+ * large files: one file of names per Node type, one flat table of
+ * integers for all of the Links, and columnar tables for the Values.
+ * Loading a snapshot is then a few large sequential reads, followed
+ * by a tight decode loop.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <stdlib.h>
+#include <time.h>
+
+#include <map>
+#include <sstream>
+#include <unordered_map>
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/atom_types/NameServer.h>
+#include <opencog/atoms/base/Link.h>
+#include <opencog/atoms/base/Node.h>
+#include <opencog/atoms/truthvalue/SimpleTruthValue.h>
+#include <opencog/atoms/truthvalue/TruthValue.h>
+#include <opencog/atomspace/AtomSpace.h>
+
+#include "IPFSAtomStorage.h"
+
+using namespace opencog;
+
+// Format version written into the snapshot manifest.
+#define SNAPSHOT_VERSION 1
+
+/* ================================================================ */
+
+/// Add a blob of text to IPFS, as a file. Return the CID of the file.
+/// IPFS will chunk large files on its own, so there is no size limit.
+std::string IPFSAtomStorage::put_file(const std::string& text)
+{
+	ipfs::Json result;
+	IPFSConnPool::ConnGuard conn(conn_pool);
+	_rpc_stats.timed(IPFSRpcStats::FILES_ADD, [&]{
+		conn->FilesAdd({{"snapshot",
+			ipfs::http::FileUpload::Type::kFileContents,
+			text}}, &result); });
+
+	return result[0]["hash"];
+}
+
+/// Get the contents of a file previously added with `put_file()`.
+std::string IPFSAtomStorage::get_file(const std::string& cid)
+{
+	std::stringstream contents;
+	IPFSConnPool::ConnGuard conn(conn_pool);
+	_rpc_stats.timed(IPFSRpcStats::FILES_GET,
+		[&]{ conn->FilesGet(cid, &contents); });
+
+	return contents.str();
+}
+
+/* ================================================================ */
+
+/// Place the atoms into a linear order, such that the Nodes come
+/// first, grouped by type, followed by the Links. Links are placed
+/// after all of the atoms in their outgoing set, so that the Links
+/// can be created by walking the order, front to back. Atoms in the
+/// outgoing sets are pulled in, even if they were not in the list.
+/// Returns the number of Nodes; these are at the start of `order`.
+size_t IPFSAtomStorage::flatten_atoms(const HandleSeq& atoms,
+                                      HandleSeq& order)
+{
+	std::map<Type, HandleSeq> nodes_by_type;
+	HandleSeq links;
+	std::unordered_map<Handle, bool> seen;
+
+	// Post-order walk of the outgoing sets.
+	std::function<void(const Handle&)> walk = [&](const Handle& h)
+	{
+		if (seen.end() != seen.find(h)) return;
+		seen[h] = true;
+
+		if (h->is_node())
+		{
+			nodes_by_type[h->get_type()].push_back(h);
+			return;
+		}
+		for (const Handle& ho: h->getOutgoingSet())
+			walk(ho);
+		links.push_back(h);
+	};
+
+	for (const Handle& h: atoms)
+		walk(h);
+
+	order.clear();
+	order.reserve(seen.size());
+	for (const auto& [t, nodes]: nodes_by_type)
+		order.insert(order.end(), nodes.begin(), nodes.end());
+
+	size_t num_nodes = order.size();
+	order.insert(order.end(), links.begin(), links.end());
+	return num_nodes;
+}
+
+/* ================================================================ */
+
+/// Write a packed snapshot of all of the atoms in the atom table,
+/// and all of the values on them. Returns the CID of the snapshot.
+///
+/// The snapshot is a single IPLD object (the manifest) that points
+/// at a handful of files:
+///  * One file per Node type, holding a json array of Node names.
+///  * A single flat array of integers holding all of the Links.
+///    Each Link is written as the type index, the arity, and then
+///    the indexes of the atoms in the outgoing set. Nodes are
+///    numbered first, in the order of the name files, followed by
+///    the Links, in the order of the table.
+///  * A json array of keys, as scheme strings.
+///  * Columnar tables for the SimpleTruthValues and for the
+///    FloatValues, and a table of all other values, as scheme strings.
+///
+/// The manifest also records the CID of the current AtomSpace, so
+/// that the snapshot can be matched to the live root.
+std::string IPFSAtomStorage::snapshot_atomspace(const AtomTable& table)
+{
+	rethrow();
+
+	logger().info("Snapshot of AtomSpace\n");
+	bulk_start = time(0);
+
+	HandleSeq atoms;
+	table.foreachHandleByType(
+		[&](const Handle& h)->void { atoms.push_back(h); },
+		ATOM, true);
+
+	HandleSeq order;
+	size_t num_nodes = flatten_atoms(atoms, order);
+
+	std::unordered_map<Handle, size_t> index;
+	index.reserve(order.size());
+	for (size_t i=0; i<order.size(); i++)
+		index[order[i]] = i;
+
+	// Type names, in order of first use.
+	std::map<Type, size_t> type_index;
+	ipfs::Json jtypes = ipfs::Json::array();
+	auto get_type_index = [&](Type t)->size_t
+	{
+		auto ti = type_index.find(t);
+		if (type_index.end() != ti) return ti->second;
+		size_t idx = jtypes.size();
+		jtypes.push_back(nameserver().getTypeName(t));
+		type_index[t] = idx;
+		return idx;
+	};
+
+	ipfs::Json manifest;
+	manifest["snapshot"] = SNAPSHOT_VERSION;
+	manifest["root"] = *pin_root();
+
+	// One name file per Node type.
+	ipfs::Json jnodes = ipfs::Json::array();
+	size_t i = 0;
+	while (i < num_nodes)
+	{
+		Type t = order[i]->get_type();
+		ipfs::Json names = ipfs::Json::array();
+		while (i < num_nodes and order[i]->get_type() == t)
+		{
+			names.push_back(order[i]->get_name());
+			i++;
+		}
+		ipfs::Json jblock;
+		jblock["type"] = get_type_index(t);
+		jblock["count"] = names.size();
+		jblock["names"] = put_file(names.dump());
+		jnodes.push_back(jblock);
+	}
+	manifest["nodes"] = jnodes;
+
+	// All of the links, in one flat table.
+	std::vector<size_t> ltable;
+	for (i = num_nodes; i < order.size(); i++)
+	{
+		const Handle& h = order[i];
+		ltable.push_back(get_type_index(h->get_type()));
+		ltable.push_back(h->get_arity());
+		for (const Handle& ho: h->getOutgoingSet())
+			ltable.push_back(index[ho]);
+	}
+	manifest["links"] = {
+		{"count", order.size() - num_nodes},
+		{"table", put_file(ipfs::Json(ltable).dump())}};
+	manifest["types"] = jtypes;
+
+	// Values, in columnar form.
+	std::map<Handle, size_t> key_index;
+	ipfs::Json jkeys = ipfs::Json::array();
+	std::vector<size_t> tv_atom;
+	std::vector<double> tv_strength;
+	std::vector<double> tv_confidence;
+	std::vector<size_t> fv_atom, fv_key, fv_length;
+	std::vector<double> fv_data;
+	std::vector<size_t> sv_atom, sv_key;
+	std::vector<std::string> sv_value;
+
+	for (i = 0; i < order.size(); i++)
+	{
+		const Handle& h = order[i];
+		for (const Handle& key: h->getKeys())
+		{
+			ValuePtr pap = h->getValue(key);
+			if (key == tvpred)
+			{
+				TruthValuePtr tv(TruthValueCast(pap));
+				if (tv->isDefaultTV()) continue;
+				if (SIMPLE_TRUTH_VALUE == tv->get_type())
+				{
+					tv_atom.push_back(i);
+					tv_strength.push_back(tv->get_mean());
+					tv_confidence.push_back(tv->get_confidence());
+					continue;
+				}
+			}
+
+			size_t kidx;
+			auto ki = key_index.find(key);
+			if (key_index.end() != ki) kidx = ki->second;
+			else
+			{
+				kidx = jkeys.size();
+				jkeys.push_back(encodeAtomToStr(key));
+				key_index[key] = kidx;
+			}
+
+			if (FLOAT_VALUE == pap->get_type())
+			{
+				const std::vector<double>& fv =
+					FloatValueCast(pap)->value();
+				fv_atom.push_back(i);
+				fv_key.push_back(kidx);
+				fv_length.push_back(fv.size());
+				fv_data.insert(fv_data.end(), fv.begin(), fv.end());
+				continue;
+			}
+
+			sv_atom.push_back(i);
+			sv_key.push_back(kidx);
+			sv_value.push_back(encodeValueToStr(pap));
+		}
+	}
+
+	manifest["keys"] = put_file(jkeys.dump());
+
+	ipfs::Json jtvs;
+	jtvs["atom"] = tv_atom;
+	jtvs["strength"] = tv_strength;
+	jtvs["confidence"] = tv_confidence;
+	manifest["tvs"] = {
+		{"count", tv_atom.size()},
+		{"table", put_file(jtvs.dump())}};
+
+	ipfs::Json jfvs;
+	jfvs["atom"] = fv_atom;
+	jfvs["key"] = fv_key;
+	jfvs["length"] = fv_length;
+	jfvs["data"] = fv_data;
+	manifest["floats"] = {
+		{"count", fv_atom.size()},
+		{"table", put_file(jfvs.dump())}};
+
+	ipfs::Json jsvs;
+	jsvs["atom"] = sv_atom;
+	jsvs["key"] = sv_key;
+	jsvs["value"] = sv_value;
+	manifest["values"] = {
+		{"count", sv_atom.size()},
+		{"table", put_file(jsvs.dump())}};
+
+	ipfs::Json result;
+	{
+		IPFSConnPool::ConnGuard conn(conn_pool);
+		_rpc_stats.timed(IPFSRpcStats::DAG_PUT,
+			[&]{ conn->DagPut(manifest, &result); });
+	}
+
+	std::string snap_cid = result["Cid"]["/"];
+
+	time_t secs = time(0) - bulk_start;
+	printf("\tFinished snapshot of %zu atoms in %d seconds\n",
+		order.size(), (int) secs);
+	printf("\tSnapshot CID: %s\n", snap_cid.c_str());
+	return snap_cid;
+}
+
+/* ================================================================ */
+
+/// Load a snapshot previously written with `snapshot_atomspace()`.
+/// The path may be a bare CID, or a path of the form /ipfs/CID.
+/// The key filter set with `set_value_keys()` is honored. Snapshots
+/// come over the network; every index in them is checked, and a
+/// damaged snapshot throws an IOException.
+void IPFSAtomStorage::load_snapshot(AtomTable& table,
+                                    const std::string& path)
+{
+	rethrow();
+
+	std::string cid = path_to_cid(path);
+
+	printf("Loading snapshot from %s\n", cid.c_str());
+	bulk_load = true;
+	bulk_start = time(0);
+
+	HandleSeq atoms;
+	try
+	{
+		load_snapshot_atoms(table, cid, atoms);
+	}
+	catch (...)
+	{
+		bulk_load = false;
+		throw;
+	}
+
+	_load_count += atoms.size();
+
+	time_t secs = time(0) - bulk_start;
+	printf("Finished loading snapshot of %zu atoms in %d seconds\n",
+		atoms.size(), (int) secs);
+	bulk_load = false;
+}
+
+/// Decode the snapshot with the given CID into the table. The atoms
+/// are returned in snapshot order.
+void IPFSAtomStorage::load_snapshot_atoms(AtomTable& table,
+                                          const std::string& cid,
+                                          HandleSeq& atoms)
+{
+	ipfs::Json manifest;
+	{
+		IPFSConnPool::ConnGuard conn(conn_pool);
+		_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+			[&]{ conn->DagGet(cid, &manifest); });
+	}
+
+	if (manifest.end() == manifest.find("snapshot") or
+	    SNAPSHOT_VERSION != manifest["snapshot"].get<int>())
+		throw RuntimeException(TRACE_INFO,
+			"Not an AtomSpace snapshot: %s\n", cid.c_str());
+
+	std::vector<Type> types;
+	for (const std::string& tname: manifest["types"])
+	{
+		Type t = nameserver().getType(tname);
+		if (NOTYPE == t)
+			throw IOException(TRACE_INFO,
+				"Unknown type in AtomSpace snapshot: %s", tname.c_str());
+		types.push_back(t);
+	}
+
+	size_t num_atoms = manifest["links"]["count"];
+	for (const auto& jblock: manifest["nodes"])
+		num_atoms += jblock["count"].get<size_t>();
+
+	atoms.reserve(num_atoms);
+
+	// The Nodes. One large read per type.
+	for (const auto& jblock: manifest["nodes"])
+	{
+		size_t ti = jblock["type"];
+		if (types.size() <= ti)
+			throw IOException(TRACE_INFO, "Bad type in AtomSpace snapshot");
+		Type t = types[ti];
+		ipfs::Json names = ipfs::Json::parse(get_file(jblock["names"]));
+		for (const std::string& name: names)
+			atoms.push_back(table.add(createNode(t, name), false));
+		_num_got_nodes += names.size();
+	}
+
+	// The Links. These are ordered so that the outgoing set always
+	// refers to atoms that have already been created.
+	std::vector<size_t> ltable =
+		ipfs::Json::parse(get_file(manifest["links"]["table"]));
+	size_t i = 0;
+	while (i < ltable.size())
+	{
+		if (ltable.size() < i + 2 or types.size() <= ltable[i])
+			throw IOException(TRACE_INFO, "Bad link in AtomSpace snapshot");
+		Type t = types[ltable[i++]];
+		size_t arity = ltable[i++];
+		if (ltable.size() - i < arity)
+			throw IOException(TRACE_INFO, "Bad link in AtomSpace snapshot");
+		HandleSeq oset;
+		oset.reserve(arity);
+		for (size_t j=0; j<arity; j++)
+		{
+			size_t idx = ltable[i++];
+			if (atoms.size() <= idx)
+				throw IOException(TRACE_INFO, "Bad link in AtomSpace snapshot");
+			oset.push_back(atoms[idx]);
+		}
+		atoms.push_back(table.add(createLink(oset, t), false));
+		_num_got_links++;
+	}
+
+	// The keys. Unwanted keys are left as null handles.
+	ipfs::Json jkeys = ipfs::Json::parse(get_file(manifest["keys"]));
+	HandleSeq keys;
+	for (const std::string& skey: jkeys)
+		keys.push_back(decodeWantedKey(skey));
+
+	if (nullptr != decodeWantedKey(encodeAtomToStr(tvpred)))
+	{
+		ipfs::Json jtvs =
+			ipfs::Json::parse(get_file(manifest["tvs"]["table"]));
+		std::vector<size_t> tv_atom = jtvs["atom"];
+		std::vector<double> tv_strength = jtvs["strength"];
+		std::vector<double> tv_confidence = jtvs["confidence"];
+		if (tv_strength.size() < tv_atom.size() or
+		    tv_confidence.size() < tv_atom.size())
+			throw IOException(TRACE_INFO, "Bad TV in AtomSpace snapshot");
+		for (i = 0; i < tv_atom.size(); i++)
+		{
+			if (atoms.size() <= tv_atom[i])
+				throw IOException(TRACE_INFO, "Bad TV in AtomSpace snapshot");
+			atoms[tv_atom[i]]->setTruthValue(
+				createSimpleTruthValue(tv_strength[i], tv_confidence[i]));
+		}
+	}
+
+	if (0 < manifest["floats"]["count"].get<size_t>())
+	{
+		ipfs::Json jfvs =
+			ipfs::Json::parse(get_file(manifest["floats"]["table"]));
+		std::vector<size_t> fv_atom = jfvs["atom"];
+		std::vector<size_t> fv_key = jfvs["key"];
+		std::vector<size_t> fv_length = jfvs["length"];
+		std::vector<double> fv_data = jfvs["data"];
+		if (fv_key.size() < fv_atom.size() or
+		    fv_length.size() < fv_atom.size())
+			throw IOException(TRACE_INFO, "Bad value in AtomSpace snapshot");
+		size_t off = 0;
+		for (i = 0; i < fv_atom.size(); i++)
+		{
+			size_t len = fv_length[i];
+			if (atoms.size() <= fv_atom[i] or keys.size() <= fv_key[i] or
+			    fv_data.size() - off < len)
+				throw IOException(TRACE_INFO, "Bad value in AtomSpace snapshot");
+			const Handle& key = keys[fv_key[i]];
+			if (key)
+				atoms[fv_atom[i]]->setValue(key, createFloatValue(
+					std::vector<double>(fv_data.begin() + off,
+					                    fv_data.begin() + off + len)));
+			off += len;
+		}
+	}
+
+	if (0 < manifest["values"]["count"].get<size_t>())
+	{
+		ipfs::Json jsvs =
+			ipfs::Json::parse(get_file(manifest["values"]["table"]));
+		std::vector<size_t> sv_atom = jsvs["atom"];
+		std::vector<size_t> sv_key = jsvs["key"];
+		std::vector<std::string> sv_value = jsvs["value"];
+		if (sv_key.size() < sv_atom.size() or
+		    sv_value.size() < sv_atom.size())
+			throw IOException(TRACE_INFO, "Bad value in AtomSpace snapshot");
+		for (i = 0; i < sv_atom.size(); i++)
+		{
+			if (atoms.size() <= sv_atom[i] or keys.size() <= sv_key[i])
+				throw IOException(TRACE_INFO, "Bad value in AtomSpace snapshot");
+			const Handle& key = keys[sv_key[i]];
+			if (key)
+				atoms[sv_atom[i]]->setValue(key,
+					decodeStrValue(sv_value[i]));
+		}
+	}
+}
+
+/* ============================= END OF FILE ================= */
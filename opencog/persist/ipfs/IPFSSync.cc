@@ -0,0 +1,123 @@
+/*
+ * IPFSSync.cc
+ * Incremental update of an AtomSpace from one root CID to another.
+ *
+ * Every AtomSpace root is a directory listing, holding one entry per
+ * Atom. The entry name is the Atom (as a scheme string) and the entry
+ * CID is the CID of the Atom, with its values and incoming set. Thus,
+ * two roots can be compared entry-by-entry: any entry whose CID is the
+ * same in both roots is unchanged, and does not need to be fetched.
+ *
+ * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+#include <stdlib.h>
+#include <time.h>
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atomspace/AtomSpace.h>
+
+#include "IPFSAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+
+/// Strip off the leading /ipfs/, if any.
+std::string IPFSAtomStorage::path_to_cid(const std::string& path)
+{
+	if (0 == path.find("/ipfs/"))
+		return path.substr(sizeof("/ipfs/") - 1);
+	return path;
+}
+
+/// Get all of the directory entries in the AtomSpace root at `cid`.
+/// The entries map the Atom label (its scheme string) to the CID of
+/// the Atom-with-values.
+void IPFSAtomStorage::get_root_entries(const std::string& cid,
+                                       RootEntries& entries)
+{
+	ipfs::Json dag;
+	{
+		IPFSConnPool::ConnGuard conn(conn_pool);
+		_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+			[&]{ conn->DagGet(path_to_cid(cid), &dag); });
+	}
+
+	for (const auto& acid: dag["links"])
+		entries[acid["Name"]] = acid["Cid"]["/"];
+}
+
+/* ================================================================ */
+
+/// Bring the AtomSpace `as` from the root `from_cid` to the root
+/// `to_cid`, by fetching only those Atoms that were added, or whose
+/// values or incoming set changed. The Atoms that are in `from_cid`
+/// but are no longer in `to_cid` are returned; they are NOT removed
+/// from the AtomSpace, as the caller may wish to keep them.
+///
+/// The cost of this is the cost of listing both roots, plus one fetch
+/// per changed Atom; unchanged Atoms are never fetched. The roots are
+/// currently flat directories, and so both listings are fetched in
+/// full; with a sharded root, unchanged shards could be skipped in the
+/// same way as unchanged entries are skipped here.
+HandleSeq IPFSAtomStorage::sync_atomspace(AtomSpace* as,
+                                          const std::string& from_cid,
+                                          const std::string& to_cid)
+{
+	rethrow();
+
+	RootEntries from_entries;
+	RootEntries to_entries;
+	get_root_entries(from_cid, from_entries);
+	get_root_entries(to_cid, to_entries);
+
+	time_t start = time(0);
+	size_t num_fetched = 0;
+	HandleSeq removed;
+
+	// Both maps are sorted by name, so walk them side by side.
+	auto fit = from_entries.begin();
+	auto tit = to_entries.begin();
+	while (fit != from_entries.end() or tit != to_entries.end())
+	{
+		// In the old root, but not in the new one.
+		if (tit == to_entries.end() or
+		    (fit != from_entries.end() and fit->first < tit->first))
+		{
+			Handle h(decodeStrAtom(fit->first));
+			Handle ha(as->get_atom(h));
+			removed.push_back(ha ? ha : h);
+			fit++;
+			continue;
+		}
+
+		// In both, but changed, or new.
+		if (fit == from_entries.end() or tit->first < fit->first or
+		    fit->second != tit->second)
+		{
+			// Atoms with stores still queued keep their local values;
+			// these are newer.
+			Handle h(fetch_atom(tit->second));
+			if (nullptr == get_pending_write(h)) as->add_atom(h);
+			_load_count++;
+			num_fetched++;
+		}
+
+		if (fit != from_entries.end() and fit->first == tit->first)
+			fit++;
+		tit++;
+	}
+
+	_num_syncs++;
+	_num_sync_fetches += num_fetched;
+
+	printf("Synced %zu changed atoms (%zu removed, %zu unchanged) "
+	       "in %d seconds\n", num_fetched, removed.size(),
+	       to_entries.size() - num_fetched, (int) (time(0) - start));
+
+	as->barrier();
+	return removed;
+}
+
+/* ============================= END OF FILE ================= */
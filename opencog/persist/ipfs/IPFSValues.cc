@@ -5,6 +5,8 @@
  * Copyright (c) 2008,2009,2013,2017,2019 Linas Vepstas <linas@linas.org>
  * SPDX-License-Identifier: AGPL-3.0-or-later
  */
+#include <cmath>
+
 #include <opencog/atoms/base/Atom.h>
 #include <opencog/atoms/value/FloatValue.h>
 #include <opencog/atoms/value/LinkValue.h>
@@ -20,7 +22,10 @@ using namespace opencog;
 /* ================================================================== */
 
 /// Get ALL of the values on the Atom, and return the corresponding
-/// JSON representation for them.
+/// JSON representation for them. The json object keeps its keys in
+/// sorted order, so the result does not depend on the order in which
+/// the values were set. SimpleTruthValues are not included; they are
+/// encoded by `encodeTVToJSON()`.
 ipfs::Json IPFSAtomStorage::encodeValuesToJSON(const Handle& atom)
 {
 	// Build some json that encodes the key-value pairs
@@ -34,13 +39,92 @@ ipfs::Json IPFSAtomStorage::encodeValuesToJSON(const Handle& atom)
 		{
 			TruthValuePtr tv(atom->getTruthValue());
 			if (tv->isDefaultTV()) continue;
+			if (not encodeTVToJSON(atom).is_null()) continue;
 		}
 		ValuePtr pap = atom->getValue(key);
-		jvals[encodeAtomToStr(key)] = encodeValueToStr(pap);
+		jvals[encodeAtomToStr(key)] = encodeValueToJSON(pap);
 	}
 	return jvals;
 }
 
+/// TruthValues are by far the most common Values, and so the
+/// SimpleTruthValue gets a compact encoding of its own: the strength
+/// and confidence are stored directly in the atom, as a two-element
+/// array of doubles, under "tv". This avoids printing and parsing an
+/// s-expression for each one. Returns null if there is no such TV.
+/// JSON cannot hold NaN or infinity; TVs holding these are left for
+/// `encodeValuesToJSON()` to encode as strings.
+ipfs::Json IPFSAtomStorage::encodeTVToJSON(const Handle& atom)
+{
+	TruthValuePtr tv(atom->getTruthValue());
+	if (tv->isDefaultTV()) return ipfs::Json();
+	if (SIMPLE_TRUTH_VALUE != tv->get_type()) return ipfs::Json();
+	if (not std::isfinite(tv->get_mean()) or
+	    not std::isfinite(tv->get_confidence())) return ipfs::Json();
+	return ipfs::Json::array({tv->get_mean(), tv->get_confidence()});
+}
+
+/// Maximum number of entries in the value block caches. They are
+/// simply emptied when they get this big.
+#define VALUE_BLOCK_CACHE_SIZE 100000
+
+/// Return the JSON for a single value. Usually, this is just the
+/// string encoding of the value. If value blocks are enabled, and the
+/// encoding is long enough, then the value is stored in a block of
+/// its own, and an IPLD link to that block is returned instead. The
+/// block for a value is stored only once, no matter how many Atoms
+/// hold that value.
+ipfs::Json IPFSAtomStorage::encodeValueToJSON(const ValuePtr& v)
+{
+	std::string sval = encodeValueToStr(v);
+	size_t block_size = _value_block_size;
+	if (0 == block_size or sval.size() < block_size)
+		return sval;
+
+	std::string vcid;
+	{
+		std::lock_guard<std::mutex> lck(_value_block_mutex);
+		auto pvc = _value_cid_map.find(sval);
+		if (_value_cid_map.end() != pvc) vcid = pvc->second;
+	}
+
+	if (0 < vcid.size())
+		_num_value_block_reuses++;
+	else
+	{
+		ipfs::Json jblock;
+		jblock["value"] = sval;
+
+		ipfs::Json result;
+		{
+			IPFSConnPool::ConnGuard conn(conn_pool);
+			_rpc_stats.timed(IPFSRpcStats::DAG_PUT,
+				[&]{ conn->DagPut(jblock, &result); });
+		}
+		_num_value_blocks++;
+
+		vcid = result["Cid"]["/"];
+		std::lock_guard<std::mutex> lck(_value_block_mutex);
+		if (VALUE_BLOCK_CACHE_SIZE <= _value_cid_map.size())
+			_value_cid_map.clear();
+		_value_cid_map.insert({sval, vcid});
+	}
+
+	ipfs::Json jlink;
+	jlink["/"] = vcid;
+	return jlink;
+}
+
+/// Store Values whose string encoding is at least `size` bytes long
+/// in blocks of their own. Atoms holding identical Values will then
+/// all link to the same block. A size of zero turns this off; Values
+/// are then stored inline, in the Atom. This affects only stores;
+/// both forms are always understood when loading.
+void IPFSAtomStorage::set_value_block_size(size_t size)
+{
+	_value_block_size = size;
+}
+
 /* ================================================================== */
 
 /// Store ALL of the values associated with the atom.
@@ -51,54 +135,87 @@ void IPFSAtomStorage::store_atom_values(const Handle& atom)
 
 	bool have_values = false;
 
-	// Atomic update of cached json
+	// Encode outside of the lock; this may need to store value blocks.
+	ipfs::Json jvals = encodeValuesToJSON(atom);
+	ipfs::Json jtv = encodeTVToJSON(atom);
+
+	// Atomic update of cached json. If a rebase replaces the cached
+	// json before the root is patched, do it over.
 	ipfs::Json jatom;
+	std::string atoid;
+	size_t gen;
+	do
 	{
-		std::lock_guard<std::mutex> lck(_json_mutex);
-		const auto& pj = _json_map.find(atom);
-		if (_json_map.end() == pj)
-			jatom = get_atom_json(atom);
-		else
-			jatom = pj->second;
-
-		ipfs::Json jvals = encodeValuesToJSON(atom);
-		if (0 < jvals.size())
 		{
-			have_values = true;
+			std::lock_guard<std::mutex> lck(_json_mutex);
+			gen = _json_gen;
+			const auto& pj = _json_map.find(atom);
+			if (_json_map.end() == pj)
+				jatom = get_atom_json(atom);
+			else
+				jatom = pj->second;
 
-			// If there aren't pre-existing values, then just
-			// publish the new ones. Else patch them into place.
-			auto pvals = jatom.find("values");
-			if (jatom.end() == pvals)
+			if (not jtv.is_null())
 			{
-				jatom["values"] = jvals;
+				have_values = true;
+				jatom["tv"] = jtv;
+
+				// Remove the TV from the values, if it was stored there
+				// by older versions of this code.
+				auto pvals = jatom.find("values");
+				if (jatom.end() != pvals)
+				{
+					pvals->erase(_tvpred_str);
+					if (0 == pvals->size()) jatom.erase("values");
+				}
+				_json_map[atom] = jatom;
 			}
-			else
+
+			if (0 < jvals.size())
 			{
-				ipfs::Json new_vals = *pvals;
-				for (const auto& [jkey, jvalue]: jvals.items())
-					new_vals[jkey] = jvalue;
+				have_values = true;
+
+				// A TruthValue other than a SimpleTruthValue replaces
+				// any SimpleTruthValue stored earlier.
+				if (jvals.end() != jvals.find(_tvpred_str))
+					jatom.erase("tv");
+
+				// If there aren't pre-existing values, then just
+				// publish the new ones. Else patch them into place.
+				auto pvals = jatom.find("values");
+				if (jatom.end() == pvals)
+				{
+					jatom["values"] = jvals;
+				}
+				else
+				{
+					ipfs::Json new_vals = *pvals;
+					for (const auto& [jkey, jvalue]: jvals.items())
+						new_vals[jkey] = jvalue;
 
-				jatom["values"] = new_vals;
+					jatom["values"] = new_vals;
+				}
+				_json_map[atom] = jatom;
 			}
-			_json_map[atom] = jatom;
 		}
-	}
 
-	if (not have_values) return;
+		if (not have_values) return;
 
-	// Store the thing in IPFS
-	ipfs::Json result;
-	ipfs::Client* conn = conn_pool.pop();
-	conn->DagPut(jatom, &result);
-	conn_pool.push(conn);
+		// Store the thing in IPFS
+		ipfs::Json result;
+		{
+			IPFSConnPool::ConnGuard conn(conn_pool);
+			_rpc_stats.timed(IPFSRpcStats::DAG_PUT,
+				[&]{ conn->DagPut(jatom, &result); });
+		}
 
-	std::string atoid = result["Cid"]["/"];
-	// std::cout << "Valued Atom: " << encodeAtomToStr(atom)
-	//          << " CID: " << atoid << std::endl;
+		atoid = result["Cid"]["/"];
+		// std::cout << "Valued Atom: " << encodeAtomToStr(atom)
+		//          << " CID: " << atoid << std::endl;
 
-   // Update the atomspace, so that it holds the new value.
-   update_atom_in_atomspace(atom, atoid);
+		// Update the atomspace, so that it holds the new value.
+	}
+	while (not update_atom_in_atomspace(atom, atoid, gen));
 
 	// The code below is ifdefed out. In a better world, we would
 	// publish just the IPNS name of where to find the atom values,
@@ -111,12 +228,14 @@ void IPFSAtomStorage::store_atom_values(const Handle& atom)
 	// XXX TODO this can be speeded up by caching the keys in C++
 	std::string atonam = _keyname + encodeAtomToStr(atom);
 	std::string atokey;
-	conn = conn_pool.pop();
-	conn->KeyFind(atonam, &atokey);
+	ipfs::Client* conn = conn_pool.pop();
+	_rpc_stats.timed(IPFSRpcStats::KEY,
+		[&]{ conn->KeyFind(atonam, &atokey); });
 	if (0 == atokey.size())
 	{
 		// Not found; make a new one, by default.
-		conn->KeyNew(atonam, &atokey);
+		_rpc_stats.timed(IPFSRpcStats::KEY,
+			[&]{ conn->KeyNew(atonam, &atokey); });
 		std::cout << "Generated Atom IPNS: " << atonam
 		          << " key: " << atokey << std::endl;
 	}
@@ -131,7 +250,8 @@ void IPFSAtomStorage::store_atom_values(const Handle& atom)
 	{
 		// The `ipns_name` should be identical to the `atokey` above.
 		std::string ipns_name;
-		conn->NamePublish(atoid, atonam, &ipns_name, "4h", "30s");
+		_rpc_stats.timed(IPFSRpcStats::NAME_PUBLISH,
+			[&]{ conn->NamePublish(atoid, atonam, &ipns_name, "4h", "30s"); });
 		std::cout << "Published Atom Values: " << ipns_name << std::endl;
 	}
 	catch (const std::exception& ex)
@@ -148,9 +268,147 @@ void IPFSAtomStorage::store_atom_values(const Handle& atom)
 }
 /* ================================================================== */
 
+/// Store just one value on the atom, the one on `key`. Only that one
+/// entry in the atom's values is changed; all of the other values on
+/// the atom are left as they were, and are not re-encoded. If the
+/// atom no longer has a value on that key, the stored one is removed.
+/// The store is synchronous.
+void IPFSAtomStorage::storeValue(const Handle& atom, const Handle& key)
+{
+	rethrow();
+
+	// No publication of Values, if there's no AtomSpace key.
+	if (0 == _keyname.size()) return;
+
+	if (guid_not_yet_stored(atom)) do_store_atom(atom);
+
+	std::string skey = encodeAtomToStr(key);
+	ipfs::Json jtv;
+	ipfs::Json jval;
+	if (key == tvpred)
+	{
+		TruthValuePtr tv(atom->getTruthValue());
+		jtv = encodeTVToJSON(atom);
+		if (jtv.is_null() and not tv->isDefaultTV())
+			jval = encodeValueToJSON(ValueCast(tv));
+	}
+	else
+	{
+		ValuePtr pap = atom->getValue(key);
+		if (pap) jval = encodeValueToJSON(pap);
+	}
+
+	// Atomic update of cached json. If a rebase replaces the cached
+	// json before the root is patched, do it over.
+	ipfs::Json jatom;
+	std::string atoid;
+	size_t gen;
+	do
+	{
+		{
+			std::lock_guard<std::mutex> lck(_json_mutex);
+			gen = _json_gen;
+			const auto& pj = _json_map.find(atom);
+			if (_json_map.end() == pj)
+				jatom = get_atom_json(atom);
+			else
+				jatom = pj->second;
+
+			if (key == tvpred)
+			{
+				if (jtv.is_null())
+					jatom.erase("tv");
+				else
+					jatom["tv"] = jtv;
+			}
+
+			if (not jval.is_null())
+				jatom["values"][skey] = jval;
+			else
+			{
+				auto pvals = jatom.find("values");
+				if (jatom.end() != pvals)
+				{
+					pvals->erase(skey);
+					if (0 == pvals->size()) jatom.erase("values");
+				}
+			}
+			_json_map[atom] = jatom;
+		}
+
+		ipfs::Json result;
+		{
+			IPFSConnPool::ConnGuard conn(conn_pool);
+			_rpc_stats.timed(IPFSRpcStats::DAG_PUT,
+				[&]{ conn->DagPut(jatom, &result); });
+		}
+
+		atoid = result["Cid"]["/"];
+	}
+	while (not update_atom_in_atomspace(atom, atoid, gen));
+	_valuation_stores++;
+}
+
+/// Fetch just one value on the atom, the one on `key`, and set it on
+/// the atom. Only that one value is fetched; the rest of the atom is
+/// not. If there is no such value stored, the atom is not changed.
+/// The key filter is not applied; the key was asked for explicitly.
+void IPFSAtomStorage::loadValue(const Handle& atom, const Handle& key)
+{
+	rethrow();
+
+	// Pin the root, so that both lookups below see the same one.
+	std::string path = *pin_root() + "/" + encodeAtomToStr(atom);
+
+	// IPLD path resolution follows links, so if the value was stored
+	// in a value block, then it is the block that is returned.
+	auto dag_get = [&](const std::string& subpath, ipfs::Json& jval)
+	{
+		IPFSConnPool::ConnGuard conn(conn_pool);
+		try
+		{
+			_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+				[&]{ conn->DagGet(path + subpath, &jval); });
+		}
+		catch (const std::exception& ex)
+		{
+			// No such value; not an error.
+		}
+		return not jval.is_null();
+	};
+
+	ipfs::Json jval;
+	if (key == tvpred and dag_get("/tv", jval))
+	{
+		atom->setTruthValue(createSimpleTruthValue(
+			jval[0].get<double>(), jval[1].get<double>()));
+		_load_count++;
+		return;
+	}
+
+	if (not dag_get("/values/" + encodeAtomToStr(key), jval)) return;
+
+	if (jval.is_object())
+		atom->setValue(key, decodeStrValue(jval["value"]));
+	else
+		atom->setValue(key, decodeStrValue(jval));
+	_load_count++;
+}
+
+/* ================================================================== */
+
 /// Get ALL of the values associated with an atom.
 void IPFSAtomStorage::get_atom_values(Handle& atom, const ipfs::Json& jatom)
 {
+	// The fast path for SimpleTruthValues: just two doubles.
+	auto ptv = jatom.find("tv");
+	if (jatom.end() != ptv and want_tv())
+	{
+		const ipfs::Json& jtv = *ptv;
+		atom->setTruthValue(createSimpleTruthValue(
+			jtv[0].get<double>(), jtv[1].get<double>()));
+	}
+
 	// If no values, then nothing to do.
 	auto pvals = jatom.find("values");
 	if (pvals == jatom.end()) return;
@@ -161,10 +419,132 @@ void IPFSAtomStorage::get_atom_values(Handle& atom, const ipfs::Json& jatom)
 	for (const auto& [jkey, jvalue]: jvals.items())
 	{
 		// std::cout << "KV Pair: " << jkey << " "<<jvalue<< std::endl;
-		atom->setValue(decodeStrAtom(jkey), decodeStrValue(jvalue));
+		Handle key(decodeWantedKey(jkey));
+		if (nullptr == key) continue;
+		atom->setValue(key, decodeJSONValue(jvalue));
 	}
 }
 
+/// Decode the JSON for a single value. This is either the string
+/// encoding of the value, or a link to a value block. Value blocks
+/// are immutable, so the decoded value is cached, and each block is
+/// fetched and decoded only once.
+ValuePtr IPFSAtomStorage::decodeJSONValue(const ipfs::Json& jvalue)
+{
+	if (jvalue.is_string())
+		return decodeStrValue(jvalue);
+
+	const std::string& vcid = jvalue["/"];
+	{
+		std::lock_guard<std::mutex> lck(_value_block_mutex);
+		auto pcv = _cid_value_map.find(vcid);
+		if (_cid_value_map.end() != pcv)
+		{
+			_num_value_block_hits++;
+			return pcv->second;
+		}
+	}
+
+	ipfs::Json jblock;
+	{
+		IPFSConnPool::ConnGuard conn(conn_pool);
+		_rpc_stats.timed(IPFSRpcStats::DAG_GET,
+			[&]{ conn->DagGet(vcid, &jblock); });
+	}
+	_num_value_block_fetches++;
+
+	ValuePtr v(decodeStrValue(jblock["value"]));
+
+	std::lock_guard<std::mutex> lck(_value_block_mutex);
+	if (VALUE_BLOCK_CACHE_SIZE <= _cid_value_map.size())
+		_cid_value_map.clear();
+	_cid_value_map.insert({vcid, v});
+	return v;
+}
+
+/// Copy out the key filter. The user predicate, and the parsing of
+/// the keys, are then run without the filter mutex held.
+void IPFSAtomStorage::get_key_filter(KeyAllow& allow,
+                      std::function<bool(const Handle&)>& pred)
+{
+	std::lock_guard<std::mutex> lck(_key_filter_mutex);
+	allow = _key_allow;
+	pred = _key_pred;
+}
+
+/// Decode the key, but only if values on that key are wanted.
+/// Return the null handle, if not. Keys that are not on the
+/// allow-list are rejected without being parsed.
+Handle IPFSAtomStorage::decodeWantedKey(const std::string& skey)
+{
+	KeyAllow allow;
+	std::function<bool(const Handle&)> pred;
+	get_key_filter(allow, pred);
+
+	if (allow and allow->end() == allow->find(skey))
+		return Handle();
+
+	Handle key(decodeStrAtom(skey));
+	if (pred and not pred(key)) return Handle();
+	return key;
+}
+
+/// Return true if TruthValues are wanted. Unlike `decodeWantedKey()`,
+/// this does not need to build or parse any strings.
+bool IPFSAtomStorage::want_tv(void)
+{
+	KeyAllow allow;
+	std::function<bool(const Handle&)> pred;
+	get_key_filter(allow, pred);
+
+	if (allow and allow->end() == allow->find(_tvpred_str))
+		return false;
+	if (pred and not pred(tvpred)) return false;
+	return true;
+}
+
+/* ================================================================ */
+
+/// Load only the values on the listed keys. All other values are
+/// skipped, during `fetch_atom()`, `getIncomingSet()`, `loadType()`
+/// and `loadAtomSpace()`. An empty list removes the restriction.
+/// The restriction applies only to loads; stores are not affected.
+void IPFSAtomStorage::set_value_keys(const HandleSeq& keys)
+{
+	std::shared_ptr<std::set<std::string>> allow;
+	if (0 < keys.size())
+	{
+		allow = std::make_shared<std::set<std::string>>();
+		for (const Handle& key: keys)
+			allow->insert(encodeAtomToStr(key));
+	}
+
+	std::lock_guard<std::mutex> lck(_key_filter_mutex);
+	_key_allow = allow;
+}
+
+/// Load only the values on keys for which the predicate returns
+/// true. This is applied in addition to the key list, if any.
+void IPFSAtomStorage::set_value_key_predicate(
+                      std::function<bool(const Handle&)> pred)
+{
+	std::lock_guard<std::mutex> lck(_key_filter_mutex);
+	_key_pred = pred;
+}
+
+void IPFSAtomStorage::clear_value_key_filter(void)
+{
+	std::lock_guard<std::mutex> lck(_key_filter_mutex);
+	_key_allow = nullptr;
+	_key_pred = nullptr;
+}
+
+bool IPFSAtomStorage::have_key_filter(void)
+{
+	std::lock_guard<std::mutex> lck(_key_filter_mutex);
+	return nullptr != _key_allow or nullptr != _key_pred;
+}
+
 /* ================================================================ */
 
 ValuePtr IPFSAtomStorage::decodeStrValue(const std::string& stv)
@@ -202,22 +582,16 @@ ValuePtr IPFSAtomStorage::decodeStrValue(const std::string& stv)
 		pos += strlen("(FloatValue ");
 		std::vector<double> fv;
 		while (pos != std::string::npos and stv[pos] != ')')
-		{
-			size_t epos;
-			fv.push_back(stod(stv.substr(pos), &epos));
-			pos += epos;
-		}
+			fv.push_back(decodeStrToFloat(stv, pos));
 		return createFloatValue(fv);
 	}
 
 	pos = stv.find("(SimpleTruthValue ");
 	if (std::string::npos != pos)
 	{
-		size_t epos;
 		pos += strlen("(SimpleTruthValue ");
-		double strength = stod(stv.substr(pos), &epos);
-		pos += epos;
-		double confidence = stod(stv.substr(pos), &epos);
+		double strength = decodeStrToFloat(stv, pos);
+		double confidence = decodeStrToFloat(stv, pos);
 		return ValueCast(createSimpleTruthValue(strength, confidence));
 	}
 
@@ -0,0 +1,81 @@
+/* Startup latency benchmark.
+ Open and close the storage many times, and report how long the opens
+ took. This is done for an AtomSpace opened by key name, by IPFS CID
+ and by IPNS name. The first open of a key name is reported apart
+ from the rest, as it might have to look up, or make, the key. Needs
+ a running IPFS daemon.
+
+ Usage: openbench [num-opens] [key-name]
+ */
+
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include <opencog/atomspace/AtomSpace.h>
+
+#include "IPFSAtomStorage.h"
+
+using namespace opencog;
+
+static double elapsed(std::chrono::steady_clock::time_point start)
+{
+	std::chrono::duration<double> secs =
+		std::chrono::steady_clock::now() - start;
+	return secs.count();
+}
+
+/// Open the URI this many times, and print the latencies.
+static void bench(const std::string& what, const std::string& uri,
+                  size_t num_opens)
+{
+	std::vector<double> msecs;
+	for (size_t i = 0; i < num_opens; i++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		IPFSAtomStorage* store = new IPFSAtomStorage(uri);
+		msecs.push_back(1.0e3 * elapsed(start));
+		delete store;
+	}
+	std::sort(msecs.begin(), msecs.end());
+
+	double sum = 0.0;
+	for (double ms : msecs) sum += ms;
+	std::cout << what << ": " << num_opens << " opens, avg "
+	          << sum / num_opens << " msecs, median "
+	          << msecs[num_opens / 2] << " msecs, longest "
+	          << msecs.back() << " msecs" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t num_opens = 100;
+	if (1 < argc) num_opens = std::max(1L, atol(argv[1]));
+	std::string key = "openbench";
+	if (2 < argc) key = argv[2];
+
+	// The first open, which might have to find or make the key.
+	auto start = std::chrono::steady_clock::now();
+	IPFSAtomStorage* store = new IPFSAtomStorage("ipfs:///" + key);
+	double first_msecs = 1.0e3 * elapsed(start);
+	std::string ipns = store->get_ipns_key();
+	std::cout << "First open of " << key << ": " << first_msecs
+	          << " msecs" << std::endl;
+
+	// Something to open by CID.
+	AtomSpace* as = new AtomSpace();
+	store->registerWith(as);
+	store->storeAtom(as->add_node(CONCEPT_NODE, "openbench atom"));
+	store->barrier();
+	std::string ipfs = store->get_ipfs_cid();
+	store->unregisterWith(as);
+	delete as;
+	delete store;
+
+	bench("By key name", "ipfs:///" + key, num_opens);
+	bench("By IPFS CID", "ipfs://" + ipfs, num_opens);
+	bench("By IPNS name", "ipfs://" + ipns, num_opens);
+	return 0;
+}
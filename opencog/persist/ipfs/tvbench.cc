@@ -0,0 +1,219 @@
+/* TruthValue load benchmark.
+ Compare the two encodings of SimpleTruthValues: two doubles under
+ "tv" in the atom block, and, as older code wrote them, a string under
+ "values". First, time the encoding and decoding alone, in-process.
+ Then store a bunch of Atoms, each with a TruthValue, in each of the
+ encodings, and time how long it takes to fetch them back, one at a
+ time, and all at once. Needs a running IPFS daemon.
+
+ Usage: tvbench [num-atoms]
+ */
+
+#include <stdlib.h>
+#include <chrono>
+#include <iostream>
+
+#include <opencog/atoms/truthvalue/SimpleTruthValue.h>
+#include <opencog/atomspace/AtomSpace.h>
+
+#include "IPFSAtomStorage.h"
+
+namespace opencog
+{
+
+static double elapsed(std::chrono::steady_clock::time_point start)
+{
+	std::chrono::duration<double> secs =
+		std::chrono::steady_clock::now() - start;
+	return secs.count();
+}
+
+static TruthValuePtr make_tv(size_t i, size_t num_atoms)
+{
+	return SimpleTruthValue::createTV(
+		((double) i) / num_atoms, 0.5 + ((double) i) / (3 * num_atoms));
+}
+
+static std::string atom_name(size_t i)
+{
+	return "tv atom " + std::to_string(i);
+}
+
+class TVBench
+{
+	IPFSAtomStorage* _store;
+	size_t _num_atoms;
+
+public:
+	TVBench(IPFSAtomStorage* store, size_t num_atoms) :
+		_store(store), _num_atoms(num_atoms) {}
+
+	void encode_decode(void);
+	std::string store_tv(void);
+	std::string store_legacy(void);
+};
+
+/// Time the encoding of the TVs, and their decoding, without any I/O.
+/// The json is printed and parsed, as it is on the way to the daemon
+/// and back.
+void TVBench::encode_decode(void)
+{
+	HandleSeq atoms;
+	for (size_t i = 0; i < _num_atoms; i++)
+	{
+		Handle h(createNode(CONCEPT_NODE, atom_name(i)));
+		h->setTruthValue(make_tv(i, _num_atoms));
+		atoms.push_back(h);
+	}
+
+	double sum = 0.0;
+	auto start = std::chrono::steady_clock::now();
+	for (const Handle& h: atoms)
+	{
+		ipfs::Json jatom;
+		jatom["tv"] = _store->encodeTVToJSON(h);
+		ipfs::Json jtv = ipfs::Json::parse(jatom.dump())["tv"];
+		TruthValuePtr tv(createSimpleTruthValue(
+			jtv[0].get<double>(), jtv[1].get<double>()));
+		sum += tv->get_mean();
+	}
+	double tv_secs = elapsed(start);
+
+	start = std::chrono::steady_clock::now();
+	for (const Handle& h: atoms)
+	{
+		ipfs::Json jvals;
+		jvals[_store->_tvpred_str] =
+			_store->encodeValueToStr(ValueCast(h->getTruthValue()));
+		ipfs::Json jback = ipfs::Json::parse(jvals.dump());
+		TruthValuePtr tv(TruthValueCast(_store->decodeStrValue(
+			jback[_store->_tvpred_str].get<std::string>())));
+		sum += tv->get_mean();
+	}
+	double str_secs = elapsed(start);
+
+	std::cout << "Encoded and decoded " << _num_atoms << " TVs: tv field "
+	          << 1.0e6 * tv_secs / _num_atoms << " usecs/tv; string "
+	          << 1.0e6 * str_secs / _num_atoms << " usecs/tv"
+	          << " (checksum " << sum << ")" << std::endl;
+}
+
+/// Store the atoms with the current encoding. Returns the root CID.
+std::string TVBench::store_tv(void)
+{
+	AtomSpace* as = new AtomSpace();
+	_store->registerWith(as);
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < _num_atoms; i++)
+	{
+		Handle h = as->add_node(CONCEPT_NODE, atom_name(i));
+		h->setTruthValue(make_tv(i, _num_atoms));
+		_store->storeAtom(h);
+	}
+	_store->barrier();
+	double store_secs = elapsed(start);
+
+	_store->unregisterWith(as);
+	delete as;
+
+	std::cout << "Stored " << _num_atoms << " atoms in " << store_secs
+	          << " secs; " << 1.0e6 * store_secs / _num_atoms
+	          << " usecs/atom" << std::endl;
+	return *_store->pin_root();
+}
+
+/// Build a root holding the atoms as older code wrote them, with the
+/// TV printed as a string under "values". Returns the root CID.
+std::string TVBench::store_legacy(void)
+{
+	// Start from the empty directory.
+	ipfs::Client clnt(_store->_hostname, _store->_port);
+	std::string root = "QmUNLLsPACCz1vLxQVkXqqLX5R1X345qqfHbsf67hvA3Nn";
+	auto add = [&](const Handle& h, const ipfs::Json& jatom)
+	{
+		ipfs::Json result;
+		clnt.DagPut(jatom, &result);
+		std::string new_root;
+		clnt.ObjectPatchAddLink(root, h->to_short_string(),
+		                        result["Cid"]["/"], &new_root);
+		root = new_root;
+	};
+
+	add(_store->tvpred, _store->encodeAtomToJSON(_store->tvpred));
+	for (size_t i = 0; i < _num_atoms; i++)
+	{
+		Handle h(createNode(CONCEPT_NODE, atom_name(i)));
+		ipfs::Json jatom = _store->encodeAtomToJSON(h);
+		jatom["values"][_store->_tvpred_str] =
+			_store->encodeValueToStr(ValueCast(make_tv(i, _num_atoms)));
+		add(h, jatom);
+	}
+	return root;
+}
+
+/// Fetch the atoms in the root back, one at a time, and then load
+/// them all at once.
+static void time_loads(const std::string& what, const std::string& cid,
+                       size_t num_atoms)
+{
+	std::cout << what << " AtomSpace CID: " << cid << std::endl;
+
+	IPFSAtomStorage* store = new IPFSAtomStorage("ipfs:///ipfs/" + cid);
+	AtomSpace* as = new AtomSpace();
+	store->registerWith(as);
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < num_atoms; i++)
+		as->fetch_atom(createNode(CONCEPT_NODE, atom_name(i)));
+	double fetch_secs = elapsed(start);
+
+	std::cout << what << ": fetched " << num_atoms << " atoms in "
+	          << fetch_secs << " secs; " << 1.0e6 * fetch_secs / num_atoms
+	          << " usecs/atom" << std::endl;
+
+	store->unregisterWith(as);
+	delete as;
+
+	// Load them all at once. Note that a second run will load from
+	// the local image cache, unless ATOMSPACE_IPFS_CACHE is set to
+	// some fresh, empty directory.
+	as = new AtomSpace();
+	store->registerWith(as);
+
+	start = std::chrono::steady_clock::now();
+	store->loadAtomSpace(as->get_atomtable());
+	double load_secs = elapsed(start);
+
+	std::cout << what << ": loaded " << as->get_size() << " atoms in "
+	          << load_secs << " secs; " << 1.0e6 * load_secs / num_atoms
+	          << " usecs/atom" << std::endl;
+
+	store->unregisterWith(as);
+	delete as;
+	delete store;
+}
+
+} // namespace opencog
+
+using namespace opencog;
+
+int main(int argc, char* argv[])
+{
+	size_t num_atoms = 1000;
+	if (1 < argc) num_atoms = atol(argv[1]);
+
+	IPFSAtomStorage* store = new IPFSAtomStorage("ipfs:///tvbench");
+	TVBench bench(store, num_atoms);
+
+	bench.encode_decode();
+	std::string tv_cid = bench.store_tv();
+	std::string legacy_cid = bench.store_legacy();
+
+	store->print_stats();
+	delete store;
+
+	time_loads("tv field", tv_cid, num_atoms);
+	time_loads("string", legacy_cid, num_atoms);
+	return 0;
+}
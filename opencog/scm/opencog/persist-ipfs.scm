@@ -12,16 +12,24 @@
 	"opencog_persist_ipfs_init")
 
 (export ipfs-clear-stats ipfs-close ipfs-open ipfs-stats
-	ipfs-atom-cid ipfs-fetch-atom ipfs-load-atomspace
+	ipfs-metrics ipfs-metrics-file
+	ipfs-atom-cid ipfs-fetch-atom ipfs-store-value ipfs-fetch-value
+	ipfs-load-atomspace ipfs-load-neighborhood
+	ipfs-cursor-open ipfs-cursor-next ipfs-cursor-position ipfs-cursor-close
 	ipfs-atomspace-cid ipns-atomspace-cid
-	ipfs-publish-atomspace ipfs-resolve-atomspace)
+	ipfs-publish-atomspace ipfs-resolve-atomspace ipfs-ipns-refresh
+	ipfs-value-keys ipfs-value-blocks ipfs-write-combine ipfs-adaptive-flow
+	ipfs-prefetch ipfs-prefetch-depth
+	ipfs-snapshot ipfs-load-snapshot
+	ipfs-sync-atomspace ipfs-merge-atomspace)
 
 (set-procedure-property! ipfs-clear-stats 'documentation
 "
  ipfs-clear-stats - reset the performance statistics counters.
     This will zero out the various counters used to track the
     performance of the IPFS backend.  Statistics will continue to
-    be accumulated.
+    be accumulated.  The counters exported by `ipfs-metrics` are not
+    reset; they keep counting up.
 ")
 
 (set-procedure-property! ipfs-close 'documentation
@@ -42,12 +50,45 @@
      ipfs://HOSTNAME:PORT/KEY-NAME
 
   If no hostname is specified, its assumed to be 'localhost'. If no port
-  is specified, its assumed to be 5001.
+  is specified, its assumed to be 5001. If the IPFS daemon has no key
+  called KEY-NAME, an ed25519 key by that name is made. The key IDs
+  are kept in the cache directory (see below), so that later opens do
+  not have to look for them; remove the cached ID, if the key is ever
+  removed from the daemon.
 
   Examples of use with valid URL's:
      (ipfs-open \"ipfs:///atomspace-test\")
      (ipfs-open \"ipfs://localhost/atomspace-test\")
      (ipfs-open \"ipfs://localhost:5001/atomspace-test\")
+
+  Read-only AtomSpaces can be opened by CID:
+     (ipfs-open \"ipfs:///ipfs/QmT9tZttJ4gVZQwVFHWTmJYqYGAAiKEcvW9k98T5syYeYU\")
+  The first time that such an AtomSpace is loaded, a local image of
+  it is written to the cache directory; later loads of the same CID
+  use that image. The cache directory is $ATOMSPACE_IPFS_CACHE if it
+  is set, else ~/.cache/atomspace-ipfs
+
+  Options may follow the URL, after a question mark:
+     io-threads=N   Number of threads for fetches and stores (default 4)
+     wb-queues=N    Number of write-back queue threads (default 6)
+     read-conns=N   Connections kept for interactive reads (default 2)
+     closure-threshold=N  Unknown atoms in one level of a link, above
+                    which the whole subgraph is fetched at once
+                    (default 16; zero turns this off)
+     announce=N     Announce each new root of the AtomSpace to its other
+                    users, and follow the roots that they announce,
+                    once the IPNS name resolves to them; AtomSpaces
+                    opened by key name never follow. 1 for IPFS pubsub,
+                    2 within this process only (default 0, off). Pubsub
+                    must be enabled in the IPFS daemon, with
+                    --enable-pubsub-experiment.
+     commit=N       With 1, commit each new root with a compare and
+                    swap in a registry shared by the processes on this
+                    host, so that several of them can write to the same
+                    AtomSpace. If another writer committed first, the
+                    changes are rebased onto its root (default 0, off).
+  For example:
+     (ipfs-open \"ipfs:///atomspace-test?io-threads=8&wb-queues=4\")
 ")
 
 (set-procedure-property! ipfs-stats 'documentation
@@ -58,6 +99,34 @@
     and are useful primarily to the developers of the database backend.
 ")
 
+(set-procedure-property! ipfs-metrics 'documentation
+"
+ ipfs-metrics FORMAT - Return the performance statistics as a string.
+    FORMAT is either \"prometheus\", for the Prometheus text format,
+    or \"json\". All of the statistics shown by `ipfs-stats` are
+    included, as well as the number, the failures and the total time
+    of the calls made to the IPFS daemon, by kind. Counters only ever
+    go up, even across `ipfs-clear-stats`; the metrics that can also
+    go down are gauges.
+
+    For example:
+       `(display (ipfs-metrics \"prometheus\"))`
+")
+
+(set-procedure-property! ipfs-metrics-file 'documentation
+"
+ ipfs-metrics-file FILENAME SECS - Write the metrics to a file.
+    The metrics are written to FILENAME every SECS seconds, in the
+    background, until the AtomSpace is closed, or until this is called
+    again with zero SECS. The file is json if FILENAME ends in .json,
+    and otherwise it is in the Prometheus text format, as read by the
+    textfile collector of the Prometheus node exporter. The file is
+    replaced all at once, so it is never seen half-written.
+
+    For example:
+       `(ipfs-metrics-file \"/var/lib/node_exporter/atomspace.prom\" 15)`
+")
+
 (set-procedure-property! ipfs-atom-cid 'documentation
 "
  ipfs-atom-cid ATOM - Return the string CID of the IPFS entry of ATOM.
@@ -84,6 +153,34 @@
      See also `ipfs-atom-cid` for the inverse operation.
 ")
 
+(set-procedure-property! ipfs-store-value 'documentation
+"
+ ipfs-store-value ATOM KEY - Store the Value on KEY on the ATOM.
+     Only this one Value is stored; the other Values on ATOM are not.
+     This is much faster than `store-atom`, when ATOM holds many
+     Values, and only one of them has changed. If ATOM no longer has
+     a Value on KEY, then the stored Value is removed. The store is
+     synchronous; it is done by the time this returns.
+
+     For example:
+        `(ipfs-store-value (Concept "foo") (Predicate "counter"))`
+
+     See also `ipfs-fetch-value`.
+")
+
+(set-procedure-property! ipfs-fetch-value 'documentation
+"
+ ipfs-fetch-value ATOM KEY - Fetch the Value on KEY on the ATOM.
+     Only this one Value is fetched; the other Values on ATOM are not.
+     Returns ATOM, with the Value set on it. If there is no such Value
+     stored, then ATOM is not changed.
+
+     For example:
+        `(ipfs-fetch-value (Concept "foo") (Predicate "counter"))`
+
+     See also `ipfs-store-value`.
+")
+
 (set-procedure-property! ipfs-load-atomspace 'documentation
 "
  ipfs-load-atomspace PATH - Load all Atoms from the PATH into the AtomSpace.
@@ -101,6 +198,63 @@
    See also `ipfs-fetch-atom` for loading individual atoms.
 ")
 
+(set-procedure-property! ipfs-load-neighborhood 'documentation
+"
+ ipfs-load-neighborhood ATOM HOPS - Load ATOM and all within HOPS hops.
+     Loads ATOM, and every Atom that can be reached from it in at most
+     HOPS steps, going either to the Atoms in an outgoing set, or to
+     the Links in an incoming set. The Values on all of these are
+     loaded, too. This is much faster than walking the neighborhood
+     with `fetch-incoming-set` and `fetch-atom`, as the Atoms at each
+     step are fetched all at once. Returns ATOM.
+
+     For example:
+        `(ipfs-load-neighborhood (Concept \"foo\") 2)`
+")
+
+(set-procedure-property! ipfs-cursor-open 'documentation
+"
+ ipfs-cursor-open TOKEN BATCH VALUES? - Start a scan over stored Atoms.
+     Opens a cursor over the Atoms in the stored AtomSpace, without
+     loading them all. TOKEN is either an empty string, to start at
+     the beginning of the current AtomSpace, or a position returned
+     by `ipfs-cursor-position`, to resume a scan. Each call to
+     `ipfs-cursor-next` then returns the next BATCH Atoms, with their
+     Values if VALUES? is #t. The next batch is fetched while the
+     current one is being worked on. Returns the name of the cursor,
+     to be passed to the other cursor calls. Several cursors can be
+     open at once; they stay open until `ipfs-cursor-close` or
+     `ipfs-close`.
+
+     For example:
+        `(define cur (ipfs-cursor-open \"\" 1000 #f))`
+        `(ipfs-cursor-next cur)`
+")
+
+(set-procedure-property! ipfs-cursor-next 'documentation
+"
+ ipfs-cursor-next CURSOR - Return the next batch of Atoms from CURSOR.
+     The Atoms are not added to any AtomSpace, so that scanning a
+     large AtomSpace does not fill up memory. Returns an empty list
+     at the end of the scan.
+     See `ipfs-cursor-open`.
+")
+
+(set-procedure-property! ipfs-cursor-position 'documentation
+"
+ ipfs-cursor-position CURSOR - Return the position of CURSOR.
+     This is a string of the form \"root@offset\". The root is the
+     CID of the AtomSpace being scanned; since that never changes, the
+     scan can be resumed from this position later, even by some other
+     process, with `ipfs-cursor-open`.
+")
+
+(set-procedure-property! ipfs-cursor-close 'documentation
+"
+ ipfs-cursor-close CURSOR - Close CURSOR, releasing the batch it holds.
+     See `ipfs-cursor-open`.
+")
+
 (set-procedure-property! ipfs-atomspace-cid 'documentation
 "
  ipfs-atomspace-cid - Return the string CID of the IPFS entry of the
@@ -149,5 +303,178 @@
      Caution: In the current version of IPFS, resolution can take
      60 seconds or more. This is a well-known IPFS bug; see
      https://github.com/ipfs/go-ipfs/issues/3860
-     for current status.
+     for current status. Because of this, the name is resolved in
+     the background, starting when the AtomSpace is opened, and the
+     last CID that it resolved to is kept in a local cache. This
+     function returns right away, with the last known CID, if there
+     is one; it only waits for the very first resolution of a name.
+     See also `ipfs-ipns-refresh`.
+")
+
+(set-procedure-property! ipfs-ipns-refresh 'documentation
+"
+ ipfs-ipns-refresh BOOL - Follow the IPNS name of the AtomSpace.
+     When on, and the background IPNS resolution finds that the name
+     now resolves to a newer CID than the one that the AtomSpace was
+     loaded from, the AtomSpace is updated to it, in the same way as
+     `ipfs-sync-atomspace` does. Only the changed Atoms are fetched.
+     This is not done if there were local stores since the load, as
+     these would be lost; use `ipfs-merge-atomspace` instead. Off by
+     default. The number of updates is shown by `ipfs-stats`.
+
+     For example:
+        `(ipfs-ipns-refresh #t)`
+")
+
+(set-procedure-property! ipfs-value-keys 'documentation
+"
+ ipfs-value-keys KEY-LIST - Load only the Values on the listed keys.
+     When Atoms are fetched, loaded by type, loaded as part of an
+     incoming set, or when the entire AtomSpace is loaded, only the
+     Values on the keys in KEY-LIST will be loaded; all other Values
+     are skipped. Calling this with an empty list restores the default
+     behavior of loading all Values.
+
+     For example, to load only TruthValues:
+        `(ipfs-value-keys (list (Predicate \"*-TruthValueKey-*\")))`
+     and to load all Values again:
+        `(ipfs-value-keys '())`
+")
+
+(set-procedure-property! ipfs-value-blocks 'documentation
+"
+ ipfs-value-blocks SIZE - Store large Values in blocks of their own.
+     Values whose encoded form is SIZE bytes or longer are stored in
+     separate IPFS blocks, and the Atoms holding them link to these
+     blocks. All Atoms holding the same Value share the same block,
+     and each such block is fetched only once. Use this when many
+     Atoms hold identical Values, such as the same TruthValue or the
+     same category StringValue. A SIZE of zero turns this off, so
+     that all Values are stored inline, in the Atom. This is the
+     default.
+
+     For example:
+        `(ipfs-value-blocks 40)`
+")
+
+(set-procedure-property! ipfs-write-combine 'documentation
+"
+ ipfs-write-combine MSECS - Combine repeated stores of the same Atom.
+     If an Atom is stored again, less than MSECS milliseconds after it
+     was last stored, then the store is held back until MSECS have
+     passed. All further stores of that Atom in the meantime are
+     combined into one: only the state of the Atom at the end of the
+     window is stored. This is useful for Atoms holding counters, or
+     other Values that are updated in bursts. A window of zero turns
+     this off, which is the default. `store-atom` with the synchronous
+     flag, and `ipfs-store-value`, are not affected. The number of
+     combined stores is shown by `ipfs-stats`.
+
+     For example:
+        `(ipfs-write-combine 200)`
+")
+
+(set-procedure-property! ipfs-adaptive-flow 'documentation
+"
+ ipfs-adaptive-flow BOOL - Turn adaptive flow control on or off.
+     When on, the write-back queue is tuned automatically, once a
+     second, based on the store rate, the store latency and the queue
+     depth. The number of writer threads that may talk to the IPFS
+     daemon at once is raised while the latency stays low, and halved
+     when it climbs. The queue watermarks are set so that a full queue
+     drains in about two seconds. If the queue is over the high
+     watermark and still growing, then `store-atom` is made to wait.
+
+     When off, which is the default, all writer threads run, and the
+     watermarks are left as they are. The decisions made are shown by
+     `ipfs-stats`.
+
+     Either way, the number of writers can be capped with the
+     `max-writers` option of the URI, as in
+        `ipfs:///atomspace-key?max-writers=2`
+
+     For example:
+        `(ipfs-adaptive-flow #t)`
+")
+
+(set-procedure-property! ipfs-prefetch 'documentation
+"
+ ipfs-prefetch BYTES - Prefetch the neighbors of incoming sets.
+     When the incoming set of an Atom is fetched, the Atoms in the
+     outgoing sets of the holders are fetched too, in the background,
+     on the guess that a traversal will go there next. They are kept
+     in a cache of at most BYTES bytes of json, from which later
+     fetches are served. Zero turns this off, which is the default.
+     The prefetch hit rate, and the bytes that were prefetched but
+     never used, are shown by `ipfs-stats`.
+
+     For example:
+        `(ipfs-prefetch 50000000)`
+")
+
+(set-procedure-property! ipfs-prefetch-depth 'documentation
+"
+ ipfs-prefetch-depth DEPTH - How far to prefetch.
+     With a DEPTH of 1, the default, only the neighbors themselves are
+     prefetched. With 2, the holders in their incoming sets are, too.
+     Either way, one incoming-set fetch prefetches at most 256 blocks,
+     and at most an eighth of the cache. See `ipfs-prefetch`.
+
+     For example:
+        `(ipfs-prefetch-depth 2)`
+")
+
+(set-procedure-property! ipfs-snapshot 'documentation
+"
+ ipfs-snapshot - Write a packed snapshot of the entire AtomSpace.
+     Returns the CID of the snapshot, for example
+        \"/ipfs/zdpuAy1d...\"
+     The snapshot holds all of the Atoms in the AtomSpace, and all of
+     the Values on them, packed into a handful of large files. It can
+     be loaded much faster than the AtomSpace itself; use
+     `ipfs-load-snapshot` to load it.  The snapshot records the CID of
+     the current AtomSpace (see `ipfs-atomspace-cid`) that it was taken
+     from.
+")
+
+(set-procedure-property! ipfs-load-snapshot 'documentation
+"
+ ipfs-load-snapshot CID - Load all Atoms from the snapshot at CID.
+     The CID must be one that was returned by `ipfs-snapshot`.
+     If a key filter has been set with `ipfs-value-keys`, then only
+     the Values on those keys are loaded.
+")
+
+(set-procedure-property! ipfs-sync-atomspace 'documentation
+"
+ ipfs-sync-atomspace FROM-CID TO-CID - Update the AtomSpace from the
+     contents at FROM-CID to the contents at TO-CID.  Only those Atoms
+     that are new in TO-CID, or whose Values or incoming sets differ
+     between the two, are fetched. This is much faster than
+     `ipfs-load-atomspace`, when only a few Atoms have changed.
+
+     Returns a list of the Atoms that are in FROM-CID but not in
+     TO-CID. These are NOT removed from the AtomSpace; use
+     `cog-extract!` to remove them, if desired.
+
+     For example:
+        `(ipfs-sync-atomspace \"/ipfs/QmT9tZt...\" \"/ipfs/QmVkzxh...\")`
+")
+
+(set-procedure-property! ipfs-merge-atomspace 'documentation
+"
+ ipfs-merge-atomspace BASE OURS THEIRS RULE - Merge two forks of an
+     AtomSpace.  OURS and THEIRS must be AtomSpace CIDs that were both
+     derived from the AtomSpace at the CID BASE.  Returns the CID of
+     the merged AtomSpace.  Only those Atoms that were changed in
+     THEIRS are examined; all other Atoms are never fetched.
+
+     Incoming sets of Atoms changed in both forks are unioned. Values
+     changed in only one fork are taken from that fork. RULE is either
+     \"ours\" or \"theirs\", and says which fork wins, when a Value
+     was changed in both.
+
+     For example:
+        `(ipfs-merge-atomspace \"/ipfs/Qm...base\"
+             \"/ipfs/Qm...ours\" \"/ipfs/Qm...theirs\" \"ours\")`
 ")